@@ -41,6 +41,9 @@ CHECK_CXX_SYMBOL_EXISTS(killpg "sys/types.h;signal.h" HAVE_KILLPG)
 CHECK_CXX_SYMBOL_EXISTS(lrand48_r stdlib.h HAVE_LRAND48_R)
 # mkostemp is in stdlib in glibc and FreeBSD, but unistd on macOS
 CHECK_CXX_SYMBOL_EXISTS(mkostemp "stdlib.h;unistd.h" HAVE_MKOSTEMP)
+# glibc 2.35+ only.
+CHECK_CXX_SYMBOL_EXISTS(posix_spawn_file_actions_addtcsetpgrp_np spawn.h
+    HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP)
 SET(HAVE_CURSES_H ${CURSES_HAVE_CURSES_H})
 SET(HAVE_NCURSES_CURSES_H ${CURSES_HAVE_NCURSES_CURSES_H})
 SET(HAVE_NCURSES_H ${CURSES_HAVE_NCURSES_H})
@@ -58,6 +61,7 @@ CHECK_STRUCT_HAS_MEMBER("struct stat" st_mtimespec.tv_nsec "sys/stat.h"
 CHECK_STRUCT_HAS_MEMBER("struct stat" st_mtim.tv_nsec "sys/stat.h" HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
     LANGUAGE CXX)
 CHECK_CXX_SYMBOL_EXISTS(sys_errlist stdio.h HAVE_SYS_ERRLIST)
+CHECK_INCLUDE_FILE_CXX(sys/inotify.h HAVE_SYS_INOTIFY_H)
 CHECK_INCLUDE_FILE_CXX(sys/ioctl.h HAVE_SYS_IOCTL_H)
 CHECK_INCLUDE_FILE_CXX(sys/select.h HAVE_SYS_SELECT_H)
 CHECK_INCLUDE_FILES("sys/types.h;sys/sysctl.h" HAVE_SYS_SYSCTL_H)
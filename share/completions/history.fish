@@ -1,5 +1,5 @@
 # Note that when a completion file is sourced a new block scope is created so `set -l` works.
-set -l __fish_history_all_commands search delete save merge clear
+set -l __fish_history_all_commands search delete save merge clear convert
 
 # Note that these options are only valid with the "search" and "delete" subcommands.
 complete -c history -n '__fish_seen_subcommand_from search delete' \
@@ -23,3 +23,6 @@ complete -f -c history -n "not __fish_seen_subcommand_from $__fish_history_all_c
     -a merge -d "Incorporate history changes from other sessions"
 complete -f -c history -n "not __fish_seen_subcommand_from $__fish_history_all_commands" \
     -a clear -d "Clears history file"
+complete -f -c history -n "not __fish_seen_subcommand_from $__fish_history_all_commands" \
+    -a convert -d "Rewrites history file in another format"
+complete -f -c history -n "__fish_seen_subcommand_from convert" -a "text binary"
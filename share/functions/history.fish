@@ -68,7 +68,7 @@ function history --description "display or manipulate interactive command histor
     # command. This allows the flags to appear before or after the subcommand.
     if not set -q hist_cmd[1]
         and set -q argv[1]
-        if contains $argv[1] search delete merge save clear
+        if contains $argv[1] search delete merge save clear convert
             set hist_cmd $argv[1]
             set -e argv[1]
         end
@@ -166,6 +166,15 @@ function history --description "display or manipulate interactive command histor
 
             builtin history merge -- $argv
 
+        case convert # rewrite the history file in another format
+            if test -n "$search_mode"
+                or set -q show_time[1]
+                printf (_ "%ls: you cannot use any options with the %ls command\n") $cmd $hist_cmd >&2
+                return 1
+            end
+
+            builtin history convert -- $argv
+
         case clear # clear the interactive command history
             __fish_unexpected_hist_args $argv
             and return 1
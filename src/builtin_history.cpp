@@ -19,12 +19,21 @@
 #include "wgetopt.h"
 #include "wutil.h"  // IWYU pragma: keep
 
-enum hist_cmd_t { HIST_SEARCH = 1, HIST_DELETE, HIST_CLEAR, HIST_MERGE, HIST_SAVE, HIST_UNDEF };
+enum hist_cmd_t {
+    HIST_SEARCH = 1,
+    HIST_DELETE,
+    HIST_CLEAR,
+    HIST_MERGE,
+    HIST_SAVE,
+    HIST_CONVERT,
+    HIST_UNDEF
+};
 
 // Must be sorted by string, not enum or random.
-const enum_map<hist_cmd_t> hist_enum_map[] = {{HIST_CLEAR, L"clear"},   {HIST_DELETE, L"delete"},
-                                              {HIST_MERGE, L"merge"},   {HIST_SAVE, L"save"},
-                                              {HIST_SEARCH, L"search"}, {HIST_UNDEF, NULL}};
+const enum_map<hist_cmd_t> hist_enum_map[] = {
+    {HIST_CLEAR, L"clear"}, {HIST_CONVERT, L"convert"}, {HIST_DELETE, L"delete"},
+    {HIST_MERGE, L"merge"}, {HIST_SAVE, L"save"},       {HIST_SEARCH, L"search"},
+    {HIST_UNDEF, NULL}};
 #define hist_enum_map_len (sizeof hist_enum_map / sizeof *hist_enum_map)
 
 struct history_cmd_opts_t {
@@ -293,6 +302,38 @@ int builtin_history(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
             history->save();
             break;
         }
+        case HIST_CONVERT: {
+            if (opts.history_search_type_defined || opts.show_time_format || opts.null_terminate) {
+                streams.err.append_format(
+                    _(L"%ls: you cannot use any options with the %ls command\n"), cmd,
+                    enum_to_str(opts.hist_cmd, hist_enum_map));
+                status = STATUS_INVALID_ARGS;
+                break;
+            }
+            if (args.size() != 1) {
+                streams.err.append_format(BUILTIN_ERR_ARG_COUNT2, cmd,
+                                          enum_to_str(opts.hist_cmd, hist_enum_map), 1,
+                                          (int)args.size());
+                status = STATUS_INVALID_ARGS;
+                break;
+            }
+            history_file_type_t type;
+            if (args.at(0) == L"text") {
+                type = history_type_fish_2_0;
+            } else if (args.at(0) == L"binary") {
+                type = history_type_binary;
+            } else {
+                streams.err.append_format(_(L"%ls: unknown history format '%ls'\n"), cmd,
+                                          args.at(0).c_str());
+                status = STATUS_INVALID_ARGS;
+                break;
+            }
+            if (!history->convert(type)) {
+                streams.err.append_format(_(L"%ls: could not rewrite the history file\n"), cmd);
+                status = STATUS_CMD_ERROR;
+            }
+            break;
+        }
         case HIST_UNDEF: {
             DIE("Unexpected HIST_UNDEF seen");
             break;
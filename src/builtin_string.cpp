@@ -692,12 +692,10 @@ class string_matcher_t {
 
 class wildcard_matcher_t : public string_matcher_t {
    private:
-    wcstring wcpattern;
+    wildcard_pattern_t pattern;
 
-   public:
-    wildcard_matcher_t(const wchar_t * /*argv0*/, const wchar_t *pattern, const options_t &opts,
-                       io_streams_t &streams)
-        : string_matcher_t(opts, streams), wcpattern(parse_util_unescape_wildcards(pattern)) {
+    static wcstring prepare_pattern(const wchar_t *pattern, const options_t &opts) {
+        wcstring wcpattern = parse_util_unescape_wildcards(pattern);
         if (opts.ignore_case) {
             for (size_t i = 0; i < wcpattern.length(); i++) {
                 wcpattern[i] = towlower(wcpattern[i]);
@@ -707,8 +705,14 @@ class wildcard_matcher_t : public string_matcher_t {
             if (wcpattern.front() != ANY_STRING) wcpattern.insert(0, 1, ANY_STRING);
             if (wcpattern.back() != ANY_STRING) wcpattern.push_back(ANY_STRING);
         }
+        return wcpattern;
     }
 
+   public:
+    wildcard_matcher_t(const wchar_t * /*argv0*/, const wchar_t *pattern, const options_t &opts,
+                       io_streams_t &streams)
+        : string_matcher_t(opts, streams), pattern(prepare_pattern(pattern, opts)) {}
+
     ~wildcard_matcher_t() override = default;
 
     bool report_matches(const wchar_t *arg) override {
@@ -721,9 +725,9 @@ class wildcard_matcher_t : public string_matcher_t {
             for (size_t i = 0; i < s.length(); i++) {
                 s[i] = towlower(s[i]);
             }
-            match = wildcard_match(s, wcpattern, false);
+            match = pattern.match(s);
         } else {
-            match = wildcard_match(arg, wcpattern, false);
+            match = pattern.match(arg);
         }
         if (match ^ opts.invert_match) {
             total_matched++;
@@ -1170,26 +1174,23 @@ static int string_split(parser_t &parser, io_streams_t &streams, int argc, wchar
     return splits.size() > arg_count ? STATUS_CMD_OK : STATUS_CMD_ERROR;
 }
 
-// Helper function to abstract the repeat logic from string_repeat
-// returns the to_repeat string, repeated count times.
-static wcstring wcsrepeat(const wcstring &to_repeat, size_t count) {
-    wcstring repeated;
-    repeated.reserve(to_repeat.length() * count);
-
-    for (size_t j = 0; j < count; j++) {
-        repeated += to_repeat;
+// Helper function to abstract the repeat logic from string_repeat.
+// Appends the to_repeat string to the output, repeated until length chars have been appended. This
+// is done a piece at a time, so that streamed output does not need to be held all at once.
+static void append_repeated(output_stream_t &out, const wcstring &to_repeat, size_t length) {
+    const size_t piece_count =
+        std::max<size_t>(1, output_stream_t::OUTPUT_STREAM_FLUSH_SIZE / to_repeat.length());
+    wcstring piece;
+    piece.reserve(to_repeat.length() * piece_count);
+    for (size_t j = 0; j < piece_count; j++) {
+        piece += to_repeat;
     }
 
-    return repeated;
-}
-
-// Helper function to abstract the repeat until logic from string_repeat
-// returns the to_repeat string, repeated until max char has been reached.
-static wcstring wcsrepeat_until(const wcstring &to_repeat, size_t max) {
-    size_t count = max / to_repeat.length();
-    size_t mod = max % to_repeat.length();
-
-    return wcsrepeat(to_repeat, count) + to_repeat.substr(0, mod);
+    while (length > 0) {
+        size_t amt = std::min(length, piece.length());
+        out.append(piece.c_str(), amt);
+        length -= amt;
+    }
 }
 
 static int string_repeat(parser_t &parser, io_streams_t &streams, int argc, wchar_t **argv) {
@@ -1210,12 +1211,12 @@ static int string_repeat(parser_t &parser, io_streams_t &streams, int argc, wcha
         const wcstring word(to_repeat);
         const bool limit_repeat =
             (opts.max > 0 && word.length() * opts.count > (size_t)opts.max) || !opts.count;
-        const wcstring repeated =
-            limit_repeat ? wcsrepeat_until(word, opts.max) : wcsrepeat(word, opts.count);
-        is_empty = repeated.empty();
+        const size_t repeated_length =
+            limit_repeat ? static_cast<size_t>(opts.max) : word.length() * opts.count;
+        is_empty = repeated_length == 0;
 
         if (!opts.quiet && !is_empty) {
-            streams.out.append(repeated);
+            append_repeated(streams.out, word, repeated_length);
             if (!opts.no_newline) streams.out.append(L"\n");
         }
     }
@@ -205,13 +205,14 @@ int fgetws2(wcstring *s, FILE *f) {
 /// The string may contain embedded nulls.
 ///
 /// This function encodes illegal character sequences in a reversible way using the private use
-/// area.
-static wcstring str2wcs_internal(const char *in, const size_t in_len) {
-    if (in_len == 0) return wcstring();
+/// area. The result is appended to \p out. If \p at_end is false, an incomplete sequence at the end
+/// of the input is left alone. Returns the number of bytes consumed.
+static size_t str2wcs_internal(const char *in, const size_t in_len, bool at_end, wcstring *out) {
+    if (in_len == 0) return 0;
     assert(in != NULL);
 
-    wcstring result;
-    result.reserve(in_len);
+    wcstring &result = *out;
+    result.reserve(result.size() + in_len);
     size_t in_pos = 0;
 
     if (MB_CUR_MAX == 1) {
@@ -220,7 +221,7 @@ static wcstring str2wcs_internal(const char *in, const size_t in_len) {
             result.push_back((unsigned char)in[in_pos]);
             in_pos++;
         }
-        return result;
+        return in_pos;
     }
 
     mbstate_t state = {};
@@ -247,7 +248,8 @@ static wcstring str2wcs_internal(const char *in, const size_t in_len) {
             } else if (wc == INTERNAL_SEPARATOR) {
                 use_encode_direct = true;
             } else if (ret == (size_t)-2) {
-                // Incomplete sequence.
+                // Incomplete sequence. Leave it for the caller to complete, if they can.
+                if (!at_end) break;
                 use_encode_direct = true;
             } else if (ret == (size_t)-1) {
                 // Invalid data.
@@ -278,21 +280,29 @@ static wcstring str2wcs_internal(const char *in, const size_t in_len) {
         }
     }
 
-    return result;
+    return in_pos;
 }
 
-wcstring str2wcstring(const char *in, size_t len) { return str2wcs_internal(in, len); }
+wcstring str2wcstring(const char *in, size_t len) {
+    wcstring result;
+    str2wcs_internal(in, len, true, &result);
+    return result;
+}
 
-wcstring str2wcstring(const char *in) { return str2wcs_internal(in, strlen(in)); }
+wcstring str2wcstring(const char *in) { return str2wcstring(in, strlen(in)); }
 
 wcstring str2wcstring(const std::string &in) {
     // Handles embedded nulls!
-    return str2wcs_internal(in.data(), in.size());
+    return str2wcstring(in.data(), in.size());
 }
 
 wcstring str2wcstring(const std::string &in, size_t len) {
     // Handles embedded nulls!
-    return str2wcs_internal(in.data(), len);
+    return str2wcstring(in.data(), len);
+}
+
+size_t str2wcstring_append(wcstring *out, const char *in, size_t len, bool at_end) {
+    return str2wcs_internal(in, len, at_end, out);
 }
 
 char *wcs2str(const wchar_t *in) {
@@ -17,6 +17,7 @@
 #include <sys/ioctl.h>  // IWYU pragma: keep
 #endif
 
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -38,6 +39,11 @@
 typedef std::wstring wcstring;
 typedef std::vector<wcstring> wcstring_list_t;
 
+// A cancel_checker_t is polled by long running operations (completion, expansion, wildcard
+// matching) which may give up early if it returns true, because the result is no longer wanted. An
+// empty cancel_checker_t never requests cancellation.
+typedef std::function<bool(void)> cancel_checker_t;
+
 // Maximum number of bytes used by a single utf-8 character.
 #define MAX_UTF8_BYTES 6
 
@@ -294,6 +300,11 @@ wcstring str2wcstring(const char *in, size_t len);
 wcstring str2wcstring(const std::string &in);
 wcstring str2wcstring(const std::string &in, size_t len);
 
+/// Like str2wcstring, but appends to \p out, for decoding input that arrives in pieces. If \p at_end
+/// is false, a multibyte sequence that is cut off at the end of the input is left undecoded, to be
+/// passed again with the bytes that complete it. Returns the number of bytes consumed.
+size_t str2wcstring_append(wcstring *out, const char *in, size_t len, bool at_end);
+
 /// Returns a newly allocated multibyte character string equivalent of the specified wide character
 /// string.
 ///
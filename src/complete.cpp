@@ -284,6 +284,8 @@ void completions_sort_and_prioritize(std::vector<completion_t> *comps) {
 class completer_t {
     const completion_request_flags_t flags;
     const wcstring initial_cmd;
+    /// Polled during expansion to find out if our result is still wanted.
+    const cancel_checker_t cancel_checker;
     std::vector<completion_t> completions;
 
     /// Table of completions conditions that have already been tested and the corresponding test
@@ -310,7 +312,11 @@ class completer_t {
     }
 
    public:
-    completer_t(wcstring c, completion_request_flags_t f) : flags(f), initial_cmd(std::move(c)) {}
+    completer_t(wcstring c, completion_request_flags_t f, cancel_checker_t cancel)
+        : flags(f), initial_cmd(std::move(c)), cancel_checker(std::move(cancel)) {}
+
+    /// Indicate whether our caller no longer wants our result.
+    bool cancelled() const { return cancel_checker && cancel_checker(); }
 
     bool empty() const { return completions.empty(); }
     const std::vector<completion_t> &get_completions() { return completions; }
@@ -647,7 +653,7 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
         expand_error_t result = expand_string(str_cmd, &this->completions,
                                               EXPAND_SPECIAL_FOR_COMMAND | EXPAND_FOR_COMPLETIONS |
                                                   EXECUTABLES_ONLY | this->expand_flags(),
-                                              NULL);
+                                              NULL, cancel_checker);
         if (result != EXPAND_ERROR && this->wants_descriptions()) {
             this->complete_cmd_desc(str_cmd);
         }
@@ -658,7 +664,8 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
         // updated with choices for the user.
         expand_error_t ignore =
             expand_string(str_cmd, &this->completions,
-                          EXPAND_FOR_COMPLETIONS | DIRECTORIES_ONLY | this->expand_flags(), NULL);
+                          EXPAND_FOR_COMPLETIONS | DIRECTORIES_ONLY | this->expand_flags(), NULL,
+                          cancel_checker);
         UNUSED(ignore);
     }
 
@@ -1033,7 +1040,8 @@ void completer_t::complete_param_expand(const wcstring &str, bool do_file,
     if (complete_from_separator) {
         const wcstring sep_string = wcstring(str, sep_index + 1);
         std::vector<completion_t> local_completions;
-        if (expand_string(sep_string, &local_completions, flags, NULL) == EXPAND_ERROR) {
+        if (expand_string(sep_string, &local_completions, flags, NULL, cancel_checker) ==
+            EXPAND_ERROR) {
             debug(3, L"Error while expanding string '%ls'", sep_string.c_str());
         }
 
@@ -1052,7 +1060,7 @@ void completer_t::complete_param_expand(const wcstring &str, bool do_file,
         // consider relaxing this if there was a preceding double-dash argument.
         if (string_prefixes_string(L"-", str)) flags &= ~EXPAND_FUZZY_MATCH;
 
-        if (expand_string(str, &this->completions, flags, NULL) == EXPAND_ERROR) {
+        if (expand_string(str, &this->completions, flags, NULL, cancel_checker) == EXPAND_ERROR) {
             debug(3, L"Error while expanding string '%ls'", str.c_str());
         }
     }
@@ -1221,7 +1229,7 @@ bool completer_t::try_complete_user(const wcstring &str) {
 }
 
 void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_comps,
-              completion_request_flags_t flags) {
+              completion_request_flags_t flags, const cancel_checker_t &cancel) {
     // Determine the innermost subcommand.
     const wchar_t *cmdsubst_begin, *cmdsubst_end;
     parse_util_cmdsubst_extent(cmd_with_subcmds.c_str(), cmd_with_subcmds.size(), &cmdsubst_begin,
@@ -1230,7 +1238,7 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_c
     const wcstring cmd = wcstring(cmdsubst_begin, cmdsubst_end - cmdsubst_begin);
 
     // Make our completer.
-    completer_t completer(cmd, flags);
+    completer_t completer(cmd, flags, cancel);
 
     wcstring current_command;
     const size_t pos = cmd.size();
@@ -1419,7 +1427,8 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_c
                         do_file = true;
                         const wcstring_list_t wrap_chain =
                             complete_get_wrap_chain(current_command_unescape);
-                        for (size_t i = 0; i < wrap_chain.size(); i++) {
+                        for (size_t i = 0; i < wrap_chain.size() && !completer.cancelled();
+                             i++) {
                             // Hackish, this. The first command in the chain is always the given
                             // command. For every command past the first, we need to create a
                             // transient commandline for builtin_commandline. But not for
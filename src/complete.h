@@ -159,9 +159,11 @@ void complete_remove(const wcstring &cmd, bool cmd_is_path, const wcstring &opti
 /// Removes all completions for a given command.
 void complete_remove_all(const wcstring &cmd, bool cmd_is_path);
 
-/// Find all completions of the command cmd, insert them into out.
+/// Find all completions of the command cmd, insert them into out. If cancel is set, it is polled
+/// while completing; once it returns true, completion stops early and out may be incomplete.
 void complete(const wcstring &cmd, std::vector<completion_t> *out_comps,
-              completion_request_flags_t flags);
+              completion_request_flags_t flags,
+              const cancel_checker_t &cancel = cancel_checker_t());
 
 /// Return a list of all current completions.
 wcstring complete_print();
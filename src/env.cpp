@@ -31,6 +31,7 @@
 
 #include <algorithm>
 #include <iterator>
+#include <map>
 #include <set>
 #include <type_traits>
 #include <unordered_map>
@@ -149,14 +150,34 @@ class env_node_t {
     /// in the stack are invisible. If new_scope is set for the global variable node, the universe
     /// will explode.
     bool new_scope;
-    /// Does this node contain any variables which are exported to subshells
-    /// or does it redefine any variables to not be exported?
-    bool exportv = false;
+    /// A node below this one whose exported variables are visible here, as if they had been copied
+    /// into this node, unless this node defines a variable with the same name. This is how a new
+    /// scope sees the exported locals of its caller without copying them. The node is hidden below
+    /// us for as long as we exist, so its variables can't change.
+    const env_node_t *exported_from = NULL;
     /// Pointer to next level.
     std::unique_ptr<env_node_t> next;
 
+    /// Return the variable with the given name in this node, including exported variables it
+    /// inherits, or NULL if there is none.
+    const env_var_t *find_var(const wcstring &key) const;
+
     maybe_t<env_var_t> find_entry(const wcstring &key);
 
+    /// Calls func(key, var) for each variable in this node, including those it inherits.
+    template <typename Func>
+    void for_each_var(const Func &func) const {
+        for (const auto &entry : env) func(entry.first, entry.second);
+        for (const env_node_t *from = exported_from; from != NULL; from = from->exported_from) {
+            for (const auto &entry : from->env) {
+                if (find_var(entry.first) == &entry.second) func(entry.first, entry.second);
+            }
+        }
+    }
+
+    /// Copy the variables this node inherits into it and stop inheriting, so they can be erased.
+    void copy_inherited_exports();
+
     bool contains_any_of(const wcstring_list_t &vars) const;
 };
 
@@ -166,8 +187,6 @@ class variable_entry_t {
 
 static fish_mutex_t env_lock;
 
-static bool local_scope_exports(const env_node_t *n);
-
 // A class wrapping up a variable stack
 // Currently there is only one variable stack in fish,
 // but we can imagine having separate (linked) stacks
@@ -180,12 +199,35 @@ struct var_stack_t {
     // This is an observer pointer
     env_node_t *global_env = NULL;
 
-    // Exported variable array used by execv.
+    // Exported variable array used by execv. This is assembled from export_cache.
     null_terminated_array_t<char> export_array;
 
-    /// Flag for checking if we need to regenerate the exported variable array.
-    bool has_changed_exported = true;
-    void mark_changed_exported() { has_changed_exported = true; }
+    /// Every exported variable, encoded as "name=value" the way execv wants it. This is patched one
+    /// variable at a time as variables change, so that updating export_array does not re-encode
+    /// variables which did not change. It is sorted, so the order of the environment is stable.
+    std::map<wcstring, std::string> export_cache;
+
+    /// Names of variables whose entry in export_cache may be stale.
+    std::unordered_set<wcstring> changed_exports;
+
+    /// Set if any entry in export_cache may be stale, e.g. before it is first built.
+    bool all_exports_changed = true;
+
+    /// Note that the variable with the given name may have changed its exported value.
+    void mark_changed_exported(const wcstring &key) { changed_exports.insert(key); }
+
+    /// Note that the variables in the local scopes visible from node may have changed their
+    /// exported value, because those scopes are being hidden or revealed.
+    void mark_local_scopes_changed_exported(const env_node_t *node);
+
+    /// Return whether hiding or revealing the given variable of the given node may change what we
+    /// export under its name. That is the case if it is exported, or hides a variable that is.
+    bool var_affects_exports(const env_node_t *node, const wcstring &key,
+                             const env_var_t &var) const;
+
+    /// Return the variable we export under the given name, if any.
+    maybe_t<env_var_t> get_exported_var(const wcstring &key) const;
+
     void update_export_array_if_necessary();
 
     var_stack_t() : top(new env_node_t(false)) { this->global_env = this->top.get(); }
@@ -210,20 +252,37 @@ struct var_stack_t {
 void var_stack_t::push(bool new_scope) {
     std::unique_ptr<env_node_t> node(new env_node_t(new_scope));
 
-    // Copy local-exported variables.
+    // Inherit local-exported variables.
     auto top_node = top.get();
     // Only if we introduce a new shadowing scope; i.e. not if it's just `begin; end` or
     // "--no-scope-shadowing".
     if (new_scope && top_node != this->global_env) {
-        for (const auto &var : top_node->env) {
-            if (var.second.exports()) node->env.insert(var);
+        // Link to the top node only if it changes what we would inherit from further down. This
+        // keeps the chain short in recursive functions which don't export anything.
+        bool contributes = false;
+        for (const auto &entry : top_node->env) {
+            if (entry.second.exports() ||
+                (top_node->exported_from && top_node->exported_from->find_var(entry.first))) {
+                contributes = true;
+                break;
+            }
         }
+        node->exported_from = contributes ? top_node : top_node->exported_from;
     }
 
+    // A new scope hides the local scopes below it.
+    if (new_scope) this->mark_local_scopes_changed_exported(top_node);
+
     node->next = std::move(this->top);
     this->top = std::move(node);
-    if (new_scope && local_scope_exports(this->top.get())) {
-        this->mark_changed_exported();
+}
+
+void var_stack_t::mark_local_scopes_changed_exported(const env_node_t *node) {
+    for (; node != NULL && node != this->global_env; node = node->next.get()) {
+        node->for_each_var([&](const wcstring &key, const env_var_t &var) {
+            if (this->var_affects_exports(node, key, var)) this->mark_changed_exported(key);
+        });
+        if (node->new_scope) break;
     }
 }
 
@@ -246,11 +305,14 @@ void var_stack_t::pop() {
     bool locale_changed = top->contains_any_of(locale_variables);
     bool curses_changed = top->contains_any_of(curses_variables);
 
-    if (top->new_scope) {  //!OCLINT(collapsible if statements)
-        if (top->exportv || local_scope_exports(top->next.get())) {
-            this->mark_changed_exported();
+    // Variables in the popped node go away, and if it was a new scope, the local scopes below it
+    // become visible again.
+    for (const auto &entry : top->env) {
+        if (this->var_affects_exports(top.get(), entry.first, entry.second)) {
+            this->mark_changed_exported(entry.first);
         }
     }
+    if (top->new_scope) this->mark_local_scopes_changed_exported(top->next.get());
 
     // Actually do the pop! Move the top pointer into a local variable, then replace the top pointer
     // with the next pointer afterwards we should have a node with no next pointer, and our top
@@ -261,14 +323,6 @@ void var_stack_t::pop() {
     assert(this->top && old_top && !old_top->next);
     assert(this->top != NULL);
 
-    for (const auto &entry_pair : old_top->env) {
-        const env_var_t &var = entry_pair.second;
-        if (var.exports()) {
-            this->mark_changed_exported();
-            break;
-        }
-    }
-
     if (locale_changed) init_locale();
     if (curses_changed) init_curses();
 }
@@ -309,6 +363,28 @@ static env_universal_t *s_universal_variables = NULL;
 /// Getter for universal variables.
 static env_universal_t *uvars() { return s_universal_variables; }
 
+bool var_stack_t::var_affects_exports(const env_node_t *node, const wcstring &key,
+                                      const env_var_t &var) const {
+    if (var.exports()) return true;
+
+    // Find what the variable hides: an exported variable the node inherits, or else whatever is
+    // visible below it.
+    if (node->exported_from) {
+        const env_var_t *inherited = node->exported_from->find_var(key);
+        if (inherited && inherited->exports()) return true;
+    }
+    for (node = this->next_scope_to_search(node); node != NULL;
+         node = this->next_scope_to_search(node)) {
+        const env_var_t *hidden = node->find_var(key);
+        if (hidden) {
+            if (hidden->exports()) return true;
+            break;
+        }
+    }
+    // An unexported variable does not hide an exported universal from the export table.
+    return uvars() && uvars()->get_export(key);
+}
+
 // Helper class for storing constant strings, without needing to wrap them in a wcstring.
 
 // Comparer for const string set.
@@ -358,12 +434,33 @@ static bool is_electric(const wcstring &key) {
     return env_electric.find(key) != env_electric.end();
 }
 
-maybe_t<env_var_t> env_node_t::find_entry(const wcstring &key) {
+const env_var_t *env_node_t::find_var(const wcstring &key) const {
     var_table_t::const_iterator entry = env.find(key);
-    if (entry != env.end()) return entry->second;
+    if (entry != env.end()) return &entry->second;
+
+    // An inherited variable is hidden by an unexported one of the same name in a nearer node.
+    for (const env_node_t *from = exported_from; from != NULL; from = from->exported_from) {
+        entry = from->env.find(key);
+        if (entry != from->env.end()) return entry->second.exports() ? &entry->second : NULL;
+    }
+    return NULL;
+}
+
+maybe_t<env_var_t> env_node_t::find_entry(const wcstring &key) {
+    const env_var_t *var = find_var(key);
+    if (var) return *var;
     return none();
 }
 
+void env_node_t::copy_inherited_exports() {
+    var_table_t inherited;
+    for_each_var([&](const wcstring &key, const env_var_t &var) {
+        if (!env.count(key)) inherited.insert(std::make_pair(key, var));
+    });
+    exported_from = NULL;
+    env.insert(inherited.begin(), inherited.end());
+}
+
 /// Return the current umask value.
 static mode_t get_umask() {
     mode_t res;
@@ -649,7 +746,7 @@ static void universal_callback(fish_message_type_t type, const wchar_t *name) {
     }
 
     react_to_variable_change(op, name);
-    vars_stack().mark_changed_exported();
+    vars_stack().mark_changed_exported(name);
 
     event_t ev = event_t::variable_event(name);
     ev.arguments.push_back(L"VARIABLE");
@@ -1027,7 +1124,7 @@ void env_init(const struct config_paths_t *paths /* or NULL */) {
 static env_node_t *env_get_node(const wcstring &key) {
     env_node_t *env = vars_stack().top.get();
     while (env != NULL) {
-        if (env->find_entry(key)) break;
+        if (env->find_var(key)) break;
         env = vars_stack().next_scope_to_search(env);
     }
     return env;
@@ -1063,7 +1160,6 @@ static int set_umask(const wcstring_list_t &list_val) {
 /// * ENV_INVALID, the variable value was invalid. This applies only to special variables.
 static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcstring_list_t val) {
     ASSERT_IS_MAIN_THREAD();
-    bool has_changed_old = vars_stack().has_changed_exported;
     int done = 0;
 
     if (val.size() == 1 && (key == L"PWD" || key == L"HOME")) {
@@ -1107,22 +1203,17 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
             uvars()->set(key, val, new_export);
             env_universal_barrier();
             if (old_export || new_export) {
-                vars_stack().mark_changed_exported();
+                vars_stack().mark_changed_exported(key);
             }
         }
     } else {
         // Determine the node.
-        bool has_changed_new = false;
         env_node_t *preexisting_node = env_get_node(key);
         bool preexisting_entry_exportv = false;
         if (preexisting_node != NULL) {
-            var_table_t::const_iterator result = preexisting_node->env.find(key);
-            assert(result != preexisting_node->env.end());
-            const env_var_t &var = result->second;
-            if (var.exports()) {
-                preexisting_entry_exportv = true;
-                has_changed_new = true;
-            }
+            const env_var_t *var = preexisting_node->find_var(key);
+            assert(var != NULL);
+            preexisting_entry_exportv = var->exports();
         }
 
         env_node_t *node = NULL;
@@ -1154,6 +1245,7 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
                 }
                 uvars()->set(key, val, exportv);
                 env_universal_barrier();
+                vars_stack().mark_changed_exported(key);
                 done = 1;
 
             } else {
@@ -1166,26 +1258,11 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
             // Set the entry in the node. Note that operator[] accesses the existing entry, or
             // creates a new one.
             env_var_t &var = node->env[key];
-            if (var.exports()) {
-                // This variable already existed, and was exported.
-                has_changed_new = true;
-            }
-
             var.set_vals(std::move(val));
+            var.set_exports(var_mode & ENV_EXPORT);
 
-            if (var_mode & ENV_EXPORT) {
-                // The new variable is exported.
-                var.set_exports(true);
-                node->exportv = true;
-                has_changed_new = true;
-            } else {
-                var.set_exports(false);
-                // Set the node's exported when it changes something about exports
-                // (also when it redefines a variable to not be exported).
-                node->exportv = has_changed_old != has_changed_new;
-            }
-
-            if (has_changed_old || has_changed_new) vars_stack().mark_changed_exported();
+            // Even an unexported variable may hide an exported one.
+            vars_stack().mark_changed_exported(key);
         }
     }
 
@@ -1228,12 +1305,16 @@ static bool try_remove(env_node_t *n, const wchar_t *key, int var_mode) {
         return false;
     }
 
-    var_table_t::iterator result = n->env.find(key);
-    if (result != n->env.end()) {
-        if (result->second.exports()) {
-            vars_stack().mark_changed_exported();
+    if (n->find_var(key)) {
+        // Even an unexported variable may have hidden an exported one.
+        vars_stack().mark_changed_exported(key);
+        n->env.erase(key);
+        if (n->find_var(key)) {
+            // The variable is also inherited, and we can't erase it from the node we inherit it
+            // from.
+            n->copy_inherited_exports();
+            n->env.erase(key);
         }
-        n->env.erase(result);
         return true;
     }
 
@@ -1286,7 +1367,7 @@ int env_remove(const wcstring &key, int var_mode) {
             event_fire(&ev);
         }
 
-        if (is_exported) vars_stack().mark_changed_exported();
+        if (is_exported) vars_stack().mark_changed_exported(key);
     }
 
     react_to_variable_change(L"ERASE", key);
@@ -1294,17 +1375,22 @@ int env_remove(const wcstring &key, int var_mode) {
     return !erased;
 }
 
-const wcstring_list_t &env_var_t::as_list() const { return vals; }
+const std::shared_ptr<const wcstring_list_t> &env_var_t::empty_list() {
+    static const auto s_empty_list = std::make_shared<const wcstring_list_t>();
+    return s_empty_list;
+}
+
+const wcstring_list_t &env_var_t::as_list() const { return *vals; }
 
 /// Return a string representation of the var. At the present time this uses the legacy 2.x
 /// encoding.
 wcstring env_var_t::as_string() const {
-    if (this->vals.empty()) return wcstring(ENV_NULL);
+    if (this->vals->empty()) return wcstring(ENV_NULL);
 
     wchar_t sep = (flags & flag_colon_delimit) ? L':' : ARRAY_SEP;
-    auto it = this->vals.cbegin();
+    auto it = this->vals->cbegin();
     wcstring result(*it);
-    while (++it != vals.end()) {
+    while (++it != vals->cend()) {
         result.push_back(sep);
         result.append(*it);
     }
@@ -1312,7 +1398,7 @@ wcstring env_var_t::as_string() const {
 }
 
 void env_var_t::to_list(wcstring_list_t &out) const {
-    out = vals;
+    out = *vals;
 }
 
 env_var_t::env_var_flags_t env_var_t::flags_for(const wchar_t *name) {
@@ -1367,12 +1453,9 @@ maybe_t<env_var_t> env_get(const wcstring &key, env_mode_flags_t mode) {
                 break;
             }
 
-            var_table_t::const_iterator result = env->env.find(key);
-            if (result != env->env.end()) {
-                const env_var_t &var = result->second;
-                if (var.exports() ? search_exported : search_unexported) {
-                    return var;
-                }
+            const env_var_t *var = env->find_var(key);
+            if (var && (var->exports() ? search_exported : search_unexported)) {
+                return *var;
             }
             env = vars_stack().next_scope_to_search(env);
         }
@@ -1401,33 +1484,19 @@ maybe_t<env_var_t> env_get(const wcstring &key, env_mode_flags_t mode) {
 
 /// Returns true if the specified scope or any non-shadowed non-global subscopes contain an exported
 /// variable.
-static bool local_scope_exports(const env_node_t *n) {
-    assert(n != NULL);
-    if (n == vars_stack().global_env) return false;
-
-    if (n->exportv) return true;
-
-    if (n->new_scope) return false;
-
-    return local_scope_exports(n->next.get());
-}
-
 void env_push(bool new_scope) { vars_stack().push(new_scope); }
 
 void env_pop() { vars_stack().pop(); }
 
-/// Function used with to insert keys of one table into a set::set<wcstring>.
-static void add_key_to_string_set(const var_table_t &envs, std::set<wcstring> *str_set,
+/// Function used with to insert keys of one node into a set::set<wcstring>.
+static void add_key_to_string_set(const env_node_t *node, std::set<wcstring> *str_set,
                                   bool show_exported, bool show_unexported) {
-    var_table_t::const_iterator iter;
-    for (iter = envs.begin(); iter != envs.end(); ++iter) {
-        const env_var_t &var = iter->second;
-
+    node->for_each_var([&](const wcstring &key, const env_var_t &var) {
         if ((var.exports() && show_exported) || (!var.exports() && show_unexported)) {
             // Insert this key.
-            str_set->insert(iter->first);
+            str_set->insert(key);
         }
-    }
+    });
 }
 
 wcstring_list_t env_get_names(int flags) {
@@ -1451,7 +1520,7 @@ wcstring_list_t env_get_names(int flags) {
         while (n) {
             if (n == vars_stack().global_env) break;
 
-            add_key_to_string_set(n->env, &names, show_exported, show_unexported);
+            add_key_to_string_set(n, &names, show_exported, show_unexported);
             if (n->new_scope)
                 break;
             else
@@ -1460,7 +1529,7 @@ wcstring_list_t env_get_names(int flags) {
     }
 
     if (show_global) {
-        add_key_to_string_set(vars_stack().global_env->env, &names, show_exported, show_unexported);
+        add_key_to_string_set(vars_stack().global_env, &names, show_exported, show_unexported);
         if (show_unexported) {
             result.insert(result.end(), env_electric.begin(), env_electric.end());
         }
@@ -1475,8 +1544,11 @@ wcstring_list_t env_get_names(int flags) {
     return result;
 }
 
+/// Exported variables by name. This is sorted, so the environment we pass to children is stable.
+typedef std::map<wcstring, env_var_t> export_table_t;
+
 /// Get list of all exported variables.
-static void get_exported(const env_node_t *n, var_table_t &h) {
+static void get_exported(const env_node_t *n, export_table_t &h) {
     if (!n) return;
 
     if (n->new_scope) {
@@ -1485,11 +1557,7 @@ static void get_exported(const env_node_t *n, var_table_t &h) {
         get_exported(n->next.get(), h);
     }
 
-    var_table_t::const_iterator iter;
-    for (iter = n->env.begin(); iter != n->env.end(); ++iter) {
-        const wcstring &key = iter->first;
-        const env_var_t var = iter->second;
-
+    n->for_each_var([&](const wcstring &key, const env_var_t &var) {
         if (var.exports()) {
             // Export the variable. Don't use std::map::insert here, since we need to overwrite
             // existing values from previous scopes.
@@ -1499,63 +1567,95 @@ static void get_exported(const env_node_t *n, var_table_t &h) {
             // exported. See #2132.
             h.erase(key);
         }
-    }
+    });
 }
 
-// Given a map from key to value, add values to out of the form key=value.
-static void export_func(const var_table_t &envs, std::vector<std::string> &out) {
-    out.reserve(out.size() + envs.size());
-    for (auto iter = envs.begin(); iter != envs.end(); ++iter) {
-        const wcstring &key = iter->first;
-        const std::string &ks = wcs2string(key);
-        std::string vs = wcs2string(iter->second.as_string());
+/// Encode a variable as a "key=value" string for the environment of a child process.
+static std::string encode_export_entry(const wcstring &key, const env_var_t &var) {
+    std::string str = wcs2string(key);
+    std::string vs = wcs2string(var.as_string());
 
-        // Arrays in the value are ASCII record separator (0x1e) delimited. But some variables
-        // should have colons. Add those.
-        if (variable_is_colon_delimited_var(key)) {
-            // Replace ARRAY_SEP with colon.
-            std::replace(vs.begin(), vs.end(), (char)ARRAY_SEP, ':');
-        }
+    // Arrays in the value are ASCII record separator (0x1e) delimited. But some variables
+    // should have colons. Add those.
+    if (variable_is_colon_delimited_var(key)) {
+        // Replace ARRAY_SEP with colon.
+        std::replace(vs.begin(), vs.end(), (char)ARRAY_SEP, ':');
+    }
+
+    str.reserve(str.size() + 1 + vs.size());
+    str.append("=");
+    str.append(vs);
+    return str;
+}
 
-        // Put a string on the vector.
-        out.push_back(std::string());
-        std::string &str = out.back();
-        str.reserve(ks.size() + 1 + vs.size());
+maybe_t<env_var_t> var_stack_t::get_exported_var(const wcstring &key) const {
+    // The innermost visible definition wins. If it is not exported it hides any exported variable
+    // further down the stack (see #2132), but, as in the full rebuild, not an exported universal.
+    for (const env_node_t *node = this->top.get(); node != NULL;
+         node = this->next_scope_to_search(node)) {
+        const env_var_t *var = node->find_var(key);
+        if (var) {
+            if (var->exports()) return *var;
+            break;
+        }
+    }
 
-        // Append our environment variable data to it.
-        str.append(ks);
-        str.append("=");
-        str.append(vs);
+    if (uvars() && uvars()->get_export(key)) {
+        auto var = uvars()->get(key);
+        if (!var.missing_or_empty()) return std::move(*var);
     }
+    return none();
 }
 
 void var_stack_t::update_export_array_if_necessary() {
-    if (!this->has_changed_exported) {
+    if (!this->all_exports_changed && this->changed_exports.empty()) {
         return;
     }
 
-    debug(4, L"env_export_arr() recalc");
-    var_table_t vals;
-    get_exported(this->top.get(), vals);
+    if (this->all_exports_changed) {
+        debug(4, L"env_export_arr() recalc");
+        export_table_t vals;
+        get_exported(this->top.get(), vals);
 
-    if (uvars()) {
-        const wcstring_list_t uni = uvars()->get_names(true, false);
-        for (size_t i = 0; i < uni.size(); i++) {
-            const wcstring &key = uni.at(i);
-            auto var = uvars()->get(key);
-
-            if (!var.missing_or_empty()) {
-                // Note that std::map::insert does NOT overwrite a value already in the map,
-                // which we depend on here.
-                vals.insert(std::pair<wcstring, env_var_t>(key, *var));
+        if (uvars()) {
+            const wcstring_list_t uni = uvars()->get_names(true, false);
+            for (size_t i = 0; i < uni.size(); i++) {
+                const wcstring &key = uni.at(i);
+                auto var = uvars()->get(key);
+
+                if (!var.missing_or_empty()) {
+                    // Note that std::map::insert does NOT overwrite a value already in the map,
+                    // which we depend on here.
+                    vals.insert(std::pair<wcstring, env_var_t>(key, *var));
+                }
+            }
+        }
+
+        this->export_cache.clear();
+        for (const auto &kv : vals) {
+            this->export_cache[kv.first] = encode_export_entry(kv.first, kv.second);
+        }
+    } else {
+        // Only re-encode the variables which may have changed.
+        debug(4, L"env_export_arr() update %lu vars", (unsigned long)changed_exports.size());
+        for (const wcstring &key : this->changed_exports) {
+            maybe_t<env_var_t> var = this->get_exported_var(key);
+            if (var) {
+                this->export_cache[key] = encode_export_entry(key, *var);
+            } else {
+                this->export_cache.erase(key);
             }
         }
     }
+    this->all_exports_changed = false;
+    this->changed_exports.clear();
 
     std::vector<std::string> local_export_buffer;
-    export_func(vals, local_export_buffer);
+    local_export_buffer.reserve(this->export_cache.size());
+    for (const auto &kv : this->export_cache) {
+        local_export_buffer.push_back(kv.second);
+    }
     export_array.set(local_export_buffer);
-    has_changed_exported = false;
 }
 
 const char *const *env_export_arr() {
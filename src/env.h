@@ -8,6 +8,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "common.h"
@@ -71,9 +72,14 @@ void misc_init();
 class env_var_t {
    private:
     using env_var_flags_t = uint8_t;
-    wcstring_list_t vals;  // list of values assigned to the var
+    // The list of values assigned to the var. This is immutable and shared between copies, so
+    // copying a variable is cheap however many values it has. It is never null.
+    std::shared_ptr<const wcstring_list_t> vals;
     env_var_flags_t flags;
 
+    // Return the shared empty list.
+    static const std::shared_ptr<const wcstring_list_t> &empty_list();
+
    public:
     enum {
         flag_export = 1 << 0,         // whether the variable is exported
@@ -84,7 +90,8 @@ class env_var_t {
     // Constructors.
     env_var_t(const env_var_t &) = default;
     env_var_t(env_var_t &&) = default;
-    env_var_t(wcstring_list_t vals, env_var_flags_t flags) : vals(std::move(vals)), flags(flags) {}
+    env_var_t(wcstring_list_t vals, env_var_flags_t flags)
+        : vals(std::make_shared<const wcstring_list_t>(std::move(vals))), flags(flags) {}
     env_var_t(wcstring val, env_var_flags_t flags)
         : env_var_t(wcstring_list_t{std::move(val)}, flags) {}
 
@@ -93,9 +100,9 @@ class env_var_t {
         : env_var_t(std::move(vals), flags_for(name)) {}
     env_var_t(const wchar_t *name, wcstring val) : env_var_t(std::move(val), flags_for(name)) {}
 
-    env_var_t() = default;
+    env_var_t() : vals(empty_list()), flags(0) {}
 
-    bool empty() const { return vals.empty() || (vals.size() == 1 && vals[0].empty()); };
+    bool empty() const { return vals->empty() || (vals->size() == 1 && vals->front().empty()); };
     bool read_only() const { return flags & flag_read_only; }
     bool exports() const { return flags & flag_export; }
 
@@ -103,7 +110,10 @@ class env_var_t {
     void to_list(wcstring_list_t &out) const;
     const wcstring_list_t &as_list() const;
 
-    void set_vals(wcstring_list_t v) { vals = std::move(v); }
+    // Replace the values. Copies of this variable keep the old ones.
+    void set_vals(wcstring_list_t v) {
+        vals = std::make_shared<const wcstring_list_t>(std::move(v));
+    }
 
     void set_exports(bool exportv) {
         if (exportv) {
@@ -118,8 +128,10 @@ class env_var_t {
     env_var_t &operator=(const env_var_t &var) = default;
     env_var_t &operator=(env_var_t &&) = default;
 
-    bool operator==(const env_var_t &var) const { return vals == var.vals; }
-    bool operator!=(const env_var_t &var) const { return vals != var.vals; }
+    bool operator==(const env_var_t &var) const {
+        return vals == var.vals || *vals == *var.vals;
+    }
+    bool operator!=(const env_var_t &var) const { return !(*this == var); }
 };
 
 /// This is used to convert a serialized env_var_t back into a list.
@@ -200,7 +212,9 @@ class env_vars_snapshot_t {
 extern int g_fork_count;
 extern bool g_use_posix_spawn;
 
-typedef std::map<wcstring, env_var_t> var_table_t;
+/// A table of variables by name. This is unordered, for fast lookup; anything which lists variables
+/// must sort them itself.
+typedef std::unordered_map<wcstring, env_var_t> var_table_t;
 
 extern bool term_has_xn;  // does the terminal have the "eat_newline_glitch"
 
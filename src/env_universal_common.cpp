@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <wchar.h>
 
+#include <algorithm>
 #include <atomic>
 #include <map>
 #include <string>
@@ -50,6 +51,10 @@
 #include <notify.h>
 #endif
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #ifdef __HAIKU__
 #define _BSD_SOURCE
 #include <bsd/ifaddrs.h>
@@ -67,6 +72,13 @@
 /// Non-wide version of the set_export command.
 #define SET_EXPORT_MBS "SET_EXPORT"
 
+/// The journal is compacted once it holds this many more records than twice the number of
+/// variables.
+#define JOURNAL_COMPACTION_SLACK 64
+
+/// How many bytes before the last read offset we remember to recognize the journal.
+#define JOURNAL_TAIL_SIZE 64
+
 /// Error message.
 #define PARSE_ERR L"Unable to parse universal variable message: '%ls'"
 
@@ -256,7 +268,11 @@ static bool append_file_entry(fish_message_type_t type, const wcstring &key_in,
 }
 
 env_universal_t::env_universal_t(wcstring path)
-    : explicit_vars_path(std::move(path)), tried_renaming(false), last_read_file(kInvalidFileID) {}
+    : explicit_vars_path(std::move(path)),
+      tried_renaming(false),
+      last_read_file(kInvalidFileID),
+      last_read_offset(0),
+      journal_records(0) {}
 
 maybe_t<env_var_t> env_universal_t::get(const wcstring &name) const {
     var_table_t::const_iterator where = vars.find(name);
@@ -323,6 +339,7 @@ wcstring_list_t env_universal_t::get_names(bool show_exported, bool show_unexpor
             result.push_back(key);
         }
     }
+    std::sort(result.begin(), result.end());
     return result;
 }
 
@@ -386,6 +403,54 @@ void env_universal_t::acquire_variables(var_table_t &vars_to_acquire) {
     this->vars = std::move(vars_to_acquire);
 }
 
+void env_universal_t::apply_journal_delta(var_table_t &changed,
+                                          callback_data_list_t &callbacks) {
+    // As in generate_callbacks, our own modifications win over what we read.
+    for (auto &kv : changed) {
+        const wcstring &key = kv.first;
+        if (this->modified.find(key) != this->modified.end()) continue;
+
+        env_var_t &new_entry = kv.second;
+        var_table_t::iterator existing = this->vars.find(key);
+        if (existing == this->vars.end() || existing->second.exports() != new_entry.exports() ||
+            existing->second != new_entry) {
+            callbacks.push_back(callback_data_t(new_entry.exports() ? SET_EXPORT : SET, key,
+                                                new_entry.as_string()));
+            this->vars[key] = std::move(new_entry);
+        }
+    }
+}
+
+void env_universal_t::note_journal_position(int fd, off_t offset, size_t records) {
+    this->last_read_offset = offset;
+    this->journal_records = records;
+    this->last_read_tail.clear();
+
+    off_t tail_len = mini(offset, (off_t)JOURNAL_TAIL_SIZE);
+    if (tail_len > 0) {
+        char buff[JOURNAL_TAIL_SIZE];
+        ssize_t amt = pread(fd, buff, (size_t)tail_len, offset - tail_len);
+        if (amt == tail_len) this->last_read_tail.assign(buff, (size_t)amt);
+    }
+}
+
+bool env_universal_t::journal_extends_last_read(int fd, const file_id_t &file) const {
+    // The file must be the same one, no shorter than what we read, and still contain what we read
+    // (inodes may be reused).
+    if (last_read_file == kInvalidFileID || file.device != last_read_file.device ||
+        file.inode != last_read_file.inode || file.size < (uint64_t)last_read_offset) {
+        return false;
+    }
+
+    size_t tail_len = last_read_tail.size();
+    if (tail_len != (size_t)mini(last_read_offset, (off_t)JOURNAL_TAIL_SIZE)) return false;
+    if (tail_len == 0) return true;
+
+    char buff[JOURNAL_TAIL_SIZE];
+    ssize_t amt = pread(fd, buff, tail_len, last_read_offset - (off_t)tail_len);
+    return amt == (ssize_t)tail_len && !memcmp(buff, last_read_tail.data(), tail_len);
+}
+
 void env_universal_t::load_from_fd(int fd, callback_data_list_t &callbacks) {
     ASSERT_IS_LOCKED(lock);
     assert(fd >= 0);
@@ -393,16 +458,37 @@ void env_universal_t::load_from_fd(int fd, callback_data_list_t &callbacks) {
     const file_id_t current_file = file_id_for_fd(fd);
     if (current_file == last_read_file) {
         debug(5, L"universal log sync elided based on fstat()");
+    } else if (this->journal_extends_last_read(fd, current_file)) {
+        // Only read the records appended since we last read.
+        debug(5, L"universal log reading journal from offset %lld", (long long)last_read_offset);
+        var_table_t changed;
+        size_t records = 0;
+        off_t amt = -1;
+        if (lseek(fd, last_read_offset, SEEK_SET) == last_read_offset) {
+            amt = this->read_message_internal(fd, &changed, &records);
+        }
+        if (amt >= 0) {
+            this->apply_journal_delta(changed, callbacks);
+            this->note_journal_position(fd, last_read_offset + amt, journal_records + records);
+            last_read_file = current_file;
+        }
     } else {
         // Read a variables table from the file.
-        var_table_t new_vars = this->read_message_internal(fd);
-
-        // Announce changes.
-        this->generate_callbacks(new_vars, callbacks);
-
-        // Acquire the new variables.
-        this->acquire_variables(new_vars);
-        last_read_file = current_file;
+        var_table_t new_vars;
+        size_t records = 0;
+        off_t amt = -1;
+        if (lseek(fd, 0, SEEK_SET) == 0) {
+            amt = this->read_message_internal(fd, &new_vars, &records);
+        }
+        if (amt >= 0) {
+            // Announce changes.
+            this->generate_callbacks(new_vars, callbacks);
+
+            // Acquire the new variables.
+            this->acquire_variables(new_vars);
+            this->note_journal_position(fd, amt, records);
+            last_read_file = current_file;
+        }
     }
 }
 
@@ -442,20 +528,30 @@ bool env_universal_t::write_to_fd(int fd, const wcstring &path) {
     // Write the save message. If this fails, we don't bother complaining.
     write_loop(fd, SAVE_MSG, strlen(SAVE_MSG));
 
-    var_table_t::const_iterator iter = vars.begin();
-    while (iter != vars.end()) {
+    // Write the variables in sorted order, so the file doesn't churn for no reason.
+    std::vector<const var_table_t::value_type *> sorted_vars;
+    sorted_vars.reserve(vars.size());
+    for (const auto &kv : vars) {
+        sorted_vars.push_back(&kv);
+    }
+    std::sort(sorted_vars.begin(), sorted_vars.end(),
+              [](const var_table_t::value_type *a, const var_table_t::value_type *b) {
+                  return a->first < b->first;
+              });
+
+    size_t records = 0;
+    for (size_t i = 0; i < sorted_vars.size(); i++) {
         // Append the entry. Note that append_file_entry may fail, but that only affects one
         // variable; soldier on.
-        const wcstring &key = iter->first;
-        const env_var_t &var = iter->second;
-        append_file_entry(var.exports() ? SET_EXPORT : SET, key, var.as_string(), &contents,
-                          &storage);
-
-        // Go to next.
-        ++iter;
+        const wcstring &key = sorted_vars.at(i)->first;
+        const env_var_t &var = sorted_vars.at(i)->second;
+        if (append_file_entry(var.exports() ? SET_EXPORT : SET, key, var.as_string(), &contents,
+                              &storage)) {
+            records++;
+        }
 
         // Flush if this is the last iteration or we exceed a page.
-        if (iter == vars.end() || contents.size() >= 4096) {
+        if (i + 1 == sorted_vars.size() || contents.size() >= 4096) {
             if (write_loop(fd, contents.data(), contents.size()) < 0) {
                 const char *error = strerror(errno);
                 debug(0, _(L"Unable to write to universal variables file '%ls': %s"), path.c_str(),
@@ -469,11 +565,48 @@ bool env_universal_t::write_to_fd(int fd, const wcstring &path) {
 
     // Since we just wrote out this file, it matches our internal state; pretend we read from it.
     this->last_read_file = file_id_for_fd(fd);
+    if (success) this->note_journal_position(fd, lseek(fd, 0, SEEK_CUR), records);
 
     // We don't close the file.
     return success;
 }
 
+/// Appends records for our modified variables to the journal at fd, which we have read up to its
+/// end. path is provided only for error reporting.
+bool env_universal_t::append_to_fd(int fd, const wcstring &path) {
+    ASSERT_IS_LOCKED(lock);
+    assert(fd >= 0);
+
+    std::string contents;
+    std::string storage;
+    size_t records = 0;
+    for (const wcstring &key : this->modified) {
+        // The journal has no way to record an erasure; see sync().
+        var_table_t::const_iterator where = this->vars.find(key);
+        if (where == this->vars.end()) return false;
+        const env_var_t &var = where->second;
+        if (append_file_entry(var.exports() ? SET_EXPORT : SET, key, var.as_string(), &contents,
+                              &storage)) {
+            records++;
+        }
+    }
+
+    // The journal must end exactly where we stopped reading; otherwise it has a torn record.
+    if (lseek(fd, 0, SEEK_END) != last_read_offset) return false;
+    if (write_loop(fd, contents.data(), contents.size()) < 0) {
+        const char *error = strerror(errno);
+        debug(0, _(L"Unable to write to universal variables file '%ls': %s"), path.c_str(), error);
+        // We may have written part of a record. Since it's unterminated nobody will read it, and
+        // since the file no longer ends where we stopped reading, we will compact it next time.
+        return false;
+    }
+
+    this->last_read_file = file_id_for_fd(fd);
+    this->note_journal_position(fd, last_read_offset + (off_t)contents.size(),
+                                journal_records + records);
+    return true;
+}
+
 bool env_universal_t::move_new_vars_file_into_place(const wcstring &src, const wcstring &dst) {
     int ret = wrename(src, dst);
     if (ret != 0) {
@@ -631,7 +764,10 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
     // 2. Lock the file (may be combined with step 1 on systems with O_EXLOCK)
     // 3. After taking the lock, check if the file at the given path is different from what we
     // opened. If so, start over.
-    // 4. Read from the file. This can be elided if its dev/inode is unchanged since the last read
+    // 4. Read from the file. This can be elided if its dev/inode is unchanged since the last read,
+    // and is limited to the records appended since then if the journal still extends what we read.
+    // 5. If we only set variables and the journal is not much larger than our variables, append
+    // records for our changes to it and skip to step 8. Otherwise rewrite it in steps 5 through 7.
     // 5. Open an adjacent temporary file
     // 6. Write our changes to an adjacent file
     // 7. Move the adjacent file into place via rename. This is assumed to be atomic.
@@ -645,6 +781,9 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
     // process 2 reaches step 7; at that point process 1 will reach step 2, notice that the file has
     // changed, and then start over.
     //
+    // Appending is safe for the same reason: it happens under the lock, to the file we just read.
+    // Readers which don't take the lock leave an unterminated last record for their next read.
+    //
     // It's possible that the underlying filesystem does not support locks (lockless NFS). In this
     // case, we risk data loss if two shells try to write their universal variables simultaneously.
     // In practice this is unlikely, since uvars are usually written interactively.
@@ -675,8 +814,6 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
     int private_fd = -1;
     wcstring private_file_path;
 
-    debug(5, L"universal log performing full sync");
-
     // Open the file.
     if (success) {
         success = this->open_and_acquire_lock(vars_path, &vars_fd);
@@ -689,6 +826,25 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
         this->load_from_fd(vars_fd, callbacks);
     }
 
+    // Append our changes to the journal, unless it's due for compaction or we erased a variable.
+    // Older versions of fish read the journal too, and only understand SET records, so erasures
+    // are written by rewriting the file without the variable.
+    const bool erased_any =
+        std::any_of(modified.begin(), modified.end(),
+                    [this](const wcstring &key) { return vars.find(key) == vars.end(); });
+    if (success && !erased_any && last_read_file != kInvalidFileID && last_read_offset > 0 &&
+        journal_records + modified.size() <= 2 * vars.size() + JOURNAL_COMPACTION_SLACK) {
+        debug(5, L"universal log appending %lu records", (unsigned long)modified.size());
+        if (this->append_to_fd(vars_fd, vars_path)) {
+            close(vars_fd);
+            modified.clear();
+            return true;
+        }
+        debug(5, L"universal log append_to_fd() failed");
+    }
+
+    debug(5, L"universal log performing full sync");
+
     // Open adjacent temporary file.
     if (success) {
         success = this->open_temporary_file(directory, &private_file_path, &private_fd);
@@ -756,12 +912,13 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
     return success;
 }
 
-var_table_t env_universal_t::read_message_internal(int fd) {
-    var_table_t result;
-
+off_t env_universal_t::read_message_internal(int fd, var_table_t *vars, size_t *record_count) {
     // Temp value used to avoid repeated allocations.
     wcstring storage;
 
+    // Number of bytes up to and including the last newline.
+    off_t consumed = 0;
+
     // The line we construct (and then parse).
     std::string line;
     wcstring wide_line;
@@ -769,7 +926,9 @@ var_table_t env_universal_t::read_message_internal(int fd) {
         // Read into a buffer. Note this is NOT null-terminated!
         char buffer[1024];
         ssize_t amt = read_loop(fd, buffer, sizeof buffer);
-        if (amt <= 0) {
+        if (amt < 0) {
+            return -1;
+        } else if (amt == 0) {
             break;
         }
         const size_t bufflen = (size_t)amt;
@@ -788,9 +947,11 @@ var_table_t env_universal_t::read_message_internal(int fd) {
             line.append(buffer + line_start, cursor - line_start);
 
             // Process it if it's a newline (which is true if we are before the end of the buffer).
-            if (cursor < bufflen && !line.empty()) {
-                if (utf8_to_wchar(line.data(), line.size(), &wide_line, 0)) {
-                    env_universal_t::parse_message_internal(wide_line, &result, &storage);
+            if (cursor < bufflen) {
+                consumed += line.size() + 1;
+                if (!line.empty() && utf8_to_wchar(line.data(), line.size(), &wide_line, 0)) {
+                    env_universal_t::parse_message_internal(wide_line, vars, &storage,
+                                                            record_count);
                 }
                 line.clear();
             }
@@ -800,13 +961,14 @@ var_table_t env_universal_t::read_message_internal(int fd) {
         }
     }
 
-    // We make no effort to handle an unterminated last line.
-    return result;
+    // An unterminated last line may be a record that is still being appended. Leave it for the
+    // next read.
+    return consumed;
 }
 
-/// Parse message msg/
+/// Parse message msg, applying it to vars.
 void env_universal_t::parse_message_internal(const wcstring &msgstr, var_table_t *vars,
-                                             wcstring *storage) {
+                                             wcstring *storage, size_t *record_count) {
     const wchar_t *msg = msgstr.c_str();
 
     // debug(3, L"parse_message( %ls );", msg);
@@ -832,6 +994,7 @@ void env_universal_t::parse_message_internal(const wcstring &msgstr, var_table_t
                 env_var_t &entry = (*vars)[key];
                 entry.set_exports(exportv);
                 entry.set_vals(decode_serialized(val));
+                (*record_count)++;
             }
         } else {
             debug(1, PARSE_ERR, msg);
@@ -1333,9 +1496,81 @@ class universal_notifier_named_pipe_t : public universal_notifier_t {
 #endif
 };
 
+// inotify-based notifier. We watch the directory containing the variables file for the file being
+// closed after writing (which is how it is appended to) or moved into place (which is how it is
+// rewritten). We watch the directory rather than the file because rewriting replaces the file.
+//
+// Writing the file is itself the notification, so posting does nothing, and nothing ever polls.
+class universal_notifier_inotify_t : public universal_notifier_t {
+#ifdef HAVE_SYS_INOTIFY_H
+    int inotify_fd;
+    // Base name of the variables file. Events for other files in its directory are ignored.
+    std::string vars_name;
+
+   public:
+    explicit universal_notifier_inotify_t(const wchar_t *test_path) : inotify_fd(-1) {
+        const wcstring vars_path = test_path ? wcstring(test_path) : default_vars_path();
+        if (vars_path.empty()) return;
+        vars_name = wcs2string(wbasename(vars_path));
+
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+            debug(1, "inotify_init1() failed: %s", strerror(errno));
+            debug(1, "Universal variable notifications may not be received.");
+            return;
+        }
+
+        const std::string dir = wcs2string(wdirname(vars_path));
+        if (inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            debug(1, "inotify_add_watch() failed for '%s': %s", dir.c_str(), strerror(errno));
+            debug(1, "Universal variable notifications may not be received.");
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+
+    ~universal_notifier_inotify_t() override {
+        if (inotify_fd >= 0) {
+            close(inotify_fd);
+        }
+    }
+
+    int notification_fd() override { return inotify_fd; }
+
+    bool notification_fd_became_readable(int fd) override {
+        // Drain every pending event, noting whether any of them concerns our file.
+        assert(fd == inotify_fd);
+        bool changed = false;
+        alignas(struct inotify_event) char buff[4096];
+        ssize_t amt;
+        while ((amt = read(inotify_fd, buff, sizeof buff)) > 0) {
+            for (ssize_t offset = 0; offset < amt;) {
+                const auto *event = reinterpret_cast<const struct inotify_event *>(buff + offset);
+                if (event->mask & IN_Q_OVERFLOW) {
+                    // We lost events; assume ours was among them.
+                    changed = true;
+                } else if (event->len > 0 && vars_name == event->name) {
+                    changed = true;
+                }
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        return changed;
+    }
+#else  // this class isn't valid on this system
+   public:
+    explicit universal_notifier_inotify_t(const wchar_t *test_path) {
+        static_cast<void>(test_path);
+        DIE("universal_notifier_inotify_t cannot be used on this system");
+    }
+#endif
+};
+
 universal_notifier_t::notifier_strategy_t universal_notifier_t::resolve_default_strategy() {
 #if FISH_NOTIFYD_AVAILABLE
     return strategy_notifyd;
+#elif defined(HAVE_SYS_INOTIFY_H)
+    return strategy_inotify;
 #elif defined(__CYGWIN__)
     return strategy_shmem_polling;
 #else
@@ -1361,6 +1596,9 @@ std::unique_ptr<universal_notifier_t> universal_notifier_t::new_notifier_for_str
         case strategy_named_pipe: {
             return make_unique<universal_notifier_named_pipe_t>(test_path);
         }
+        case strategy_inotify: {
+            return make_unique<universal_notifier_inotify_t>(test_path);
+        }
     }
     DIE("should never reach this statement");
     return NULL;
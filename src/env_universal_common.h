@@ -51,11 +51,35 @@ class env_universal_t {
     bool open_and_acquire_lock(const wcstring &path, int *out_fd);
     bool open_temporary_file(const wcstring &directory, wcstring *out_path, int *out_fd);
     bool write_to_fd(int fd, const wcstring &path);
+    bool append_to_fd(int fd, const wcstring &path);
     bool move_new_vars_file_into_place(const wcstring &src, const wcstring &dst);
 
+    // The file is a journal: each sync that only sets variables appends records for them, and
+    // later records override earlier ones. Erasing a variable, or a journal holding many more
+    // records than there are variables, rewrites the file.
+
     // File id from which we last read.
     file_id_t last_read_file;
 
+    // Offset just past the last complete record we read or wrote.
+    off_t last_read_offset;
+
+    // The bytes preceding last_read_offset. If the file still has them there, it is the same
+    // journal and we only need to read what was appended after it.
+    std::string last_read_tail;
+
+    // Number of records in the journal up to last_read_offset.
+    size_t journal_records;
+
+    // Record where we are in the journal open at fd, having read or written up to offset.
+    void note_journal_position(int fd, off_t offset, size_t records);
+
+    // Returns whether the journal at fd extends the one we last read.
+    bool journal_extends_last_read(int fd, const file_id_t &file) const;
+
+    // Apply records read from the journal since our last read, generating callbacks for changes.
+    void apply_journal_delta(var_table_t &changed, callback_data_list_t &callbacks);
+
     // Given a variable table, generate callbacks representing the difference between our vars and
     // the new vars.
     void generate_callbacks(const var_table_t &new_vars, callback_data_list_t &callbacks) const;
@@ -64,8 +88,9 @@ class env_universal_t {
     // vars_to_acquire.
     void acquire_variables(var_table_t &vars_to_acquire);
 
-    static void parse_message_internal(const wcstring &msg, var_table_t *vars, wcstring *storage);
-    static var_table_t read_message_internal(int fd);
+    static void parse_message_internal(const wcstring &msg, var_table_t *vars, wcstring *storage,
+                                       size_t *record_count);
+    static off_t read_message_internal(int fd, var_table_t *vars, size_t *record_count);
 
    public:
     explicit env_universal_t(wcstring path);
@@ -121,6 +146,9 @@ class universal_notifier_t {
         // Strategy that uses a named pipe. Somewhat complex, but portable and doesn't require
         // polling most of the time.
         strategy_named_pipe,
+        // Strategy that uses inotify(7) to watch the variables file itself. Never polls, but Linux
+        // only.
+        strategy_inotify,
     };
 
    protected:
@@ -33,6 +33,7 @@
 #include "fallback.h"  // IWYU pragma: keep
 #include "function.h"
 #include "io.h"
+#include "iothread.h"
 #include "parse_tree.h"
 #include "parser.h"
 #include "postfork.h"
@@ -53,9 +54,9 @@
 /// Base open mode to pass to calls to open.
 #define OPEN_MASK 0666
 
-/// Called in a forked child.
-static void exec_write_and_exit(int fd, const char *buff, size_t count, int status) {
-    if (write_loop(fd, buff, count) == -1) {
+/// Called in a forked child to write the contents of a chunked buffer.
+static void exec_write_buffer_and_exit(int fd, const chunked_buffer_t &buff, int status) {
+    if (buff.write_to(fd) == -1) {
         debug(0, WRITE_ERROR);
         wperror(L"write");
         exit_without_destructors(status);
@@ -63,6 +64,70 @@ static void exec_write_and_exit(int fd, const char *buff, size_t count, int stat
     exit_without_destructors(status);
 }
 
+/// Output for pipes, each given by the write end of the pipe and what to write to it.
+typedef std::vector<std::pair<int, chunked_buffer_t>> pipe_outputs_t;
+
+/// Write outputs into their pipes, in order, blocking until they are written.
+static void write_to_pipes(const pipe_outputs_t &outputs) {
+    for (const auto &output : outputs) {
+        // EPIPE just means nobody is reading any more, e.g. `yes | head -1`.
+        if (output.second.write_to(output.first) == -1 && errno != EPIPE) {
+            debug(1, WRITE_ERROR);
+            wperror(L"write");
+        }
+    }
+}
+
+static void *pipe_writer_main(void *param) {
+    std::unique_ptr<pipe_outputs_t> outputs(static_cast<pipe_outputs_t *>(param));
+    write_to_pipes(*outputs);
+    for (const auto &output : *outputs) {
+        close(output.first);
+    }
+    return NULL;
+}
+
+/// Write outputs into their pipes, in order, on a detached thread, so that the processes reading
+/// from the pipes can be started while they are written. This is much cheaper than forking a child
+/// to do the writing. On success, the contents of outputs are taken; on failure they are left alone
+/// and false is returned.
+static bool write_to_pipes_on_thread(pipe_outputs_t *outputs) {
+    // The thread gets its own copies of the fds, since we close ours once the pipeline is started.
+    std::unique_ptr<pipe_outputs_t> req(new pipe_outputs_t());
+    for (auto &output : *outputs) {
+        int fd = fcntl(output.first, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) break;
+        req->push_back(std::make_pair(fd, std::move(output.second)));
+    }
+
+    pthread_t thread;
+    if (req->size() == outputs->size() && make_pthread(&thread, pipe_writer_main, req.get())) {
+        pthread_detach(thread);
+        req.release();
+        return true;
+    }
+
+    for (size_t i = 0; i < req->size(); i++) {
+        outputs->at(i).second = std::move(req->at(i).second);
+        close(req->at(i).first);
+    }
+    return false;
+}
+
+/// If the given redirection is into a pipe to another process in the job, return the write end of
+/// the pipe. Otherwise return -1.
+static int pipe_write_fd_for_io(const io_data_t *io) {
+    if (io == NULL || io->io_mode != IO_PIPE) return -1;
+    const io_pipe_t *io_pipe = static_cast<const io_pipe_t *>(io);
+    return io_pipe->is_input ? -1 : io_pipe->pipe_fd[1];
+}
+
+/// Return whether the given redirection is into a pipe whose reader has already been started.
+static bool pipe_reader_is_running(const io_data_t *io) {
+    if (pipe_write_fd_for_io(io) < 0) return false;
+    return static_cast<const io_pipe_t *>(io)->reader_running;
+}
+
 void exec_close(int fd) {
     ASSERT_IS_MAIN_THREAD();
 
@@ -336,8 +401,11 @@ void internal_exec_helper(parser_t &parser, parsed_source_ref_t parsed_source, t
 //
 // Furthermore, to avoid the race between the caller calling tcsetpgrp() and the client checking the
 // foreground process group, we don't use posix_spawn if we're going to foreground the process. (If
-// we use fork(), we can call tcsetpgrp after the fork, before the exec, and avoid the race).
+// we use fork(), we can call tcsetpgrp after the fork, before the exec, and avoid the race). Where
+// posix_spawn can do the tcsetpgrp itself before the exec, there is no race. That matters for large
+// fish processes, since posix_spawn uses vfork-style clone and avoids copying our page tables.
 static bool can_use_posix_spawn_for_job(const job_t *job, const process_t *process) {
+#if !HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
     if (job->get_flag(JOB_CONTROL)) {  //!OCLINT(collapsible if statements)
         // We are going to use job control; therefore when we launch this job it will get its own
         // process group ID. But will it be foregrounded?
@@ -347,6 +415,7 @@ static bool can_use_posix_spawn_for_job(const job_t *job, const process_t *proce
             return false;
         }
     }
+#endif
 
     // Now see if we have a redirection involving a file. The only one we allow is /dev/null, which
     // we assume will not fail.
@@ -390,6 +459,14 @@ void internal_exec(job_t *j, const io_chain_t &&all_ios) {
     }
 }
 
+/// Return the fd that a builtin's output for \p fd can be written to while the builtin runs, or -1
+/// if it has to be held until the builtin is done.
+static int builtin_stream_fd(const io_chain_t &io_chain, int fd) {
+    const shared_ptr<const io_data_t> io = io_chain.get_io_for_fd(fd);
+    if (!io) return fd;
+    return pipe_reader_is_running(io.get()) ? pipe_write_fd_for_io(io.get()) : -1;
+}
+
 /// Execute an internal builtin. Given a parser, a job within that parser, and a process within that
 /// job corresponding to a builtin, execute the builtin with the given streams. If pipe_read is set,
 /// assign stdin to it; otherwise infer stdin from the IO chain.
@@ -473,6 +550,8 @@ static bool exec_internal_builtin_proc(parser_t &parser, job_t *j, process_t *p,
     streams.err_is_redirected = has_fd(proc_io_chain, STDERR_FILENO);
     streams.stdin_is_directly_redirected = stdin_is_directly_redirected;
     streams.io_chain = &proc_io_chain;
+    streams.out.set_stream_fd(builtin_stream_fd(proc_io_chain, STDOUT_FILENO));
+    streams.err.set_stream_fd(builtin_stream_fd(proc_io_chain, STDERR_FILENO));
 
     // Since this may be the foreground job, and since a builtin may execute another
     // foreground job, we need to pretend to suspend this job while running the
@@ -512,9 +591,527 @@ void on_process_created(job_t *j, pid_t child_pid) {
     }
 }
 
-void exec_job(parser_t &parser, job_t *j) {
+/// A job's process group lives as long as any process in it, including zombies that fish has not
+/// yet reaped. Internal processes in the middle of a pipeline may run other jobs that reap the
+/// earlier members of this one, leaving no group for the next external process to join. When that
+/// happens every process that was in the group has finished, so let the next one lead a new group.
+static void reset_pgid_if_group_exited(job_t *j) {
+    if (!j->get_flag(JOB_CONTROL) || j->pgid == -2 || j->pgid == getpgrp()) {
+        return;
+    }
+    if (killpg(j->pgid, 0) < 0 && errno == ESRCH) {
+        debug(3, L"Process group %d of job '%ls' has exited, starting a new one", j->pgid,
+              j->command_wcstr());
+        j->pgid = -2;
+    }
+}
+
+/// Execute the process \p p of job \p j. \p pipe_current_read is the read end of the pipe from the
+/// previous process, or -1. \p next_pipe is the pipe to the next process, if p is not the last in
+/// the job; \p next_reader_running is set if the process reading from it has already been started,
+/// so that p may write into it directly. Returns false if there was an error executing p.
+static bool exec_process_in_job(parser_t &parser, process_t *p, job_t *j,
+                                const io_chain_t &all_ios, size_t stdout_read_limit,
+                                int pipe_current_read, const int next_pipe[2],
+                                bool next_reader_running) {
     pid_t pid = 0;
+    bool exec_error = false;
+
+    // The IO chain for this process. It starts with the block IO, then pipes, and then gets any
+    // from the process.
+    io_chain_t process_net_io_chain = j->block_io_chain();
+
+    // See if we need a pipe.
+    const bool pipes_to_next_command = !p->is_last_in_job;
+    // Set to true if we end up forking for this process.
+    bool child_forked = false;
+    bool child_spawned = false;
+
+    // The pipes the current process write to and read from. Unfortunately these can't be just
+    // allocated on the stack, since j->io wants shared_ptr.
+    //
+    // The write pipe (destined for stdout) needs to occur before redirections. For example,
+    // with a redirection like this:
+    //
+    //   `foo 2>&1 | bar`
+    //
+    // what we want to happen is this:
+    //
+    //    dup2(pipe, stdout)
+    //    dup2(stdout, stderr)
+    //
+    // so that stdout and stderr both wind up referencing the pipe.
+    //
+    // The read pipe (destined for stdin) is more ambiguous. Imagine a pipeline like this:
+    //
+    //   echo alpha | cat < beta.txt
+    //
+    // Should cat output alpha or beta? bash and ksh output 'beta', tcsh gets it right and
+    // complains about ambiguity, and zsh outputs both (!). No shells appear to output 'alpha',
+    // so we match bash here. That would mean putting the pipe first, so that it gets trumped by
+    // the file redirection.
+    //
+    // However, eval does this:
+    //
+    //   echo "begin; $argv "\n" ;end <&3 3<&-" | source 3<&0
+    //
+    // which depends on the redirection being evaluated before the pipe. So the write end of the
+    // pipe comes first, the read pipe of the pipe comes last. See issue #966.
+    shared_ptr<io_pipe_t> pipe_write;
+    shared_ptr<io_pipe_t> pipe_read;
+
+    // Write pipe goes first.
+    if (pipes_to_next_command) {
+        pipe_write.reset(new io_pipe_t(p->pipe_write_fd, false));
+        process_net_io_chain.push_back(pipe_write);
+    }
+
+    // The explicit IO redirections associated with the process.
+    process_net_io_chain.append(p->io_chain());
+
+    // Read pipe goes last.
+    if (!p->is_first_in_job) {
+        pipe_read.reset(new io_pipe_t(p->pipe_read_fd, true));
+        // Record the current read in pipe_read.
+        pipe_read->pipe_fd[0] = pipe_current_read;
+        process_net_io_chain.push_back(pipe_read);
+    }
+
+    // This call is used so the global environment variable array is regenerated, if needed,
+    // before the fork. That way, we avoid a lot of duplicate work where EVERY child would need
+    // to generate it, since that result would not get written back to the parent. This call
+    // could be safely removed, but it would result in slightly lower performance - at least on
+    // uniprocessor systems.
+    if (p->type == EXTERNAL) {
+        // Apply universal barrier so we have the most recent uvar changes
+        if (!get_proc_had_barrier()) {
+            set_proc_had_barrier(true);
+            env_universal_barrier();
+        }
+        env_export_arr();
+    }
+
+    // The caller made the pipe to the next process.
+    if (pipes_to_next_command) {
+        memcpy(pipe_write->pipe_fd, next_pipe, sizeof(int) * 2);
+        pipe_write->reader_running = next_reader_running;
+    }
+
+    // This is the IO buffer we use for storing the output of a block or function when it is in
+    // a pipeline.
+    shared_ptr<io_buffer_t> block_output_io_buffer;
+
+    // This is the io_streams we pass to internal builtins.
+    std::unique_ptr<io_streams_t> builtin_io_streams(new io_streams_t(stdout_read_limit));
+
+    // We fork in several different places. Each time the same code must be executed, so unify
+    // it all here.
+    auto do_fork = [&j, &p, &pid, &exec_error, &process_net_io_chain,
+                    &child_forked](bool drain_threads, const char *fork_type,
+                                   std::function<void()> child_action) -> bool {
+        pid = execute_fork(drain_threads);
+        if (pid == 0) {
+            // This is the child process. Setup redirections, print correct output to
+            // stdout and stderr, and then exit.
+            p->pid = getpid();
+            child_set_group(j, p);
+            setup_child_process(p, process_net_io_chain);
+            child_action();
+            DIE("Child process returned control to do_fork lambda!");
+        }
+
+        if (pid < 0) {
+            debug(1, L"Failed to fork %s!\n", fork_type);
+            job_mark_process_as_failed(j, p);
+            exec_error = true;
+            return false;
+        }
+
+        // This is the parent process. Store away information on the child, and
+        // possibly give it control over the terminal.
+        debug(2, L"Fork #%d, pid %d: %s for '%ls'", g_fork_count, pid, fork_type, p->argv0());
+        child_forked = true;
+
+        p->pid = pid;
+        on_process_created(j, p->pid);
+        set_child_group(j, p->pid);
+        maybe_assign_terminal(j);
+
+        return true;
+    };
+
+    // Helper routine executed by INTERNAL_FUNCTION and INTERNAL_BLOCK_NODE to make sure an
+    // output buffer exists in case there is another command in the job chain that will be
+    // reading from this command's output, and that has not been started yet.
+    auto verify_buffer_output = [&]() {
+        if (!p->is_last_in_job && !next_reader_running) {
+            // Be careful to handle failure, e.g. too many open fds.
+            block_output_io_buffer = io_buffer_t::create(STDOUT_FILENO, all_ios);
+            if (block_output_io_buffer.get() == NULL) {
+                exec_error = true;
+                job_mark_process_as_failed(j, p);
+            } else {
+                // This looks sketchy, because we're adding this io buffer locally - they
+                // aren't in the process or job redirection list. Therefore select_try won't
+                // be able to read them. However we call block_output_io_buffer->read()
+                // below, which reads until EOF. So there's no need to select on this.
+                process_net_io_chain.push_back(block_output_io_buffer);
+            }
+        }
+    };
+
+    switch (p->type) {
+        case INTERNAL_FUNCTION: {
+            const wcstring func_name = p->argv0();
+            auto props = function_get_properties(func_name);
+            if (!props) {
+                debug(0, _(L"Unknown function '%ls'"), p->argv0());
+                break;
+            }
+
+            const std::map<wcstring, env_var_t> inherit_vars =
+                function_get_inherit_vars(func_name);
 
+            function_block_t *fb =
+                parser.push_block<function_block_t>(p, func_name, props->shadow_scope);
+            function_prepare_environment(func_name, p->get_argv() + 1, inherit_vars);
+            parser.forbid_function(func_name);
+
+            verify_buffer_output();
+
+            if (!exec_error) {
+                internal_exec_helper(parser, props->parsed_source, props->body_node,
+                                     process_net_io_chain);
+            }
+
+            parser.allow_function();
+            parser.pop_block(fb);
+
+            break;
+        }
+
+        case INTERNAL_BLOCK_NODE: {
+            verify_buffer_output();
+
+            if (!exec_error) {
+                assert(p->block_node_source && p->internal_block_node &&
+                       "Process is missing node info");
+                internal_exec_helper(parser, p->block_node_source, p->internal_block_node,
+                                     process_net_io_chain);
+            }
+            break;
+        }
+
+        case INTERNAL_BUILTIN: {
+            if (!exec_internal_builtin_proc(parser, j, p, pipe_read.get(), process_net_io_chain,
+                                            *builtin_io_streams)) {
+                exec_error = true;
+            }
+            break;
+        }
+
+        case EXTERNAL:
+            // External commands are handled in the next switch statement below.
+            break;
+
+        case INTERNAL_EXEC:
+            // We should have handled exec up above.
+            DIE("INTERNAL_EXEC process found in pipeline, where it should never be. Aborting.");
+            break;
+    }
+
+    if (exec_error) {
+        return false;
+    }
+
+    switch (p->type) {
+        case INTERNAL_BLOCK_NODE:
+        case INTERNAL_FUNCTION: {
+            int status = proc_get_last_status();
+
+            // Handle output from a block or function. This usually means do nothing, but in the
+            // case of pipes, we have to buffer such io, since otherwise the internal pipe
+            // buffer might overflow.
+            if (!block_output_io_buffer.get()) {
+                // No buffer, so we exit directly. This means we have to manually set the exit
+                // status.
+                if (p->is_last_in_job) {
+                    proc_set_last_status(j->get_flag(JOB_NEGATE) ? (!status) : status);
+                }
+                p->completed = 1;
+                break;
+            }
+
+            // Here we must have a non-NULL block_output_io_buffer.
+            assert(block_output_io_buffer.get() != NULL);
+            process_net_io_chain.remove(block_output_io_buffer);
+
+            block_output_io_buffer->read();
+
+            pipe_outputs_t outputs;
+            outputs.push_back(std::make_pair(
+                pipe_write_fd_for_io(
+                    process_net_io_chain.get_io_for_fd(block_output_io_buffer->fd).get()),
+                block_output_io_buffer->take_out_buffer()));
+            const chunked_buffer_t &buffer = outputs.front().second;
+            if (!buffer.empty() && outputs.front().first >= 0 &&
+                write_to_pipes_on_thread(&outputs)) {
+                // The output is going into the pipe to the next process; we're done.
+                debug(3, L"Skipping fork: writing buffered output for '%ls' on a thread",
+                      p->argv0());
+                p->status = status;
+                p->completed = 1;
+            } else if (!buffer.empty()) {
+                // We don't have to drain threads here because our child process is simple.
+                const char *fork_reason = p->type == INTERNAL_BLOCK_NODE ? "internal block io" : "internal function io";
+                if (!do_fork(false, fork_reason, [&] {
+                        exec_write_buffer_and_exit(block_output_io_buffer->fd, buffer, status);
+                    })) {
+                    break;
+                }
+            } else {
+                if (p->is_last_in_job) {
+                    proc_set_last_status(j->get_flag(JOB_NEGATE) ? (!status) : status);
+                }
+                p->completed = 1;
+            }
+
+            block_output_io_buffer.reset();
+            break;
+        }
+
+        case INTERNAL_BUILTIN: {
+            // Handle output from builtin commands. In the general case, this means forking of a
+            // worker process, that will write out the contents of the stdout and stderr buffers
+            // to the correct file descriptor. Since forking is expensive, fish tries to avoid
+            // it when possible.
+            bool fork_was_skipped = false;
+
+            const shared_ptr<io_data_t> stdout_io =
+                process_net_io_chain.get_io_for_fd(STDOUT_FILENO);
+            const shared_ptr<io_data_t> stderr_io =
+                process_net_io_chain.get_io_for_fd(STDERR_FILENO);
+
+            assert(builtin_io_streams.get() != NULL);
+            const wcstring &stdout_buffer = builtin_io_streams->out.buffer();
+            const wcstring &stderr_buffer = builtin_io_streams->err.buffer();
+
+            // If we are outputting to a file, we have to actually do it, even if we have no
+            // output, so that we can truncate the file. Does not apply to /dev/null.
+            bool must_fork = redirection_is_to_real_file(stdout_io.get()) ||
+                             redirection_is_to_real_file(stderr_io.get());
+            if (!must_fork && p->is_last_in_job) {
+                // We are handling reads directly in the main loop. Note that we may still end
+                // up forking.
+                const bool stdout_is_to_buffer = stdout_io && stdout_io->io_mode == IO_BUFFER;
+                const bool no_stdout_output = stdout_buffer.empty();
+                const bool no_stderr_output = stderr_buffer.empty();
+                const bool stdout_discarded = builtin_io_streams->out.output_discarded();
+
+                if (!stdout_discarded && no_stdout_output && no_stderr_output) {
+                    // The builtin produced no output and is not inside of a pipeline. No
+                    // need to fork or even output anything.
+                    debug(3, L"Skipping fork: no output for internal builtin '%ls'",
+                          p->argv0());
+                    fork_was_skipped = true;
+                } else if (no_stderr_output && stdout_is_to_buffer) {
+                    // The builtin produced no stderr, and its stdout is going to an
+                    // internal buffer. There is no need to fork. This helps out the
+                    // performance quite a bit in complex completion code.
+                    debug(3, L"Skipping fork: buffered output for internal builtin '%ls'",
+                          p->argv0());
+
+                    io_buffer_t *io_buffer = static_cast<io_buffer_t *>(stdout_io.get());
+                    if (stdout_discarded) {
+                        io_buffer->set_discard();
+                    } else {
+                        const std::string res = wcs2string(builtin_io_streams->out.buffer());
+                        io_buffer->out_buffer_append(res.data(), res.size());
+                    }
+                    fork_was_skipped = true;
+                } else if (stdout_io.get() == NULL && stderr_io.get() == NULL) {
+                    // We are writing to normal stdout and stderr. Just do it - no need to fork.
+                    debug(3, L"Skipping fork: ordinary output for internal builtin '%ls'",
+                          p->argv0());
+                    const std::string outbuff = wcs2string(stdout_buffer);
+                    const std::string errbuff = wcs2string(stderr_buffer);
+                    bool builtin_io_done = do_builtin_io(outbuff.data(), outbuff.size(),
+                                                         errbuff.data(), errbuff.size());
+                    if (!builtin_io_done && errno != EPIPE) {
+                        redirect_tty_output();  // workaround glibc bug
+                        debug(0, "!builtin_io_done and errno != EPIPE");
+                        show_stackframe(L'E');
+                    }
+                    if (stdout_discarded) p->status = STATUS_READ_TOO_MUCH;
+                    fork_was_skipped = true;
+                }
+            }
+
+            // Output into pipes to other processes in the job can be written on threads, and
+            // there is no need to write empty output at all.
+            const int stdout_pipe = pipe_write_fd_for_io(stdout_io.get());
+            const int stderr_pipe = pipe_write_fd_for_io(stderr_io.get());
+            if (!fork_was_skipped && !must_fork && stdout_pipe >= 0 &&
+                (stderr_io.get() == NULL || stderr_pipe >= 0)) {
+                const std::string outbuff = wcs2string(stdout_buffer);
+                const std::string errbuff = wcs2string(stderr_buffer);
+                pipe_outputs_t outputs;
+                if (!outbuff.empty()) {
+                    outputs.push_back(std::make_pair(stdout_pipe, chunked_buffer_t()));
+                    outputs.back().second.append(outbuff.data(), outbuff.size());
+                }
+                if (!errbuff.empty() && stderr_pipe >= 0) {
+                    outputs.push_back(std::make_pair(stderr_pipe, chunked_buffer_t()));
+                    outputs.back().second.append(errbuff.data(), errbuff.size());
+                }
+
+                // If the readers are already running, we must write in order with whatever else
+                // goes into the pipes, and can block until they catch up.
+                const bool readers_running =
+                    pipe_reader_is_running(stdout_io.get()) &&
+                    (stderr_pipe < 0 || pipe_reader_is_running(stderr_io.get()));
+                bool written = true;
+                if (readers_running) {
+                    write_to_pipes(outputs);
+                } else if (!outputs.empty()) {
+                    written = write_to_pipes_on_thread(&outputs);
+                }
+                if (written) {
+                    debug(3, L"Skipping fork: writing output for internal builtin '%ls' into pipes",
+                          p->argv0());
+                    if (!errbuff.empty() && stderr_pipe < 0) {
+                        do_builtin_io(NULL, 0, errbuff.data(), errbuff.size());
+                    }
+                    fork_was_skipped = true;
+                }
+            }
+
+            if (fork_was_skipped) {
+                p->completed = 1;
+                if (p->is_last_in_job) {
+                    debug(3, L"Set status of %ls to %d using short circuit", j->command_wcstr(),
+                          p->status);
+
+                    int status = p->status;
+                    proc_set_last_status(j->get_flag(JOB_NEGATE) ? (!status) : status);
+                }
+            } else {
+                // Ok, unfortunately, we have to do a real fork. Bummer. We work hard to make
+                // sure we don't have to wait for all our threads to exit, by arranging things
+                // so that we don't have to allocate memory or do anything except system calls
+                // in the child.
+                //
+                // These strings may contain embedded nulls, so don't treat them as C strings.
+                const std::string outbuff_str = wcs2string(stdout_buffer);
+                const char *outbuff = outbuff_str.data();
+                size_t outbuff_len = outbuff_str.size();
+
+                const std::string errbuff_str = wcs2string(stderr_buffer);
+                const char *errbuff = errbuff_str.data();
+                size_t errbuff_len = errbuff_str.size();
+
+                fflush(stdout);
+                fflush(stderr);
+                if (!do_fork(false, "internal builtin", [&] {
+                        do_builtin_io(outbuff, outbuff_len, errbuff, errbuff_len);
+                        exit_without_destructors(p->status);
+                    })) {
+                    break;
+                }
+            }
+
+            break;
+        }
+
+        case EXTERNAL: {
+            // Get argv and envv before we fork.
+            null_terminated_array_t<char> argv_array;
+            convert_wide_array_to_narrow(p->get_argv_array(), &argv_array);
+
+            // Ensure that stdin is blocking before we hand it off (see issue #176). It's a
+            // little strange that we only do this with stdin and not with stdout or stderr.
+            // However in practice, setting or clearing O_NONBLOCK on stdin also sets it for the
+            // other two fds, presumably because they refer to the same underlying file
+            // (/dev/tty?).
+            make_fd_blocking(STDIN_FILENO);
+
+            const char *const *argv = argv_array.get();
+            const char *const *envv = env_export_arr();
+
+            std::string actual_cmd_str = wcs2string(p->actual_cmd);
+            const char *actual_cmd = actual_cmd_str.c_str();
+            const wchar_t *file = reader_current_filename();
+
+#if FISH_USE_POSIX_SPAWN
+            // Prefer to use posix_spawn, since it's faster on some systems like OS X.
+            bool use_posix_spawn = g_use_posix_spawn && can_use_posix_spawn_for_job(j, p);
+            if (use_posix_spawn) {
+                g_fork_count++;  // spawn counts as a fork+exec
+                // Create posix spawn attributes and actions.
+                posix_spawnattr_t attr = posix_spawnattr_t();
+                posix_spawn_file_actions_t actions = posix_spawn_file_actions_t();
+                bool made_it = fork_actions_make_spawn_properties(&attr, &actions, j, p,
+                                                                  process_net_io_chain);
+                if (made_it) {
+                    // We successfully made the attributes and actions; actually call
+                    // posix_spawn.
+                    int spawn_ret = posix_spawn(&pid, actual_cmd, &actions, &attr,
+                                                const_cast<char *const *>(argv),
+                                                const_cast<char *const *>(envv));
+
+                    // This usleep can be used to test for various race conditions
+                    // (https://github.com/fish-shell/fish-shell/issues/360).
+                    // usleep(10000);
+
+                    if (spawn_ret != 0) {
+                        safe_report_exec_error(spawn_ret, actual_cmd, argv, envv);
+                        // Make sure our pid isn't set.
+                        pid = 0;
+                    }
+
+                    // Clean up our actions.
+                    posix_spawn_file_actions_destroy(&actions);
+                    posix_spawnattr_destroy(&attr);
+                }
+
+                // A 0 pid means we failed to posix_spawn. Since we have no pid, we'll never get
+                // told when it's exited, so we have to mark the process as failed.
+                debug(2, L"Fork #%d, pid %d: spawn external command '%s' from '%ls'",
+                      g_fork_count, pid, actual_cmd, file ? file : L"<no file>");
+                if (pid == 0) {
+                    job_mark_process_as_failed(j, p);
+                    exec_error = true;
+                    break;
+                }
+
+                // these are all things do_fork() takes care of normally:
+                p->pid = pid;
+                child_spawned = true;
+                on_process_created(j, p->pid);
+                maybe_assign_terminal(j);
+            } else
+#endif
+            {
+                if (!do_fork(false, "external command",
+                             [&] { safe_launch_process(p, actual_cmd, argv, envv); })) {
+                    break;
+                }
+            }
+
+            break;
+        }
+
+        case INTERNAL_EXEC: {
+            // We should have handled exec up above.
+            DIE("INTERNAL_EXEC process found in pipeline, where it should never be. Aborting.");
+            break;
+        }
+    }
+
+    return !exec_error;
+}
+
+void exec_job(parser_t &parser, job_t *j) {
     // Set to true if something goes wrong while exec:ing the job, in which case the cleanup code
     // will kick in.
     bool exec_error = false;
@@ -567,25 +1164,26 @@ void exec_job(parser_t &parser, job_t *j) {
         }
     }
 
-    // See if we need to create a group keepalive process. This is a process that we create to make
-    // sure that the process group doesn't die accidentally, and is often needed when a
-    // builtin/block/function is inside a pipeline, since that usually means we have to wait for one
-    // program to exit before continuing in the pipeline, causing the group leader to exit.
-    if (j->get_flag(JOB_CONTROL) && !exec_error) {
-        for (const process_ptr_t &p : j->processes) {
-            if (p->type != EXTERNAL && (!p->is_last_in_job || !p->is_first_in_job)) {
-                needs_keepalive = true;
-                break;
+    // The first process we fork leads the job's process group. A builtin/block/function inside a
+    // pipeline may let that leader exit before the rest of the pipeline is launched; see
+    // reset_pgid_if_group_exited for how we cope with that without a keepalive process.
+    //
+    // WSL does not permit joining the pgrp of an exited process, even before it is reaped
+    // (see https://github.com/Microsoft/WSL/issues/2786), also fish PR #4676. There we still create
+    // a keepalive process to hold the group open if our first process is external, or if there is
+    // an internal process inside a pipeline.
+    if (is_windows_subsystem_for_linux() && !exec_error) {
+        needs_keepalive = j->processes.front()->type == EXTERNAL;
+        if (j->get_flag(JOB_CONTROL)) {
+            for (const process_ptr_t &p : j->processes) {
+                if (p->type != EXTERNAL && (!p->is_last_in_job || !p->is_first_in_job)) {
+                    needs_keepalive = true;
+                    break;
+                }
             }
         }
     }
 
-    // When running under WSL, create a keepalive process unconditionally if our first process is external.
-    // This is because WSL does not permit joining the pgrp of an exited process.
-    // (see https://github.com/Microsoft/WSL/issues/2786), also fish PR #4676
-    if (j->processes.front()->type == EXTERNAL && is_windows_subsystem_for_linux())
-        needs_keepalive = true;
-
     if (needs_keepalive) {
         // Call fork. No need to wait for threads since our use is confined and simple.
         pid_t parent_pid = getpid();
@@ -606,108 +1204,36 @@ void exec_job(parser_t &parser, job_t *j) {
         }
     }
 
-    // This loop loops over every process_t in the job, starting it as appropriate. This turns out
-    // to be rather complex, since a process_t can be one of many rather different things.
-    //
-    // The loop also has to handle pipelining between the jobs.
-    //
-    // We can have up to three pipes "in flight" at a time:
-    //
-    // 1. The pipe the current process should read from (courtesy of the previous process)
-    // 2. The pipe that the current process should write to
-    // 3. The pipe that the next process should read from (courtesy of us)
-    //
-    // We are careful to set these to -1 when closed, so if we exit the loop abruptly, we can still
-    // close them.
-    int pipe_current_read = -1, pipe_current_write = -1, pipe_next_read = -1;
+    // If the processes after the last internal process are all external, we start them first, so
+    // that the internal process can write straight into the pipe to them. Its output then streams,
+    // with backpressure, instead of being buffered whole. We don't do this for jobs that are given
+    // the terminal, since the internal process may run commands that need it.
+    process_t *streaming_proc = NULL;
+    if (!j->get_flag(JOB_TERMINAL)) {
+        for (const process_ptr_t &p : j->processes) {
+            if (p->type != EXTERNAL) streaming_proc = p.get();
+        }
+        if (streaming_proc && streaming_proc->is_last_in_job) streaming_proc = NULL;
+    }
+    int streaming_read = -1, streaming_write = -1;
+
+    // The pipe from the current process to the next. We are careful to set these to -1 when
+    // closed, so if we exit the loop abruptly, we can still close them.
+    int pipe_current_read = -1, pipe_next_read = -1, pipe_current_write = -1;
     for (std::unique_ptr<process_t> &unique_p : j->processes) {
         if (exec_error) {
             break;
         }
         process_t *const p = unique_p.get();
-        // The IO chain for this process. It starts with the block IO, then pipes, and then gets any
-        // from the process.
-        io_chain_t process_net_io_chain = j->block_io_chain();
 
         // "Consume" any pipe_next_read by making it current.
         assert(pipe_current_read == -1);
         pipe_current_read = pipe_next_read;
         pipe_next_read = -1;
 
-        // See if we need a pipe.
-        const bool pipes_to_next_command = !p->is_last_in_job;
-        // Set to true if we end up forking for this process.
-        bool child_forked = false;
-        bool child_spawned = false;
-
-        // The pipes the current process write to and read from. Unfortunately these can't be just
-        // allocated on the stack, since j->io wants shared_ptr.
-        //
-        // The write pipe (destined for stdout) needs to occur before redirections. For example,
-        // with a redirection like this:
-        //
-        //   `foo 2>&1 | bar`
-        //
-        // what we want to happen is this:
-        //
-        //    dup2(pipe, stdout)
-        //    dup2(stdout, stderr)
-        //
-        // so that stdout and stderr both wind up referencing the pipe.
-        //
-        // The read pipe (destined for stdin) is more ambiguous. Imagine a pipeline like this:
-        //
-        //   echo alpha | cat < beta.txt
-        //
-        // Should cat output alpha or beta? bash and ksh output 'beta', tcsh gets it right and
-        // complains about ambiguity, and zsh outputs both (!). No shells appear to output 'alpha',
-        // so we match bash here. That would mean putting the pipe first, so that it gets trumped by
-        // the file redirection.
-        //
-        // However, eval does this:
-        //
-        //   echo "begin; $argv "\n" ;end <&3 3<&-" | source 3<&0
-        //
-        // which depends on the redirection being evaluated before the pipe. So the write end of the
-        // pipe comes first, the read pipe of the pipe comes last. See issue #966.
-        shared_ptr<io_pipe_t> pipe_write;
-        shared_ptr<io_pipe_t> pipe_read;
-
-        // Write pipe goes first.
-        if (pipes_to_next_command) {
-            pipe_write.reset(new io_pipe_t(p->pipe_write_fd, false));
-            process_net_io_chain.push_back(pipe_write);
-        }
-
-        // The explicit IO redirections associated with the process.
-        process_net_io_chain.append(p->io_chain());
-
-        // Read pipe goes last.
-        if (!p->is_first_in_job) {
-            pipe_read.reset(new io_pipe_t(p->pipe_read_fd, true));
-            // Record the current read in pipe_read.
-            pipe_read->pipe_fd[0] = pipe_current_read;
-            process_net_io_chain.push_back(pipe_read);
-        }
-
-        // This call is used so the global environment variable array is regenerated, if needed,
-        // before the fork. That way, we avoid a lot of duplicate work where EVERY child would need
-        // to generate it, since that result would not get written back to the parent. This call
-        // could be safely removed, but it would result in slightly lower performance - at least on
-        // uniprocessor systems.
-        if (p->type == EXTERNAL) {
-            // Apply universal barrier so we have the most recent uvar changes
-            if (!get_proc_had_barrier()) {
-                set_proc_had_barrier(true);
-                env_universal_barrier();
-            }
-            env_export_arr();
-        }
-
         // Set up fds that will be used in the pipe.
-        if (pipes_to_next_command) {
-            // debug( 1, L"%ls|%ls" , p->argv[0], p->next->argv[0]);
-            int local_pipe[2] = {-1, -1};
+        int local_pipe[2] = {-1, -1};
+        if (!p->is_last_in_job) {
             if (exec_pipe(local_pipe) == -1) {
                 debug(1, PIPE_ERROR);
                 wperror(L"pipe");
@@ -726,380 +1252,24 @@ void exec_job(parser_t &parser, job_t *j) {
                 break;
             }
 
-            // This tells the redirection about the fds, but the redirection does not close them.
-            assert(local_pipe[0] >= 0);
-            assert(local_pipe[1] >= 0);
-            memcpy(pipe_write->pipe_fd, local_pipe, sizeof(int) * 2);
-
             // Record our pipes. The fds should be negative to indicate that we aren't overwriting
             // an fd we failed to close.
-            assert(pipe_current_write == -1);
             pipe_current_write = local_pipe[1];
-
-            assert(pipe_next_read == -1);
             pipe_next_read = local_pipe[0];
         }
 
-        // This is the IO buffer we use for storing the output of a block or function when it is in
-        // a pipeline.
-        shared_ptr<io_buffer_t> block_output_io_buffer;
-
-        // This is the io_streams we pass to internal builtins.
-        std::unique_ptr<io_streams_t> builtin_io_streams(new io_streams_t(stdout_read_limit));
-
-        // We fork in several different places. Each time the same code must be executed, so unify
-        // it all here.
-        auto do_fork = [&j, &p, &pid, &exec_error, &process_net_io_chain,
-                        &child_forked](bool drain_threads, const char *fork_type,
-                                       std::function<void()> child_action) -> bool {
-            pid = execute_fork(drain_threads);
-            if (pid == 0) {
-                // This is the child process. Setup redirections, print correct output to
-                // stdout and stderr, and then exit.
-                p->pid = getpid();
-                child_set_group(j, p);
-                setup_child_process(p, process_net_io_chain);
-                child_action();
-                DIE("Child process returned control to do_fork lambda!");
-            }
-
-            if (pid < 0) {
-                debug(1, L"Failed to fork %s!\n", fork_type);
-                job_mark_process_as_failed(j, p);
-                exec_error = true;
-                return false;
-            }
-
-            // This is the parent process. Store away information on the child, and
-            // possibly give it control over the terminal.
-            debug(2, L"Fork #%d, pid %d: %s for '%ls'", g_fork_count, pid, fork_type, p->argv0());
-            child_forked = true;
-
-            p->pid = pid;
-            on_process_created(j, p->pid);
-            set_child_group(j, p->pid);
-            maybe_assign_terminal(j);
-
-            return true;
-        };
-
-        // Helper routine executed by INTERNAL_FUNCTION and INTERNAL_BLOCK_NODE to make sure an
-        // output buffer exists in case there is another command in the job chain that will be
-        // reading from this command's output.
-        auto verify_buffer_output = [&]() {
-            if (!p->is_last_in_job) {
-                // Be careful to handle failure, e.g. too many open fds.
-                block_output_io_buffer = io_buffer_t::create(STDOUT_FILENO, all_ios);
-                if (block_output_io_buffer.get() == NULL) {
-                    exec_error = true;
-                    job_mark_process_as_failed(j, p);
-                } else {
-                    // This looks sketchy, because we're adding this io buffer locally - they
-                    // aren't in the process or job redirection list. Therefore select_try won't
-                    // be able to read them. However we call block_output_io_buffer->read()
-                    // below, which reads until EOF. So there's no need to select on this.
-                    process_net_io_chain.push_back(block_output_io_buffer);
-                }
-            }
-        };
-
-        switch (p->type) {
-            case INTERNAL_FUNCTION: {
-                const wcstring func_name = p->argv0();
-                auto props = function_get_properties(func_name);
-                if (!props) {
-                    debug(0, _(L"Unknown function '%ls'"), p->argv0());
-                    break;
-                }
-
-                const std::map<wcstring, env_var_t> inherit_vars =
-                    function_get_inherit_vars(func_name);
-
-                function_block_t *fb =
-                    parser.push_block<function_block_t>(p, func_name, props->shadow_scope);
-                function_prepare_environment(func_name, p->get_argv() + 1, inherit_vars);
-                parser.forbid_function(func_name);
-
-                verify_buffer_output();
-
-                if (!exec_error) {
-                    internal_exec_helper(parser, props->parsed_source, props->body_node,
-                                         process_net_io_chain);
-                }
-
-                parser.allow_function();
-                parser.pop_block(fb);
-
-                break;
-            }
-
-            case INTERNAL_BLOCK_NODE: {
-                verify_buffer_output();
-
-                if (!exec_error) {
-                    assert(p->block_node_source && p->internal_block_node &&
-                           "Process is missing node info");
-                    internal_exec_helper(parser, p->block_node_source, p->internal_block_node,
-                                         process_net_io_chain);
-                }
-                break;
-            }
-
-            case INTERNAL_BUILTIN: {
-                if (!exec_internal_builtin_proc(parser, j, p, pipe_read.get(), process_net_io_chain,
-                                                *builtin_io_streams)) {
-                    exec_error = true;
-                }
-                break;
-            }
-
-            case EXTERNAL:
-                // External commands are handled in the next switch statement below.
-                break;
-
-            case INTERNAL_EXEC:
-                // We should have handled exec up above.
-                DIE("INTERNAL_EXEC process found in pipeline, where it should never be. Aborting.");
-                break;
-        }
-
-        if (exec_error) {
-            break;
+        if (p == streaming_proc) {
+            // Hold on to its pipes until the processes after it have been started.
+            streaming_read = pipe_current_read;
+            streaming_write = pipe_current_write;
+            pipe_current_read = pipe_current_write = -1;
+            continue;
         }
 
-        switch (p->type) {
-            case INTERNAL_BLOCK_NODE:
-            case INTERNAL_FUNCTION: {
-                int status = proc_get_last_status();
-
-                // Handle output from a block or function. This usually means do nothing, but in the
-                // case of pipes, we have to buffer such io, since otherwise the internal pipe
-                // buffer might overflow.
-                if (!block_output_io_buffer.get()) {
-                    // No buffer, so we exit directly. This means we have to manually set the exit
-                    // status.
-                    if (p->is_last_in_job) {
-                        proc_set_last_status(j->get_flag(JOB_NEGATE) ? (!status) : status);
-                    }
-                    p->completed = 1;
-                    break;
-                }
-
-                // Here we must have a non-NULL block_output_io_buffer.
-                assert(block_output_io_buffer.get() != NULL);
-                process_net_io_chain.remove(block_output_io_buffer);
-
-                block_output_io_buffer->read();
-
-                const char *buffer = block_output_io_buffer->out_buffer_ptr();
-                size_t count = block_output_io_buffer->out_buffer_size();
-
-                if (block_output_io_buffer->out_buffer_size() > 0) {
-                    // We don't have to drain threads here because our child process is simple.
-                    const char *fork_reason = p->type == INTERNAL_BLOCK_NODE ? "internal block io" : "internal function io";
-                    if (!do_fork(false, fork_reason, [&] {
-                            exec_write_and_exit(block_output_io_buffer->fd, buffer, count, status);
-                        })) {
-                        break;
-                    }
-                } else {
-                    if (p->is_last_in_job) {
-                        proc_set_last_status(j->get_flag(JOB_NEGATE) ? (!status) : status);
-                    }
-                    p->completed = 1;
-                }
-
-                block_output_io_buffer.reset();
-                break;
-            }
-
-            case INTERNAL_BUILTIN: {
-                // Handle output from builtin commands. In the general case, this means forking of a
-                // worker process, that will write out the contents of the stdout and stderr buffers
-                // to the correct file descriptor. Since forking is expensive, fish tries to avoid
-                // it when possible.
-                bool fork_was_skipped = false;
-
-                const shared_ptr<io_data_t> stdout_io =
-                    process_net_io_chain.get_io_for_fd(STDOUT_FILENO);
-                const shared_ptr<io_data_t> stderr_io =
-                    process_net_io_chain.get_io_for_fd(STDERR_FILENO);
-
-                assert(builtin_io_streams.get() != NULL);
-                const wcstring &stdout_buffer = builtin_io_streams->out.buffer();
-                const wcstring &stderr_buffer = builtin_io_streams->err.buffer();
-
-                // If we are outputting to a file, we have to actually do it, even if we have no
-                // output, so that we can truncate the file. Does not apply to /dev/null.
-                bool must_fork = redirection_is_to_real_file(stdout_io.get()) ||
-                                 redirection_is_to_real_file(stderr_io.get());
-                if (!must_fork && p->is_last_in_job) {
-                    // We are handling reads directly in the main loop. Note that we may still end
-                    // up forking.
-                    const bool stdout_is_to_buffer = stdout_io && stdout_io->io_mode == IO_BUFFER;
-                    const bool no_stdout_output = stdout_buffer.empty();
-                    const bool no_stderr_output = stderr_buffer.empty();
-                    const bool stdout_discarded = builtin_io_streams->out.output_discarded();
-
-                    if (!stdout_discarded && no_stdout_output && no_stderr_output) {
-                        // The builtin produced no output and is not inside of a pipeline. No
-                        // need to fork or even output anything.
-                        debug(3, L"Skipping fork: no output for internal builtin '%ls'",
-                              p->argv0());
-                        fork_was_skipped = true;
-                    } else if (no_stderr_output && stdout_is_to_buffer) {
-                        // The builtin produced no stderr, and its stdout is going to an
-                        // internal buffer. There is no need to fork. This helps out the
-                        // performance quite a bit in complex completion code.
-                        debug(3, L"Skipping fork: buffered output for internal builtin '%ls'",
-                              p->argv0());
-
-                        io_buffer_t *io_buffer = static_cast<io_buffer_t *>(stdout_io.get());
-                        if (stdout_discarded) {
-                            io_buffer->set_discard();
-                        } else {
-                            const std::string res = wcs2string(builtin_io_streams->out.buffer());
-                            io_buffer->out_buffer_append(res.data(), res.size());
-                        }
-                        fork_was_skipped = true;
-                    } else if (stdout_io.get() == NULL && stderr_io.get() == NULL) {
-                        // We are writing to normal stdout and stderr. Just do it - no need to fork.
-                        debug(3, L"Skipping fork: ordinary output for internal builtin '%ls'",
-                              p->argv0());
-                        const std::string outbuff = wcs2string(stdout_buffer);
-                        const std::string errbuff = wcs2string(stderr_buffer);
-                        bool builtin_io_done = do_builtin_io(outbuff.data(), outbuff.size(),
-                                                             errbuff.data(), errbuff.size());
-                        if (!builtin_io_done && errno != EPIPE) {
-                            redirect_tty_output();  // workaround glibc bug
-                            debug(0, "!builtin_io_done and errno != EPIPE");
-                            show_stackframe(L'E');
-                        }
-                        if (stdout_discarded) p->status = STATUS_READ_TOO_MUCH;
-                        fork_was_skipped = true;
-                    }
-                }
-
-                if (fork_was_skipped) {
-                    p->completed = 1;
-                    if (p->is_last_in_job) {
-                        debug(3, L"Set status of %ls to %d using short circuit", j->command_wcstr(),
-                              p->status);
-
-                        int status = p->status;
-                        proc_set_last_status(j->get_flag(JOB_NEGATE) ? (!status) : status);
-                    }
-                } else {
-                    // Ok, unfortunately, we have to do a real fork. Bummer. We work hard to make
-                    // sure we don't have to wait for all our threads to exit, by arranging things
-                    // so that we don't have to allocate memory or do anything except system calls
-                    // in the child.
-                    //
-                    // These strings may contain embedded nulls, so don't treat them as C strings.
-                    const std::string outbuff_str = wcs2string(stdout_buffer);
-                    const char *outbuff = outbuff_str.data();
-                    size_t outbuff_len = outbuff_str.size();
-
-                    const std::string errbuff_str = wcs2string(stderr_buffer);
-                    const char *errbuff = errbuff_str.data();
-                    size_t errbuff_len = errbuff_str.size();
-
-                    fflush(stdout);
-                    fflush(stderr);
-                    if (!do_fork(false, "internal builtin", [&] {
-                            do_builtin_io(outbuff, outbuff_len, errbuff, errbuff_len);
-                            exit_without_destructors(p->status);
-                        })) {
-                        break;
-                    }
-                }
-
-                break;
-            }
-
-            case EXTERNAL: {
-                // Get argv and envv before we fork.
-                null_terminated_array_t<char> argv_array;
-                convert_wide_array_to_narrow(p->get_argv_array(), &argv_array);
-
-                // Ensure that stdin is blocking before we hand it off (see issue #176). It's a
-                // little strange that we only do this with stdin and not with stdout or stderr.
-                // However in practice, setting or clearing O_NONBLOCK on stdin also sets it for the
-                // other two fds, presumably because they refer to the same underlying file
-                // (/dev/tty?).
-                make_fd_blocking(STDIN_FILENO);
-
-                const char *const *argv = argv_array.get();
-                const char *const *envv = env_export_arr();
-
-                std::string actual_cmd_str = wcs2string(p->actual_cmd);
-                const char *actual_cmd = actual_cmd_str.c_str();
-                const wchar_t *file = reader_current_filename();
-
-#if FISH_USE_POSIX_SPAWN
-                // Prefer to use posix_spawn, since it's faster on some systems like OS X.
-                bool use_posix_spawn = g_use_posix_spawn && can_use_posix_spawn_for_job(j, p);
-                if (use_posix_spawn) {
-                    g_fork_count++;  // spawn counts as a fork+exec
-                    // Create posix spawn attributes and actions.
-                    posix_spawnattr_t attr = posix_spawnattr_t();
-                    posix_spawn_file_actions_t actions = posix_spawn_file_actions_t();
-                    bool made_it = fork_actions_make_spawn_properties(&attr, &actions, j, p,
-                                                                      process_net_io_chain);
-                    if (made_it) {
-                        // We successfully made the attributes and actions; actually call
-                        // posix_spawn.
-                        int spawn_ret = posix_spawn(&pid, actual_cmd, &actions, &attr,
-                                                    const_cast<char *const *>(argv),
-                                                    const_cast<char *const *>(envv));
-
-                        // This usleep can be used to test for various race conditions
-                        // (https://github.com/fish-shell/fish-shell/issues/360).
-                        // usleep(10000);
-
-                        if (spawn_ret != 0) {
-                            safe_report_exec_error(spawn_ret, actual_cmd, argv, envv);
-                            // Make sure our pid isn't set.
-                            pid = 0;
-                        }
-
-                        // Clean up our actions.
-                        posix_spawn_file_actions_destroy(&actions);
-                        posix_spawnattr_destroy(&attr);
-                    }
-
-                    // A 0 pid means we failed to posix_spawn. Since we have no pid, we'll never get
-                    // told when it's exited, so we have to mark the process as failed.
-                    debug(2, L"Fork #%d, pid %d: spawn external command '%s' from '%ls'",
-                          g_fork_count, pid, actual_cmd, file ? file : L"<no file>");
-                    if (pid == 0) {
-                        job_mark_process_as_failed(j, p);
-                        exec_error = true;
-                        break;
-                    }
-
-                    // these are all things do_fork() takes care of normally:
-                    p->pid = pid;
-                    child_spawned = true;
-                    on_process_created(j, p->pid);
-                    maybe_assign_terminal(j);
-                } else
-#endif
-                {
-                    if (!do_fork(false, "external command",
-                                 [&] { safe_launch_process(p, actual_cmd, argv, envv); })) {
-                        break;
-                    }
-                }
-
-                break;
-            }
-
-            case INTERNAL_EXEC: {
-                // We should have handled exec up above.
-                DIE("INTERNAL_EXEC process found in pipeline, where it should never be. Aborting.");
-                break;
-            }
+        reset_pgid_if_group_exited(j);
+        if (!exec_process_in_job(parser, p, j, all_ios, stdout_read_limit, pipe_current_read,
+                                 local_pipe, false)) {
+            exec_error = true;
         }
 
         // Close the pipe the current process uses to read from the previous process_t.
@@ -1120,6 +1290,20 @@ void exec_job(parser_t &parser, job_t *j) {
     if (pipe_current_write >= 0) exec_close(pipe_current_write);
     if (pipe_next_read >= 0) exec_close(pipe_next_read);
 
+    if (streaming_write >= 0) {
+        if (!exec_error) {
+            // The read end was closed when the next process was started.
+            const int streaming_pipe[2] = {-1, streaming_write};
+            reset_pgid_if_group_exited(j);
+            if (!exec_process_in_job(parser, streaming_proc, j, all_ios, stdout_read_limit,
+                                     streaming_read, streaming_pipe, true)) {
+                exec_error = true;
+            }
+        }
+        if (streaming_read >= 0) exec_close(streaming_read);
+        exec_close(streaming_write);
+    }
+
     // The keepalive process is no longer needed, so we terminate it with extreme prejudice.
     if (needs_keepalive) {
         kill(keepalive.pid, SIGKILL);
@@ -1179,32 +1363,33 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
         return subcommand_status;
     }
 
-    const char *begin = io_buffer->out_buffer_ptr();
-    const char *end = begin + io_buffer->out_buffer_size();
+    const chunked_buffer_t &buffer = io_buffer->get_out_buffer();
     if (split_output) {
-        const char *cursor = begin;
-        while (cursor < end) {
-            // Look for the next separator.
-            const char *stop = (const char *)memchr(cursor, '\n', end - cursor);
-            const bool hit_separator = (stop != NULL);
-            if (!hit_separator) {
-                // If it's not found, just use the end.
-                stop = end;
-            }
-            // Stop now points at the first character we do not want to copy.
-            const wcstring wc = str2wcstring(cursor, stop - cursor);
-            lst->push_back(wc);
-
-            // If we hit a separator, skip over it; otherwise we're at the end.
-            cursor = stop + (hit_separator ? 1 : 0);
-        }
+        // The buffer already knows where its lines are.
+        lst->reserve(lst->size() + buffer.newline_count() + 1);
+        buffer.for_each_line(
+            [&](const char *line, size_t len) { lst->push_back(str2wcstring(line, len)); });
     } else {
-        // We're not splitting output, but we still want to trim off a trailing newline.
-        if (end != begin && end[-1] == '\n') {
-            --end;
-        }
-        const wcstring wc = str2wcstring(begin, end - begin);
-        lst->push_back(wc);
+        // We're not splitting output, but we still want to trim off a trailing newline. Decode the
+        // chunks in place, carrying over any character that is split between two of them.
+        size_t remaining = buffer.size() - (buffer.ends_with_newline() ? 1 : 0);
+        wcstring output;
+        output.reserve(remaining);
+        std::string carry;
+        buffer.for_each_chunk([&](const char *data, size_t len) {
+            len = std::min(len, remaining);
+            remaining -= len;
+            // Complete the split character a byte at a time; it is only a few bytes long.
+            while (!carry.empty() && len > 0) {
+                carry.push_back(*data++);
+                len--;
+                carry.erase(0, str2wcstring_append(&output, carry.data(), carry.size(), false));
+            }
+            size_t used = str2wcstring_append(&output, data, len, false);
+            carry.append(data + used, len - used);
+        });
+        str2wcstring_append(&output, carry.data(), carry.size(), true);
+        lst->push_back(std::move(output));
     }
 
     return subcommand_status;
@@ -1292,10 +1292,13 @@ static void remove_internal_separator(wcstring *str, bool conv) {
 typedef expand_error_t (*expand_stage_t)(const wcstring &input,           //!OCLINT(unused param)
                                          std::vector<completion_t> *out,  //!OCLINT(unused param)
                                          expand_flags_t flags,            //!OCLINT(unused param)
-                                         parse_error_list_t *errors);     //!OCLINT(unused param)
+                                         parse_error_list_t *errors,      //!OCLINT(unused param)
+                                         const cancel_checker_t &cancel); //!OCLINT(unused param)
 
 static expand_error_t expand_stage_cmdsubst(const wcstring &input, std::vector<completion_t> *out,
-                                            expand_flags_t flags, parse_error_list_t *errors) {
+                                            expand_flags_t flags, parse_error_list_t *errors,
+                                            const cancel_checker_t &cancel) {
+    UNUSED(cancel);
     if (EXPAND_SKIP_CMDSUBST & flags) {
         wchar_t *begin, *end;
         if (parse_util_locate_cmdsubst(input.c_str(), &begin, &end, true) == 0) {
@@ -1314,7 +1317,9 @@ static expand_error_t expand_stage_cmdsubst(const wcstring &input, std::vector<c
 }
 
 static expand_error_t expand_stage_variables(const wcstring &input, std::vector<completion_t> *out,
-                                             expand_flags_t flags, parse_error_list_t *errors) {
+                                             expand_flags_t flags, parse_error_list_t *errors,
+                                             const cancel_checker_t &cancel) {
+    UNUSED(cancel);
     // We accept incomplete strings here, since complete uses expand_string to expand incomplete
     // strings from the commandline.
     wcstring next;
@@ -1336,13 +1341,17 @@ static expand_error_t expand_stage_variables(const wcstring &input, std::vector<
 }
 
 static expand_error_t expand_stage_brackets(const wcstring &input, std::vector<completion_t> *out,
-                                            expand_flags_t flags, parse_error_list_t *errors) {
+                                            expand_flags_t flags, parse_error_list_t *errors,
+                                            const cancel_checker_t &cancel) {
+    UNUSED(cancel);
     return expand_brackets(input, flags, out, errors);
 }
 
 static expand_error_t expand_stage_home_and_pid(const wcstring &input,
                                                 std::vector<completion_t> *out,
-                                                expand_flags_t flags, parse_error_list_t *errors) {
+                                                expand_flags_t flags, parse_error_list_t *errors,
+                                                const cancel_checker_t &cancel) {
+    UNUSED(cancel);
     wcstring next = input;
 
     if (!(EXPAND_SKIP_HOME_DIRECTORIES & flags)) {
@@ -1362,7 +1371,8 @@ static expand_error_t expand_stage_home_and_pid(const wcstring &input,
 }
 
 static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<completion_t> *out,
-                                             expand_flags_t flags, parse_error_list_t *errors) {
+                                             expand_flags_t flags, parse_error_list_t *errors,
+                                             const cancel_checker_t &cancel) {
     UNUSED(errors);
     expand_error_t result = EXPAND_OK;
     wcstring path_to_expand = input;
@@ -1429,7 +1439,7 @@ static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<
         std::vector<completion_t> expanded;
         for (size_t wd_idx = 0; wd_idx < effective_working_dirs.size(); wd_idx++) {
             int local_wc_res = wildcard_expand_string(
-                path_to_expand, effective_working_dirs.at(wd_idx), flags, &expanded);
+                path_to_expand, effective_working_dirs.at(wd_idx), flags, &expanded, cancel);
             if (local_wc_res > 0) {
                 // Something matched,so overall we matched.
                 result = EXPAND_WILDCARD_MATCH;
@@ -1453,29 +1463,72 @@ static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<
     return result;
 }
 
+// Tests for whether a stage would output its input unchanged, when not expanding for completions.
+// These are conservative: they only look for the characters the stage acts on.
+static bool expand_stage_cmdsubst_is_noop(const wcstring &input, expand_flags_t flags) {
+    UNUSED(flags);
+    return input.find_first_of(L"()") == wcstring::npos;
+}
+
+static bool expand_stage_brackets_is_noop(const wcstring &input, expand_flags_t flags) {
+    UNUSED(flags);
+    const wchar_t bracket_chars[] = {BRACKET_BEGIN, BRACKET_END, L'\0'};
+    return input.find_first_of(bracket_chars) == wcstring::npos;
+}
+
+static bool expand_stage_home_and_pid_is_noop(const wcstring &input, expand_flags_t flags) {
+    if (!(flags & EXPAND_SKIP_HOME_DIRECTORIES) && !input.empty() &&
+        input.at(0) == HOME_DIRECTORY) {
+        return false;
+    }
+    const wchar_t pid_chars[] = {INTERNAL_SEPARATOR, PROCESS_EXPAND, L'\0'};
+    return input.find_first_of(pid_chars) == wcstring::npos;
+}
+
+static bool expand_stage_wildcards_is_noop(const wcstring &input, expand_flags_t flags) {
+    UNUSED(flags);
+    const wchar_t wildcard_chars[] = {INTERNAL_SEPARATOR, ANY_CHAR, ANY_STRING,
+                                      ANY_STRING_RECURSIVE, L'\0'};
+    return input.find_first_of(wildcard_chars) == wcstring::npos;
+}
+
+/// Our expansion stages, in order. Stages that may be skipped when they have nothing to do have a
+/// test for that.
+static const struct {
+    expand_stage_t run;
+    bool (*is_noop)(const wcstring &input, expand_flags_t flags);
+} expand_stages[] = {{expand_stage_cmdsubst, expand_stage_cmdsubst_is_noop},
+                     {expand_stage_variables, NULL},
+                     {expand_stage_brackets, expand_stage_brackets_is_noop},
+                     {expand_stage_home_and_pid, expand_stage_home_and_pid_is_noop},
+                     {expand_stage_wildcards, expand_stage_wildcards_is_noop}};
+
 expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *out_completions,
-                             expand_flags_t flags, parse_error_list_t *errors) {
+                             expand_flags_t flags, parse_error_list_t *errors,
+                             const cancel_checker_t &cancel) {
     // Early out. If we're not completing, and there's no magic in the input, we're done.
     if (!(flags & EXPAND_FOR_COMPLETIONS) && expand_is_clean(input)) {
         append_completion(out_completions, input);
         return EXPAND_OK;
     }
 
-    // Our expansion stages.
-    const expand_stage_t stages[] = {expand_stage_cmdsubst, expand_stage_variables,
-                                     expand_stage_brackets, expand_stage_home_and_pid,
-                                     expand_stage_wildcards};
-
     // Load up our single initial completion.
     std::vector<completion_t> completions, output_storage;
     append_completion(&completions, input);
 
     expand_error_t total_result = EXPAND_OK;
     for (size_t stage_idx = 0;
-         total_result != EXPAND_ERROR && stage_idx < sizeof stages / sizeof *stages; stage_idx++) {
+         total_result != EXPAND_ERROR && stage_idx < sizeof expand_stages / sizeof *expand_stages;
+         stage_idx++) {
+        // Give up between stages if our result is no longer wanted.
+        if (cancel && cancel()) {
+            total_result = EXPAND_ERROR;
+            break;
+        }
         for (size_t i = 0; total_result != EXPAND_ERROR && i < completions.size(); i++) {
             const wcstring &next = completions.at(i).completion;
-            expand_error_t this_result = stages[stage_idx](next, &output_storage, flags, errors);
+            expand_error_t this_result =
+                expand_stages[stage_idx].run(next, &output_storage, flags, errors, cancel);
             // If this_result was no match, but total_result is that we have a match, then don't
             // change it.
             if (!(this_result == EXPAND_WILDCARD_NO_MATCH &&
@@ -1494,8 +1547,56 @@ expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *o
         if (!(flags & EXPAND_SKIP_HOME_DIRECTORIES)) {
             unexpand_tildes(input, &completions);
         }
-        out_completions->insert(out_completions->end(), completions.begin(), completions.end());
+        std::move(completions.begin(), completions.end(), std::back_inserter(*out_completions));
+    }
+    return total_result;
+}
+
+expand_error_t expand_string(const wcstring &input, wcstring_list_t *out, expand_flags_t flags,
+                             parse_error_list_t *errors) {
+    assert(!(flags & EXPAND_FOR_COMPLETIONS) && "Use the completion_t variant for completions");
+    if (expand_is_clean(input)) {
+        out->push_back(input);
+        return EXPAND_OK;
+    }
+
+    // The strings going into and coming out of each stage. Stages that have nothing to do for a
+    // string are skipped, and the string is moved along as is.
+    wcstring_list_t items{input}, next_items;
+    std::vector<completion_t> stage_output;
+
+    expand_error_t total_result = EXPAND_OK;
+    for (const auto &stage : expand_stages) {
+        for (size_t i = 0; total_result != EXPAND_ERROR && i < items.size(); i++) {
+            wcstring &item = items[i];
+            if (stage.is_noop && stage.is_noop(item, flags)) {
+                next_items.push_back(std::move(item));
+                continue;
+            }
+
+            stage_output.clear();
+            expand_error_t this_result =
+                stage.run(item, &stage_output, flags, errors, cancel_checker_t());
+            // If this_result was no match, but total_result is that we have a match, then don't
+            // change it.
+            if (!(this_result == EXPAND_WILDCARD_NO_MATCH &&
+                  total_result == EXPAND_WILDCARD_MATCH)) {
+                total_result = this_result;
+            }
+            for (completion_t &c : stage_output) {
+                next_items.push_back(std::move(c.completion));
+            }
+        }
+        if (total_result == EXPAND_ERROR) return total_result;
+
+        // Output becomes our next stage's input.
+        items.swap(next_items);
+        next_items.clear();
     }
+
+    // Note there's no need to un-expand tildes: that only applies to completions that replace
+    // their token.
+    std::move(items.begin(), items.end(), std::back_inserter(*out));
     return total_result;
 }
 
@@ -106,11 +106,20 @@ enum expand_error_t {
 /// \param flags Specifies if any expansion pass should be skipped. Legal values are any combination
 /// of EXPAND_SKIP_CMDSUBST EXPAND_SKIP_VARIABLES and EXPAND_SKIP_WILDCARDS
 /// \param errors Resulting errors, or NULL to ignore
+/// \param cancel If set, polled between expansion stages and during wildcard expansion. If it
+/// returns true, expansion stops and EXPAND_ERROR is returned.
 ///
 /// \return One of EXPAND_OK, EXPAND_ERROR, EXPAND_WILDCARD_MATCH and EXPAND_WILDCARD_NO_MATCH.
 /// EXPAND_WILDCARD_NO_MATCH and EXPAND_WILDCARD_MATCH are normal exit conditions used only on
 /// strings containing wildcards to tell if the wildcard produced any matches.
 __warn_unused expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *output,
+                                           expand_flags_t flags, parse_error_list_t *errors,
+                                           const cancel_checker_t &cancel = cancel_checker_t());
+
+/// Variant of expand_string for expanding arguments for execution, which only wants the expanded
+/// strings. This skips building a completion for each result of each expansion stage. \p flags
+/// must not contain EXPAND_FOR_COMPLETIONS.
+__warn_unused expand_error_t expand_string(const wcstring &input, wcstring_list_t *output,
                                            expand_flags_t flags, parse_error_list_t *errors);
 
 /// expand_one is identical to expand_string, except it will fail if in expands to more than one
@@ -4,6 +4,7 @@
 // IWYU pragma: no_include <cstring>
 // IWYU pragma: no_include <cstddef>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
 #include <pthread.h>
@@ -475,6 +476,19 @@ static void test_convert() {
         }
         free((void *)n);
     }
+
+    // Decoding in pieces gives the same result as decoding all at once, wherever it is split. The
+    // string ends with a truncated sequence.
+    const std::string whole = "a\xc3\xa9z\xe2\x82\xac\xf0\x9f\x90\x9f!\xc3";
+    for (size_t split = 0; split <= whole.size(); split++) {
+        wcstring pieces;
+        size_t used = str2wcstring_append(&pieces, whole.data(), split, false);
+        const std::string rest = whole.substr(used);
+        if (str2wcstring_append(&pieces, rest.data(), rest.size(), true) != rest.size() ||
+            pieces != str2wcstring(whole)) {
+            err(L"Decoding in pieces split at %lu gave a different string", (unsigned long)split);
+        }
+    }
 }
 
 /// Verify correct behavior with embedded nulls.
@@ -653,6 +667,94 @@ static void test_iothread() {
         max_achieved_thread_count);
 }
 
+static void test_io_buffer() {
+    say(L"Testing io buffers");
+    shared_ptr<io_buffer_t> buffer = io_buffer_t::create(STDOUT_FILENO, io_chain_t());
+    if (!buffer) {
+        err(L"Could not create io buffer");
+        return;
+    }
+
+    // Write far more than a pipe can hold. This only completes because the buffer drains the pipe
+    // while we write.
+    const std::string chunk(4096, 'x');
+    const size_t chunk_count = 256;
+    for (size_t i = 0; i < chunk_count; i++) {
+        if (write_loop(buffer->pipe_fd[1], chunk.data(), chunk.size()) < 0) {
+            err(L"Write to io buffer failed");
+            break;
+        }
+    }
+
+    // Output appended directly must come after what was written to the pipe.
+    buffer->out_buffer_append("tail", 4);
+    buffer->read();
+
+    const size_t expected_size = chunk.size() * chunk_count + 4;
+    const std::string contents = buffer->get_out_buffer().contents();
+    if (contents.size() != expected_size) {
+        err(L"Expected io buffer to have %lu bytes, but it has %lu",
+            (unsigned long)expected_size, (unsigned long)contents.size());
+    } else if (contents.compare(contents.size() - 4, 4, "tail") != 0 ||
+               contents.find_first_not_of('x') != contents.size() - 4) {
+        err(L"Io buffer contents are out of order");
+    }
+
+    // Lines are split correctly, including lines that straddle chunks.
+    chunked_buffer_t chunked;
+    std::vector<std::string> expected_lines;
+    for (size_t i = 0; i < 2000; i++) {
+        std::string line(i % 97, 'a' + i % 26);
+        expected_lines.push_back(line);
+        line.push_back('\n');
+        chunked.append(line.data(), line.size());
+    }
+    chunked.append("\n", 1);
+    expected_lines.push_back("");
+    chunked.append("no newline", 10);
+    expected_lines.push_back("no newline");
+    std::vector<std::string> lines;
+    chunked.for_each_line([&](const char *line, size_t len) { lines.emplace_back(line, len); });
+    do_test(chunked.newline_count() == expected_lines.size() - 1);
+    do_test(lines == expected_lines);
+}
+
+static void test_output_stream() {
+    say(L"Testing streaming output streams");
+    int pipes[2];
+    if (pipe(pipes) < 0) {
+        err(L"Could not create pipe");
+        return;
+    }
+    make_fd_nonblocking(pipes[0]);
+
+    // Output is written once enough of it accumulates, and the rest is left for the caller.
+    const size_t flush_size = output_stream_t::OUTPUT_STREAM_FLUSH_SIZE;
+    output_stream_t streamed(0);
+    streamed.set_stream_fd(pipes[1]);
+    streamed.append(wcstring(flush_size - 1, L'x'));
+    do_test(streamed.buffer().size() == flush_size - 1);
+    streamed.append(L"y\u00e9");
+    do_test(streamed.buffer().empty());
+    streamed.append(L'z');
+    do_test(streamed.buffer() == L"z");
+
+    std::string written(2 * flush_size, '\0');
+    ssize_t amt = read(pipes[0], &written[0], written.size());
+    written.resize(amt < 0 ? 0 : amt);
+    do_test(written == std::string(flush_size - 1, 'x') + wcs2string(L"y\u00e9"));
+
+    // Streams with a buffer limit hold all of their output, so that the limit can be applied.
+    output_stream_t limited(flush_size * 2);
+    limited.set_stream_fd(pipes[1]);
+    limited.append(wcstring(flush_size + 1, L'x'));
+    do_test(limited.buffer().size() == flush_size + 1);
+    do_test(read(pipes[0], &written[0], written.size()) < 0 && errno == EAGAIN);
+
+    close(pipes[0]);
+    close(pipes[1]);
+}
+
 static parser_test_error_bits_t detect_argument_errors(const wcstring &src) {
     parse_node_tree_t tree;
     if (!parse_tree_from_string(src, parse_flag_none, &tree, NULL, symbol_argument_list)) {
@@ -1440,6 +1542,19 @@ static bool expand_test(const wchar_t *in, expand_flags_t flags, ...) {
         return false;
     }
 
+    // The variant for execution must produce the same strings.
+    if (!(flags & EXPAND_FOR_COMPLETIONS)) {
+        wcstring_list_t strings;
+        if (expand_string(in, &strings, flags, NULL) == EXPAND_ERROR ||
+            strings.size() != output.size() ||
+            !std::equal(strings.begin(), strings.end(), output.begin(),
+                        [](const wcstring &str, const completion_t &c) {
+                            return str == c.completion;
+                        })) {
+            err(L"Expansion of '%ls' for execution differs", in);
+        }
+    }
+
     wcstring_list_t expected;
 
     va_start(va, flags);
@@ -1493,6 +1608,70 @@ static bool expand_test(const wchar_t *in, expand_flags_t flags, ...) {
     return res;
 }
 
+static void test_dir_iter() {
+    say(L"Testing directory iteration");
+    if (system("mkdir -p test/fish_dir_iter_test/dir/")) err(L"mkdir failed");
+    if (system("touch test/fish_dir_iter_test/file")) err(L"touch failed");
+    if (symlink("dir", "test/fish_dir_iter_test/link")) err(L"symlink failed");
+
+    dir_iter_t missing(L"test/fish_dir_iter_test/nope");
+    do_test(!missing.valid());
+
+    dir_iter_t dir(L"test/fish_dir_iter_test");
+    do_test(dir.valid());
+    std::set<std::string> names;
+    struct stat buf;
+    while (const dir_iter_t::entry_t *entry = dir.next()) {
+        const std::string name = entry->name;
+        names.insert(name);
+        if (name == "file") {
+            // A file may have an unknown type, but must never claim to be a directory.
+            do_test(!entry->is_dir());
+            do_test(dir.stat(entry->name, &buf) == 0 && S_ISREG(buf.st_mode));
+            do_test(!dir_iter_t(dir, entry->name).valid());
+        } else if (name == "dir") {
+            do_test(entry->maybe_dir());
+            do_test(dir.stat(entry->name, &buf) == 0 && S_ISDIR(buf.st_mode));
+            do_test(dir_iter_t(dir, entry->name).valid());
+        } else if (name == "link") {
+            // Symlinks are never considered known, so callers look at what they point to.
+            do_test(!entry->type_known() && entry->maybe_dir());
+            do_test(dir.lstat(entry->name, &buf) == 0 && S_ISLNK(buf.st_mode));
+            do_test(dir.stat(entry->name, &buf) == 0 && S_ISDIR(buf.st_mode));
+        }
+    }
+    do_test(names == (std::set<std::string>{".", "..", "dir", "file", "link"}));
+    do_test(dir.access("file", F_OK) == 0);
+    do_test(dir.access("nope", F_OK) != 0);
+
+    // Rewinding starts over.
+    dir.rewind();
+    size_t count = 0;
+    while (dir.next()) count++;
+    do_test(count == names.size());
+
+    // Cached listings match the directory, and are dropped once it changes. Backdate the directory
+    // so its listing gets cached, then add a file while keeping the same modification time: only
+    // the change time tells the cache the listing is stale.
+    const auto cached_names = [] {
+        std::set<std::string> result;
+        dir_iter_t cached(L"test/fish_dir_iter_test", true);
+        while (const dir_iter_t::entry_t *entry = cached.next()) result.insert(entry->name);
+        return result;
+    };
+    struct timeval old_times[2] = {};
+    old_times[0].tv_sec = old_times[1].tv_sec = time(NULL) - 3600;
+    if (utimes("test/fish_dir_iter_test", old_times)) err(L"utimes failed");
+    do_test(cached_names() == names);
+    do_test(cached_names() == names);
+    if (system("touch test/fish_dir_iter_test/new")) err(L"touch failed");
+    if (utimes("test/fish_dir_iter_test", old_times)) err(L"utimes failed");
+    names.insert("new");
+    do_test(cached_names() == names);
+
+    if (system("rm -Rf test/fish_dir_iter_test/")) err(L"rm failed");
+}
+
 /// Test globbing and other parameter expansion.
 static void test_expand() {
     say(L"Testing parameter expansion");
@@ -1505,6 +1684,14 @@ static void test_expand() {
     expand_test(L"foo\\$bar", EXPAND_SKIP_VARIABLES, L"foo$bar", 0,
                 L"Failed to handle dollar sign in variable-skipping expansion");
 
+    env_push(true);
+    env_set(L"fish_expand_var", ENV_LOCAL, {L"x", L"y"});
+    expand_test(L"a{b,c}$fish_expand_var", 0, L"abx", L"aby", L"acx", L"acy", 0,
+                L"Variables and brackets do not combine");
+    expand_test(L"'a{b}'\"$fish_expand_var[2]\"", 0, L"a{b}y", 0,
+                L"Quoted variables are broken");
+    env_pop();
+
     // bb
     //    x
     // bar
@@ -1576,6 +1763,13 @@ static void test_expand() {
     expand_test(L"test/fish_expand_test/**/q", 0, L"test/fish_expand_test/lol/nub/q", wnull,
                 L"Glob did the wrong thing 7");
 
+    // Recursive walks are spread across threads, but must still skip directories that are their
+    // own ancestors.
+    if (symlink("..", "test/fish_expand_test/lol/nub/loop")) err(L"symlink failed");
+    expand_test(L"test/fish_expand_test/l**/q", 0, L"test/fish_expand_test/lol/nub/q", wnull,
+                L"Glob did not stop at a symlink loop");
+    if (unlink("test/fish_expand_test/lol/nub/loop")) err(L"unlink failed");
+
     expand_test(L"test/fish_expand_test/BA", EXPAND_FOR_COMPLETIONS, L"test/fish_expand_test/bar",
                 L"test/fish_expand_test/bax/", L"test/fish_expand_test/baz/", wnull,
                 L"Case insensitive test did the wrong thing");
@@ -1615,6 +1809,31 @@ static void test_expand() {
         err(L"Expansion not correctly handling literal path components in dotfiles");
     }
 
+    // A cancellation checker is polled during expansion, and stops it once it returns true.
+    size_t poll_count = 0;
+    std::vector<completion_t> output;
+    const cancel_checker_t never_cancel = [&poll_count] { return ++poll_count == 0; };
+    if (expand_string(L"test/fish_expand_test/**", &output, 0, NULL, never_cancel) !=
+            EXPAND_WILDCARD_MATCH ||
+        output.empty() || poll_count == 0) {
+        err(L"Expansion did not poll its cancellation checker");
+    }
+    output.clear();
+    const cancel_checker_t always_cancel = [] { return true; };
+    if (expand_string(L"test/fish_expand_test/**", &output, 0, NULL, always_cancel) !=
+            EXPAND_ERROR ||
+        !output.empty()) {
+        err(L"Cancelled expansion still produced results");
+    }
+    if (wildcard_expand_string(L"**", L"test/fish_expand_test/", 0, &output, always_cancel) != -1) {
+        err(L"Cancelled wildcard expansion did not report the cancellation");
+    }
+    output.clear();
+    complete(L"echo test/fish_expand_test/b", &output, COMPLETION_REQUEST_DEFAULT, always_cancel);
+    if (!output.empty()) {
+        err(L"Cancelled completion still produced results");
+    }
+
     if (!pushd("test/fish_expand_test")) return;
 
     expand_test(L"b/xx", EXPAND_FOR_COMPLETIONS | EXPAND_FUZZY_MATCH, L"bax/xxx", L"baz/xxx", wnull,
@@ -1627,6 +1846,36 @@ static void test_expand() {
     popd();
 }
 
+static void test_wildcard_pattern() {
+    say(L"Testing compiled wildcards");
+    // Compiled wildcards must agree with wildcard_match() on every string. Use '?', '*' and '#'
+    // for ANY_CHAR, ANY_STRING and ANY_STRING_RECURSIVE.
+    const wchar_t *const wildcards[] = {
+        L"",      L"abc",      L"a?c",   L"*",    L"?",     L"a*",     L"*c",   L"a*c",
+        L"*b*",   L"a*b*c",    L"ab*bc", L"*.*",  L".*",    L"..",     L"?*?",  L"#",
+        L"a#c",   L"*abc*abc", L"??",    L"*a*a", L"abc*",  L"**",     L"a?*b", L"*bc*bc*"};
+    const wchar_t *const strs[] = {L"",      L"a",     L"abc",  L"abbc",  L"ac",    L"abcabc",
+                                   L"aXbYc", L".",     L"..",   L".abc",  L"a.b",   L"bc",
+                                   L"abcbc", L"aa",    L"aaa",  L"ab",    L"xbcbc", L"..."};
+    for (const wchar_t *raw : wildcards) {
+        wcstring wc = raw;
+        for (wchar_t &c : wc) {
+            if (c == L'?') c = ANY_CHAR;
+            if (c == L'*') c = ANY_STRING;
+            if (c == L'#') c = ANY_STRING_RECURSIVE;
+        }
+        for (bool leading_dots : {false, true}) {
+            const wildcard_pattern_t pattern(wc, leading_dots);
+            for (const wchar_t *str : strs) {
+                if (pattern.match(str) != wildcard_match(str, wc, leading_dots)) {
+                    err(L"Compiled wildcard '%ls' disagrees on '%ls' (leading dots %d)", raw, str,
+                        int(leading_dots));
+                }
+            }
+        }
+    }
+}
+
 static void test_fuzzy_match() {
     say(L"Testing fuzzy string matching");
 
@@ -2787,6 +3036,79 @@ static void test_universal_callbacks() {
     system("rm -Rf test/fish_uvars_test/");
 }
 
+static off_t uvars_test_file_size() {
+    struct stat buf = {};
+    if (wstat(UVARS_TEST_PATH, &buf) != 0) return -1;
+    return buf.st_size;
+}
+
+static void test_universal_journal() {
+    say(L"Testing universal variable journal");
+    if (system("mkdir -p test/fish_uvars_test/")) err(L"mkdir failed");
+    callback_data_list_t callbacks;
+    env_universal_t uvars1(UVARS_TEST_PATH);
+    env_universal_t uvars2(UVARS_TEST_PATH);
+
+    for (int i = 0; i < 100; i++) {
+        uvars1.set(format_string(L"key_%d", i), {L"1"}, false);
+    }
+    uvars1.sync(callbacks);
+    uvars2.sync(callbacks);
+
+    // A change appends a record, and a peer reads just that record.
+    off_t size_before = uvars_test_file_size();
+    uvars1.set(L"key_0", {L"2"}, false);
+    do_test(uvars1.sync(callbacks));
+    do_test(uvars_test_file_size() == size_before + (off_t)strlen("SET key_0:2\n"));
+
+    callbacks.clear();
+    uvars2.sync(callbacks);
+    do_test(callbacks.size() == 1);
+    do_test(callbacks.at(0).type == SET && callbacks.at(0).key == L"key_0");
+
+    // An erasure rewrites the file without the variable, since older versions of fish would not
+    // understand an appended erasure.
+    uvars1.set(L"key_3", {L"2"}, false);
+    uvars1.remove(L"key_1");
+    do_test(uvars1.sync(callbacks));
+    do_test(uvars_test_file_size() < size_before);
+    FILE *f = wfopen(UVARS_TEST_PATH, "r");
+    do_test(f != NULL);
+    char line[256];
+    while (f && fgets(line, sizeof line, f)) {
+        if (strstr(line, "key_1:") || !strncmp(line, "ERASE", 5)) err(L"Erased uvar still in file");
+    }
+    if (f) fclose(f);
+
+    callbacks.clear();
+    uvars2.sync(callbacks);
+    std::sort(callbacks.begin(), callbacks.end(), callback_data_less_than);
+    do_test(callbacks.size() == 2);
+    do_test(callbacks.at(0).type == ERASE && callbacks.at(0).key == L"key_1");
+    do_test(callbacks.at(1).type == SET && callbacks.at(1).key == L"key_3");
+
+    // Repeated changes eventually compact the journal.
+    for (int i = 0; i < 1000; i++) {
+        uvars1.set(L"key_2", {format_string(L"%d", i)}, false);
+        uvars1.sync(callbacks);
+    }
+    do_test(uvars_test_file_size() < size_before * 4);
+
+    // A peer and a fresh reader agree on the result.
+    callbacks.clear();
+    uvars2.sync(callbacks);
+    do_test(callbacks.size() == 1);
+    env_universal_t uvars3(UVARS_TEST_PATH);
+    uvars3.load(callbacks);
+    for (env_universal_t *uvars : {&uvars2, &uvars3}) {
+        do_test(uvars->get(L"key_0") == env_var_t(wcstring(L"2"), 0));
+        do_test(!uvars->get(L"key_1"));
+        do_test(uvars->get(L"key_2") == env_var_t(wcstring(L"999"), 0));
+        do_test(uvars->get_names(true, true).size() == 99);
+    }
+    system("rm -Rf test/fish_uvars_test/");
+}
+
 bool poll_notifier(const std::unique_ptr<universal_notifier_t> &note) {
     bool result = false;
     if (note->usec_delay_between_polls() > 0) {
@@ -2820,6 +3142,16 @@ static void trigger_or_wait_for_notification(universal_notifier_t::notifier_stra
         case universal_notifier_t::strategy_named_pipe: {
             break;  // nothing required
         }
+        case universal_notifier_t::strategy_inotify: {
+            // inotify notices writes to the variables file itself, rather than posts.
+            int fd = wopen_cloexec(UVARS_TEST_PATH, O_WRONLY | O_APPEND);
+            if (fd < 0) {
+                err(L"Unable to open %ls for writing", UVARS_TEST_PATH);
+            } else {
+                close(fd);
+            }
+            break;
+        }
     }
 }
 
@@ -2898,6 +3230,12 @@ class history_tests_t {
     static void test_history();
     static void test_history_merge();
     static void test_history_formats();
+    static void test_history_index();
+    static void test_history_search_index();
+    static void test_history_item_views();
+    static void test_history_parallel_search();
+    static void test_history_binary_format();
+    static void test_history_background_vacuum();
     // static void test_history_speed(void);
     static void test_history_races();
     static void test_history_races_pound_on_history(size_t item_count);
@@ -3358,6 +3696,410 @@ void history_tests_t::test_history_formats() {
     }
 }
 
+void history_tests_t::test_history_index() {
+    say(L"Testing history index");
+    const wcstring name = L"index_test";
+    wcstring data_path;
+    if (!path_get_data(data_path)) {
+        err(L"Failed to get data directory");
+        return;
+    }
+    const wcstring history_path = data_path + L"/" + name + L"_history";
+    const wcstring index_path = history_path + L".index";
+
+    std::unique_ptr<history_t> writer = make_unique<history_t>(name);
+    writer->clear();
+    time_barrier();
+
+    // The first save creates the file and its index by rewriting; the rest append to both.
+    writer->add(L"index_item_1");
+    writer->save();
+    writer->add(L"index_item_2");
+    writer->save();
+    writer->add(L"index_item_3");
+    writer->save();
+    do_test(waccess(index_path, F_OK) == 0);
+
+    // Append an item without updating the index, like an older fish would. It should be found by
+    // scanning the part of the file past the index.
+    FILE *f = wfopen(history_path, "a");
+    if (!f) {
+        err(L"Couldn't open history file %ls", history_path.c_str());
+    } else {
+        fprintf(f, "- cmd: index_item_4\n  when: %ld\n", (long)time(NULL));
+        fclose(f);
+    }
+    time_barrier();
+
+    const wchar_t *const expected[] = {L"index_item_4", L"index_item_3", L"index_item_2",
+                                       L"index_item_1", NULL};
+    history_t with_index(name);
+    if (!history_equals(with_index, expected)) {
+        err(L"test_history_index failed with the index");
+    }
+
+    // The index must not change what we find.
+    wunlink(index_path);
+    history_t without_index(name);
+    if (!history_equals(without_index, expected)) {
+        err(L"test_history_index failed without the index");
+    }
+    writer->clear();
+}
+
+void history_tests_t::test_history_search_index() {
+    say(L"Testing history search index");
+    const wcstring name = L"search_index_test";
+    std::unique_ptr<history_t> writer = make_unique<history_t>(name);
+    writer->clear();
+    time_barrier();
+    const wchar_t *const texts[] = {L"git commit -m 'Fix the thing'", L"git checkout master",
+                                    L"make install", L"echo Hello World",
+                                    L"echo one\necho two\\n"};
+    for (const wchar_t *text : texts) {
+        writer->add(text);
+    }
+    writer->save();
+    time_barrier();
+
+    // Search a fresh history, so that every item comes from the file and goes through the index.
+    history_t reader(name);
+    history_search_t searcher;
+    searcher = history_search_t(reader, L"check");
+    test_history_matches(searcher, 1, __LINE__);
+    searcher = history_search_t(reader, L"git", HISTORY_SEARCH_TYPE_PREFIX);
+    test_history_matches(searcher, 2, __LINE__);
+    searcher = history_search_t(reader, L"it");
+    test_history_matches(searcher, 2, __LINE__);
+    searcher = history_search_t(reader, L"hello");
+    test_history_matches(searcher, 0, __LINE__);
+    searcher = history_search_t(reader, L"hello", HISTORY_SEARCH_TYPE_CONTAINS, false);
+    test_history_matches(searcher, 1, __LINE__);
+    searcher = history_search_t(reader, L"THE THING", HISTORY_SEARCH_TYPE_CONTAINS, false);
+    test_history_matches(searcher, 1, __LINE__);
+    searcher = history_search_t(reader, L"one\necho two\\n");
+    test_history_matches(searcher, 1, __LINE__);
+    searcher = history_search_t(reader, L"make install", HISTORY_SEARCH_TYPE_EXACT);
+    test_history_matches(searcher, 1, __LINE__);
+    searcher = history_search_t(reader, L"xyzzy");
+    test_history_matches(searcher, 0, __LINE__);
+
+    // Searches of the same history keep their own candidates, so they can be interleaved.
+    history_search_t check_search(reader, L"check"), make_search(reader, L"make");
+    do_test(check_search.go_backwards());
+    do_test(make_search.go_backwards());
+    do_test(check_search.current_string() == L"git checkout master");
+    do_test(make_search.current_string() == L"make install");
+    do_test(!check_search.go_backwards());
+    do_test(!make_search.go_backwards());
+
+    // Items the index rules out come back as ruled out views, which are not the end of history.
+    history_search_candidates_t candidates;
+    candidates.term = L"xyzzy";
+    history_item_view_t view = reader.item_view_at_index(1, &candidates);
+    do_test(view.ruled_out() && !view.empty());
+    do_test(candidates.usable && candidates.offsets.empty());
+
+    // Items appended to the file later are picked up by the index too.
+    writer->add(L"git checkout -b feature");
+    writer->save();
+    time_barrier();
+    reader.incorporate_external_changes();
+    searcher = history_search_t(reader, L"checkout");
+    test_history_matches(searcher, 2, __LINE__);
+    writer->clear();
+}
+
+void history_tests_t::test_history_item_views() {
+    say(L"Testing history item views");
+    const wcstring name = L"view_test";
+    std::unique_ptr<history_t> writer = make_unique<history_t>(name);
+    writer->clear();
+    time_barrier();
+    writer->add(L"echo back\\slash");
+    writer->add(L"echo one\ntwo");
+    writer->add(L"ls -l");
+    writer->save();
+    time_barrier();
+
+    // Views into the file match against its escaped bytes.
+    history_t reader(name);
+    history_item_view_t view = reader.item_view_at_index(1);
+    do_test(!view.empty());
+    do_test(view.may_match("ls", HISTORY_SEARCH_TYPE_PREFIX, true));
+    do_test(!view.may_match("-l", HISTORY_SEARCH_TYPE_PREFIX, true));
+    do_test(view.may_match("-l", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(!view.may_match("l -", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(view.item().str() == L"ls -l");
+
+    view = reader.item_view_at_index(2);
+    do_test(view.may_match("one\ntwo", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(!view.may_match("one\\ntwo", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(view.item().str() == L"echo one\ntwo");
+
+    view = reader.item_view_at_index(3);
+    do_test(view.may_match("k\\s", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(!view.may_match("k\\\\s", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(view.may_match("echo back\\slash", HISTORY_SEARCH_TYPE_EXACT, true));
+    do_test(!view.may_match("echo back", HISTORY_SEARCH_TYPE_EXACT, true));
+    do_test(!view.may_match("ECHO", HISTORY_SEARCH_TYPE_PREFIX, true));
+    do_test(view.may_match("echo", HISTORY_SEARCH_TYPE_PREFIX, false));
+    do_test(view.item().str() == L"echo back\\slash");
+
+    // Case insensitive searches fold the contents of the decoded item; terms are lowercase.
+    history_item_t mixed(L"Echo MUnich");
+    do_test(mixed.matches_search(L"echo munich", HISTORY_SEARCH_TYPE_EXACT, false));
+    do_test(!mixed.matches_search(L"echo munich", HISTORY_SEARCH_TYPE_EXACT, true));
+    do_test(mixed.matches_search(L"echo m", HISTORY_SEARCH_TYPE_PREFIX, false));
+    do_test(mixed.matches_search(L"unic", HISTORY_SEARCH_TYPE_CONTAINS, false));
+    do_test(!mixed.matches_search(L"unic", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(!mixed.matches_search(L"munich!", HISTORY_SEARCH_TYPE_CONTAINS, false));
+    do_test(mixed.matches_search(L"e*m", HISTORY_SEARCH_TYPE_PREFIX_GLOB, false));
+
+    do_test(reader.item_view_at_index(4).empty());
+    writer->clear();
+}
+
+void history_tests_t::test_history_parallel_search() {
+    say(L"Testing parallel history search");
+    const wcstring name = L"parallel_search_test";
+    wcstring data_path;
+    if (!path_get_data(data_path)) {
+        err(L"Failed to get data directory");
+        return;
+    }
+    const wcstring history_path = data_path + L"/" + name + L"_history";
+
+    // Write a large history file directly; adding this many items one at a time is too slow. Every
+    // command is repeated a few times, so that deduplication happens across chunks.
+    const size_t item_count = 20000;
+    FILE *f = wfopen(history_path, "w");
+    if (!f) {
+        err(L"Couldn't open history file %ls", history_path.c_str());
+        return;
+    }
+    for (size_t i = 0; i < item_count; i++) {
+        fprintf(f, "- cmd: %s %lu --flag\\\\value\n  when: %lu\n", i % 3 ? "echo" : "ECHO",
+                (unsigned long)(i % (item_count / 4)), (unsigned long)(1000 + i));
+    }
+    fclose(f);
+
+    // Don't let adding an item save the history, which might vacuum it.
+    history_t history(name);
+    history.disable_automatic_saving();
+    history.add(L"echo 7 recent");
+    do_test(history.size() == item_count + 1);
+
+    struct {
+        const wchar_t *term;
+        history_search_type_t type;
+        bool case_sensitive;
+        size_t max_items;
+    } searches[] = {
+        {L"echo 1", HISTORY_SEARCH_TYPE_PREFIX, true, (size_t)-1},
+        {L"echo 1", HISTORY_SEARCH_TYPE_PREFIX, false, (size_t)-1},
+        {L"7", HISTORY_SEARCH_TYPE_CONTAINS, true, (size_t)-1},
+        {L"7", HISTORY_SEARCH_TYPE_CONTAINS, true, 10},
+        {L"7", HISTORY_SEARCH_TYPE_CONTAINS, true, 3000},
+        {L"echo", HISTORY_SEARCH_TYPE_PREFIX, false, 1},
+        {L"flag\\v", HISTORY_SEARCH_TYPE_CONTAINS, true, (size_t)-1},
+        {L"ECHO 2*9 -", HISTORY_SEARCH_TYPE_PREFIX_GLOB, true, (size_t)-1},
+        {L"echo 1234 --flag\\value", HISTORY_SEARCH_TYPE_EXACT, false, (size_t)-1},
+        {L"no such command", HISTORY_SEARCH_TYPE_CONTAINS, true, (size_t)-1},
+    };
+    double serial_time = 0, parallel_time = 0;
+    for (const auto &search : searches) {
+        double start = timef();
+        std::vector<history_item_t> serial = history.find_matching_items(
+            search.term, search.type, search.case_sensitive, search.max_items, false);
+        double mid = timef();
+        std::vector<history_item_t> parallel = history.find_matching_items(
+            search.term, search.type, search.case_sensitive, search.max_items, true);
+        double end = timef();
+        serial_time += mid - start;
+        parallel_time += end - mid;
+
+        bool same = serial.size() == parallel.size();
+        for (size_t i = 0; same && i < serial.size(); i++) {
+            same = serial.at(i).str() == parallel.at(i).str() &&
+                   serial.at(i).timestamp() == parallel.at(i).timestamp();
+        }
+        if (!same) {
+            err(L"Parallel search for '%ls' found %lu items, but serial search found %lu",
+                search.term, (unsigned long)parallel.size(), (unsigned long)serial.size());
+        }
+    }
+    say(L"Searched %lu items: serial %.0f msec, parallel %.0f msec", (unsigned long)item_count,
+        serial_time * 1000, parallel_time * 1000);
+    history.clear();
+}
+
+void history_tests_t::test_history_binary_format() {
+    say(L"Testing binary history format");
+    const wcstring name = L"binary_test";
+    wcstring data_path;
+    if (!path_get_data(data_path)) {
+        err(L"Failed to get data directory");
+        return;
+    }
+    const wcstring history_path = data_path + L"/" + name + L"_history";
+    const wcstring binary_path = history_path + L".bin";
+    auto read_file = [](const wcstring &path) {
+        std::string contents;
+        char buf[1024];
+        FILE *f = wfopen(path, "r");
+        if (!f) return contents;
+        while (size_t amt = fread(buf, 1, sizeof buf, f)) contents.append(buf, amt);
+        fclose(f);
+        return contents;
+    };
+    auto file_starts_with = [&](const wcstring &path, const char *prefix, size_t len) {
+        return read_file(path).compare(0, len, prefix, len) == 0;
+    };
+
+    std::unique_ptr<history_t> writer = make_unique<history_t>(name);
+    writer->clear();
+    time_barrier();
+    writer->add(L"echo back\\slash");
+    writer->disable_automatic_saving();
+    writer->add(L"cat file", 42);
+    writer->set_valid_file_paths({L"file", L"other file"}, 42);
+    writer->enable_automatic_saving();
+    writer->add(L"echo one\ntwo");
+    writer->save();
+    do_test(file_starts_with(history_path, "- cmd:", 6));
+    const std::string text_contents = read_file(history_path);
+
+    // Convert to binary, and append another item. The binary history has its own file, and the
+    // text file is left for older versions of fish.
+    do_test(writer->convert(history_type_binary));
+    do_test(file_starts_with(binary_path, "\0fishhis", 8));
+    writer->add(L"echo \xe9t\xe9");
+    writer->save();
+    do_test(file_starts_with(binary_path, "\0fishhis", 8));
+    do_test(read_file(history_path) == text_contents);
+    time_barrier();
+
+    const wchar_t *const expected[] = {L"echo \xe9t\xe9", L"echo one\ntwo", L"cat file",
+                                       L"echo back\\slash", NULL};
+    history_t reader(name);
+    do_test(history_equals(reader, expected));
+    path_list_t expected_paths = {L"file", L"other file"};
+    do_test(reader.item_at_index(3).get_required_paths() == expected_paths);
+
+    // Views can rule out binary items without decoding them.
+    history_item_view_t view = reader.item_view_at_index(2);
+    do_test(view.may_match("one\ntwo", HISTORY_SEARCH_TYPE_CONTAINS, true));
+    do_test(!view.may_match("two", HISTORY_SEARCH_TYPE_PREFIX, true));
+    do_test(view.may_match("ECHO ONE", HISTORY_SEARCH_TYPE_PREFIX, false));
+    history_search_t searcher(reader, L"slash");
+    test_history_matches(searcher, 1, __LINE__);
+
+    // Items from after our session started are ignored.
+    writer->add(L"echo newer");
+    writer->save();
+    do_test(history_equals(reader, expected));
+
+    // A damaged record only loses that record: the ones after it are found by their markers.
+    std::string binary_contents = read_file(binary_path);
+    size_t damaged = binary_contents.find("cat file");
+    do_test(damaged != std::string::npos);
+    binary_contents[damaged] = 'C';
+    FILE *f = wfopen(binary_path, "w");
+    do_test(f != NULL);
+    if (f) {
+        fwrite(binary_contents.data(), 1, binary_contents.size(), f);
+        fclose(f);
+    }
+    const wchar_t *const expected_damaged[] = {L"echo newer", L"echo \xe9t\xe9", L"echo one\ntwo",
+                                               L"echo back\\slash", NULL};
+    history_t damaged_reader(name);
+    do_test(history_equals(damaged_reader, expected_damaged));
+
+    // Convert back. This replaces the text file and removes the binary one.
+    do_test(writer->convert(history_type_fish_2_0));
+    do_test(file_starts_with(history_path, "- cmd:", 6));
+    do_test(read_file(binary_path).empty());
+    history_t text_reader(name);
+    do_test(text_reader.item_at_index(1).str() == L"echo newer");
+    do_test(text_reader.item_at_index(3).str() == L"echo one\ntwo");
+
+    // A binary file from a later version of fish is neither read nor written.
+    const std::string future("\0fishhis\x63\0\0\0future data", 23);
+    f = wfopen(binary_path, "w");
+    do_test(f != NULL);
+    if (f) {
+        fwrite(future.data(), 1, future.size(), f);
+        fclose(f);
+    }
+    history_t future_history(name);
+    do_test(future_history.item_at_index(1).empty());
+    future_history.add(L"echo present");
+    future_history.save();
+    do_test(!future_history.convert(history_type_binary));
+    do_test(read_file(binary_path) == future);
+    wunlink(binary_path);
+    writer->clear();
+}
+
+void history_tests_t::test_history_background_vacuum() {
+    say(L"Testing background history vacuum");
+    const wcstring name = L"vacuum_test";
+    wcstring data_path;
+    if (!path_get_data(data_path)) {
+        err(L"Failed to get data directory");
+        return;
+    }
+    const wcstring history_path = data_path + L"/" + name + L"_history";
+    auto items_in_file = [&]() {
+        size_t count = 0;
+        char line[256];
+        FILE *f = wfopen(history_path, "r");
+        if (!f) return count;
+        while (fgets(line, sizeof line, f)) {
+            if (!strncmp(line, "- cmd:", 6)) count++;
+        }
+        fclose(f);
+        return count;
+    };
+
+    // Appending leaves duplicates in the file.
+    std::unique_ptr<history_t> writer = make_unique<history_t>(name);
+    writer->clear();
+    time_barrier();
+    writer->add(L"echo dup");
+    writer->save();
+    writer->add(L"echo other");
+    writer->save();
+    writer->add(L"echo dup");
+    writer->save();
+    do_test(items_in_file() == 3);
+
+    // The vacuum removes them, while we can keep adding items.
+    {
+        scoped_lock locker(writer->lock);
+        writer->start_background_vacuum();
+    }
+    writer->add(L"echo during");
+    writer->wait_for_background_vacuum();
+    writer->save();
+    do_test(items_in_file() == 3);
+    time_barrier();
+
+    const wchar_t *const expected[] = {L"echo during", L"echo dup", L"echo other", NULL};
+    history_t reader(name);
+    do_test(history_equals(reader, expected));
+
+    // A vacuum does not bring back a history which has been cleared.
+    {
+        scoped_lock locker(writer->lock);
+        writer->start_background_vacuum();
+    }
+    writer->clear();
+    writer->wait_for_background_vacuum();
+    do_test(waccess(history_path, F_OK) != 0);
+}
+
 #if 0
 // This test isn't run at this time. It was added by commit b9283d48 but not actually enabled.
 void history_tests_t::test_history_speed(void)
@@ -4345,6 +5087,150 @@ static void test_env_vars() {
     // TODO: Add tests for the locale and ncurses vars.
 }
 
+static void test_env_vars_speed() {
+    say(L"Testing env_get speed on large lists");
+    const size_t list_size = 10000;
+    wcstring_list_t vals;
+    for (size_t i = 0; i < list_size; i++) {
+        vals.push_back(to_string(i));
+    }
+    env_push(true);
+    env_set(L"test_env_big_list", ENV_LOCAL, vals);
+
+    // Looking up a variable shares its values rather than copying them.
+    const size_t iterations = 100000;
+    size_t total = 0;
+    double start = timef();
+    for (size_t i = 0; i < iterations; i++) {
+        auto var = env_get(L"test_env_big_list");
+        if (var) total += var->as_list().size();
+    }
+    double end = timef();
+    env_pop();
+
+    do_test(total == iterations * list_size);
+    say(L"    %lu lookups of a %lu element list took %.02f msec", (unsigned long)iterations,
+        (unsigned long)list_size, (end - start) * 1000.0);
+}
+
+/// Return the value of the given variable in the exported environment, or "(missing)".
+static std::string exported_value(const char *name) {
+    size_t len = strlen(name);
+    for (const char *const *cursor = env_export_arr(); *cursor != NULL; cursor++) {
+        if (!strncmp(*cursor, name, len) && (*cursor)[len] == '=') return *cursor + len + 1;
+    }
+    return "(missing)";
+}
+
+static void test_env_export_arr() {
+    say(L"Testing exported environment");
+    env_set_one(L"test_env_export_global", ENV_GLOBAL | ENV_EXPORT, L"global");
+    do_test(exported_value("test_env_export_global") == "global");
+
+    env_push(true);
+    env_set_one(L"test_env_export_global", ENV_LOCAL | ENV_EXPORT, L"local");
+    env_set_one(L"test_env_export_local", ENV_LOCAL | ENV_EXPORT, L"local");
+    do_test(exported_value("test_env_export_global") == "local");
+    do_test(exported_value("test_env_export_local") == "local");
+
+    // An unexported local hides the exported global.
+    env_set_one(L"test_env_export_global", ENV_LOCAL | ENV_UNEXPORT, L"hidden");
+    do_test(exported_value("test_env_export_global") == "(missing)");
+
+    // A new scope reveals it again, but still sees exported locals.
+    env_push(true);
+    do_test(exported_value("test_env_export_global") == "global");
+    do_test(exported_value("test_env_export_local") == "local");
+    env_pop();
+    do_test(exported_value("test_env_export_global") == "(missing)");
+
+    // So does popping a block whose unexported locals hid it, while its other locals don't matter.
+    env_push(false);
+    env_set_one(L"test_env_export_local", ENV_LOCAL | ENV_UNEXPORT, L"hidden");
+    env_set_one(L"test_env_export_other", ENV_LOCAL | ENV_UNEXPORT, L"other");
+    do_test(exported_value("test_env_export_local") == "(missing)");
+    env_push(true);
+    do_test(exported_value("test_env_export_global") == "global");
+    do_test(exported_value("test_env_export_local") == "(missing)");
+    do_test(exported_value("test_env_export_other") == "(missing)");
+    env_pop();
+    env_pop();
+    do_test(exported_value("test_env_export_local") == "local");
+    do_test(exported_value("test_env_export_other") == "(missing)");
+
+    env_pop();
+    do_test(exported_value("test_env_export_global") == "global");
+    do_test(exported_value("test_env_export_local") == "(missing)");
+
+    env_remove(L"test_env_export_global", ENV_GLOBAL);
+    do_test(exported_value("test_env_export_global") == "(missing)");
+
+    // An unexported global or local does not hide an exported universal; a full rebuild of the
+    // export table keeps the universal too.
+    env_set_one(L"test_env_export_uvar", ENV_UNIVERSAL | ENV_EXPORT, L"uni");
+    do_test(exported_value("test_env_export_uvar") == "uni");
+    env_set_one(L"test_env_export_uvar", ENV_GLOBAL | ENV_UNEXPORT, L"glob");
+    do_test(exported_value("test_env_export_uvar") == "uni");
+    env_set_one(L"test_env_export_uvar", ENV_GLOBAL | ENV_UNEXPORT, L"glob2");
+    do_test(exported_value("test_env_export_uvar") == "uni");
+    env_push(true);
+    env_set_one(L"test_env_export_uvar", ENV_LOCAL | ENV_UNEXPORT, L"local");
+    do_test(exported_value("test_env_export_uvar") == "uni");
+    env_pop();
+    do_test(exported_value("test_env_export_uvar") == "uni");
+    env_remove(L"test_env_export_uvar", ENV_GLOBAL);
+    env_remove(L"test_env_export_uvar", ENV_UNIVERSAL);
+    do_test(exported_value("test_env_export_uvar") == "(missing)");
+}
+
+static void test_env_inherited_exports() {
+    say(L"Testing inherited exported locals");
+    auto exported_as = [](const wchar_t *name, const wchar_t *val) {
+        auto var = env_get(name);
+        return var && var->exports() && var->as_string() == val;
+    };
+    env_push(true);
+    env_set_one(L"test_env_inherit_x", ENV_LOCAL | ENV_EXPORT, L"outer");
+    env_set_one(L"test_env_inherit_u", ENV_LOCAL | ENV_UNEXPORT, L"outer");
+
+    // A new scope sees exported locals of the scope it was pushed from, but not unexported ones.
+    env_push(true);
+    do_test(exported_as(L"test_env_inherit_x", L"outer"));
+    do_test(!env_get(L"test_env_inherit_u"));
+
+    // Even through scopes that don't export anything themselves.
+    env_set_one(L"test_env_inherit_u", ENV_LOCAL | ENV_UNEXPORT, L"middle");
+    env_push(true);
+    do_test(exported_value("test_env_inherit_x") == "outer");
+    wcstring_list_t names = env_get_names(ENV_LOCAL | ENV_EXPORT);
+    do_test(std::count(names.begin(), names.end(), L"test_env_inherit_x") == 1);
+
+    // Changing or erasing an inherited variable doesn't affect the scope it came from.
+    env_set_one(L"test_env_inherit_x", ENV_LOCAL | ENV_EXPORT, L"inner");
+    do_test(exported_as(L"test_env_inherit_x", L"inner"));
+    env_remove(L"test_env_inherit_x", ENV_LOCAL);
+    do_test(!env_get(L"test_env_inherit_x"));
+    env_pop();
+    do_test(exported_as(L"test_env_inherit_x", L"outer"));
+
+    // An unexported local hides an inherited variable from new scopes too.
+    env_set_one(L"test_env_inherit_x", ENV_LOCAL | ENV_UNEXPORT, L"hidden");
+    env_push(true);
+    do_test(!env_get(L"test_env_inherit_x"));
+    env_pop();
+
+    // Erasing it erases the inherited variable too.
+    env_remove(L"test_env_inherit_x", ENV_LOCAL);
+    do_test(!env_get(L"test_env_inherit_x"));
+    do_test(exported_value("test_env_inherit_x") == "(missing)");
+    env_pop();
+
+    do_test(exported_as(L"test_env_inherit_x", L"outer"));
+    auto unexported = env_get(L"test_env_inherit_u");
+    do_test(unexported && !unexported->exports() && unexported->as_string() == L"outer");
+    env_pop();
+}
+
 static void test_illegal_command_exit_code() {
     say(L"Testing illegal command exit code");
 
@@ -4384,6 +5270,53 @@ static void test_illegal_command_exit_code() {
     popd();
 }
 
+/// Pipelines with internal processes used to fork a keepalive process to hold the job's process
+/// group open. Check that they no longer do, and that a group whose leader was reaped while the
+/// pipeline was being launched is replaced rather than joined.
+static void test_pipeline_fork_count() {
+    say(L"Testing fork counts of pipelines with internal processes");
+    if (!pushd("test/temp")) return;
+
+    // Jobs run from event handlers are not given the terminal, which we may not have here.
+    int saved_job_control_mode = job_control_mode;
+    job_control_mode = JOB_CONTROL_ALL;
+    is_event++;
+    const io_chain_t empty_ios;
+    parser_t &parser = parser_t::principal_parser();
+    // Waiting for the background job reaps the pipeline's group leader before the last process is
+    // launched.
+    parser.eval(L"function fork_count_mid; read -l x; string upper $x; command true &; wait; end",
+                empty_ios, TOP);
+
+    // Each iteration runs three external commands.
+    const int iterations = 50;
+    const int forks_per_iteration = 3;
+    int start_forks = g_fork_count;
+    double start = timef();
+    for (int i = 0; i < iterations; i++) {
+        parser.eval(L"command echo foo | fork_count_mid | command cat > fork_count.txt\n"
+                    L"read -g fork_count_result < fork_count.txt",
+                    empty_ios, TOP);
+        auto result = env_get(L"fork_count_result");
+        if (!result || result->as_string() != L"FOO") {
+            err(L"Pipeline output was '%ls', expected 'FOO'",
+                result ? result->as_string().c_str() : L"(missing)");
+            break;
+        }
+    }
+    double end = timef();
+    int forks = g_fork_count - start_forks;
+
+    say(L"    %d pipelines took %d forks and %.02f msec", iterations, forks, (end - start) * 1000.0);
+    do_test(forks == iterations * forks_per_iteration);
+
+    parser.eval(L"functions -e fork_count_mid; set -e fork_count_result", empty_ios, TOP);
+    is_event--;
+    job_control_mode = saved_job_control_mode;
+    unlink("fork_count.txt");
+    popd();
+}
+
 void test_maybe() {
     say(L"Testing maybe_t");
     do_test(!bool(maybe_t<int>()));
@@ -4506,6 +5439,9 @@ int main(int argc, char **argv) {
     if (should_test_function("utility_functions")) test_utility_functions();
     if (should_test_function("wcstring_tok")) test_wcstring_tok();
     if (should_test_function("env_vars")) test_env_vars();
+    if (should_test_function("env_vars_speed")) test_env_vars_speed();
+    if (should_test_function("env_export_arr")) test_env_export_arr();
+    if (should_test_function("env_inherited_exports")) test_env_inherited_exports();
     if (should_test_function("str_to_num")) test_str_to_num();
     if (should_test_function("highlighting")) test_highlighting();
     if (should_test_function("new_parser_ll2")) test_new_parser_ll2();
@@ -4523,13 +5459,17 @@ int main(int argc, char **argv) {
     if (should_test_function("convert_nulls")) test_convert_nulls();
     if (should_test_function("tok")) test_tokenizer();
     if (should_test_function("iothread")) test_iothread();
+    if (should_test_function("io_buffer")) test_io_buffer();
+    if (should_test_function("output_stream")) test_output_stream();
     if (should_test_function("parser")) test_parser();
     if (should_test_function("cancellation")) test_cancellation();
     if (should_test_function("indents")) test_indents();
     if (should_test_function("utf8")) test_utf8();
     if (should_test_function("escape_sequences")) test_escape_sequences();
     if (should_test_function("lru")) test_lru();
+    if (should_test_function("dir_iter")) test_dir_iter();
     if (should_test_function("expand")) test_expand();
+    if (should_test_function("wildcard_pattern")) test_wildcard_pattern();
     if (should_test_function("fuzzy_match")) test_fuzzy_match();
     if (should_test_function("abbreviations")) test_abbreviations();
     if (should_test_function("test")) test_test();
@@ -4543,6 +5483,7 @@ int main(int argc, char **argv) {
     if (should_test_function("input")) test_input();
     if (should_test_function("universal")) test_universal();
     if (should_test_function("universal")) test_universal_callbacks();
+    if (should_test_function("universal")) test_universal_journal();
     if (should_test_function("notifiers")) test_universal_notifiers();
     if (should_test_function("completion_insertions")) test_completion_insertions();
     if (should_test_function("autosuggestion_ignores")) test_autosuggestion_ignores();
@@ -4552,8 +5493,20 @@ int main(int argc, char **argv) {
     if (should_test_function("history_merge")) history_tests_t::test_history_merge();
     if (should_test_function("history_races")) history_tests_t::test_history_races();
     if (should_test_function("history_formats")) history_tests_t::test_history_formats();
+    if (should_test_function("history_index")) history_tests_t::test_history_index();
+    if (should_test_function("history_search_index")) {
+        history_tests_t::test_history_search_index();
+    }
+    if (should_test_function("history_item_views")) history_tests_t::test_history_item_views();
+    if (should_test_function("history_parallel_search"))
+        history_tests_t::test_history_parallel_search();
+    if (should_test_function("history_binary_format"))
+        history_tests_t::test_history_binary_format();
+    if (should_test_function("history_background_vacuum"))
+        history_tests_t::test_history_background_vacuum();
     if (should_test_function("string")) test_string();
     if (should_test_function("illegal_command_exit_code")) test_illegal_command_exit_code();
+    if (should_test_function("pipeline_fork_count")) test_pipeline_fork_count();
     if (should_test_function("maybe")) test_maybe();
     if (should_test_function("layout_cache")) test_layout_cache();
     // history_tests_t::test_history_speed();
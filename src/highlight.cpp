@@ -171,40 +171,37 @@ bool is_potential_path(const wcstring &potential_path_fragment, const wcstring_l
             }
         } else {
             // We do not end with a slash; it does not have to be a directory.
-            DIR *dir = NULL;
             const wcstring dir_name = wdirname(abs_path);
             const wcstring filename_fragment = wbasename(abs_path);
             if (dir_name == L"/" && filename_fragment == L"/") {
                 // cd ///.... No autosuggestion.
                 result = true;
-            } else if ((dir = wopendir(dir_name))) {
-                // Check if we're case insensitive.
-                const bool do_case_insensitive =
-                    fs_is_case_insensitive(dir_name, dirfd(dir), case_sensitivity_cache);
-
-                wcstring matched_file;
-
-                // We opened the dir_name; look for a string where the base name prefixes it Don't
-                // ask for the is_dir value unless we care, because it can cause extra filesystem
-                // access.
-                wcstring ent;
-                bool is_dir = false;
-                while (wreaddir_resolving(dir, dir_name, ent, require_dir ? &is_dir : NULL)) {
-                    // Maybe skip directories.
-                    if (require_dir && !is_dir) {
-                        continue;
-                    }
-
-                    if (string_prefixes_string(filename_fragment, ent) ||
-                        (do_case_insensitive &&
-                         string_prefixes_string_case_insensitive(filename_fragment, ent))) {
-                        matched_file = ent;  // we matched
-                        break;
+            } else {
+                // This runs on every keypress, so use a cached listing if the directory hasn't
+                // changed.
+                dir_iter_t dir(dir_name, true /* cached */);
+                if (dir.valid()) {
+                    // Check if we're case insensitive.
+                    const bool do_case_insensitive =
+                        fs_is_case_insensitive(dir_name, dir.fd(), case_sensitivity_cache);
+
+                    // We opened the dir_name; look for a string where the base name prefixes it.
+                    // Only check whether it's a directory once it matches, because that can cause
+                    // extra filesystem access.
+                    while (const dir_iter_t::entry_t *entry = dir.next()) {
+                        const wcstring ent = str2wcstring(entry->name);
+                        if (string_prefixes_string(filename_fragment, ent) ||
+                            (do_case_insensitive &&
+                             string_prefixes_string_case_insensitive(filename_fragment, ent))) {
+                            // Maybe skip directories.
+                            if (require_dir && !dir.entry_is_dir(*entry)) {
+                                continue;
+                            }
+                            result = true;  // we matched
+                            break;
+                        }
                     }
                 }
-                closedir(dir);
-
-                result = !matched_file.empty();  // we succeeded if we found a match
             }
         }
     }
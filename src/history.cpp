@@ -20,10 +20,12 @@
 
 #include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <cwchar>
 #include <functional>
 #include <iterator>
 #include <map>
+#include <mutex>
 #include <numeric>
 #include <type_traits>
 #include <unordered_set>
@@ -56,6 +58,12 @@
 // This is the history session ID we use by default if the user has not set env var fish_history.
 #define DFLT_FISH_HISTORY_SESSION_ID L"fish"
 
+// The suffix of the history index file, which lives next to the history file.
+#define HISTORY_INDEX_SUFFIX L".index"
+
+// The suffix of the binary history file, which replaces the text history file once it exists.
+#define HISTORY_BINARY_SUFFIX L".bin"
+
 // When we rewrite the history, the number of items we keep.
 #define HISTORY_SAVE_MAX (1024 * 256)
 
@@ -70,6 +78,19 @@ static constexpr int history_file_mode = 0644;
 // the file and taking the lock
 static constexpr int max_save_tries = 1024;
 
+// `history search` scans the history file in parallel once it has at least this many items.
+static constexpr size_t history_parallel_search_min_items = 32 * 1024;
+
+// The smallest number of items worth handing to a thread in a parallel search.
+static constexpr size_t history_parallel_search_min_chunk = 4 * 1024;
+
+// The most chunks a parallel search is split into.
+static constexpr size_t history_parallel_search_max_chunks = 16;
+
+// `history search` for at most this many items is done serially, since it usually finds them long
+// before it reaches the end of the file.
+static constexpr size_t history_parallel_search_max_serial_results = 256;
+
 namespace {
 
 /// Helper class for certain output. This is basically a string that allows us to ensure we only
@@ -103,6 +124,11 @@ class history_output_buffer_t {
         }
     }
 
+    /// Append some bytes, which may include nul bytes.
+    void append_bytes(const std::string &bytes) {
+        buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+    }
+
     /// Output to a given fd, resetting our buffer. Returns true on success, false on error.
     bool flush_to_fd(int fd) {
         if (buffer.empty()) {
@@ -207,6 +233,7 @@ class history_collection_t {
 static history_collection_t histories;
 
 static wcstring history_filename(const wcstring &name, const wcstring &suffix);
+static wcstring history_file_path(const wcstring &name, bool *out_binary = NULL);
 
 /// Replaces newlines with a literal backslash followed by an n, and replaces backslashes with two
 /// backslashes.
@@ -274,19 +301,127 @@ static wcstring history_unescape_newlines_fish_1_x(const wcstring &in_str) {
     return out;
 }
 
-/// Try to infer the history file type based on inspecting the data.
-static history_file_type_t infer_file_type(const char *data, size_t len) {
-    history_file_type_t result = history_type_unknown;
-    if (len > 0) {  // old fish started with a #
-        if (data[0] == '#') {
-            result = history_type_fish_1_x;
-        } else {  // assume new fish
-            result = history_type_fish_2_0;
-        }
+// The binary history format. It is kept in its own file, named by HISTORY_BINARY_SUFFIX, which
+// older versions of fish never open; they keep using the text file. The file starts with a header
+// of the magic bytes below followed by a version number. Each item is then stored as a record:
+//
+//   4 bytes  the record marker below
+//   u32  size of the record in bytes, including the marker and this field
+//   u32  FNV-1a hash of the rest of the record, following this field
+//   i64  creation timestamp, or 0 if none
+//   u32  length of the command, followed by the command
+//   u32  number of required paths, followed by each path as a u32 length and the path
+//
+// Integers are little-endian. Strings are stored as they are, without escaping or a terminator.
+// Since each record starts with its size, finding the next item does not require looking at the
+// item itself. A record whose size or hash is wrong is skipped by looking for the next marker, so
+// one damaged record does not hide the ones after it.
+static const char kHistoryBinaryMagic[8] = {'\0', 'f', 'i', 's', 'h', 'h', 'i', 's'};
+static constexpr uint32_t kHistoryBinaryVersion = 2;
+static constexpr size_t kHistoryBinaryHeaderSize = sizeof kHistoryBinaryMagic + 4;
+static const char kHistoryBinaryRecordMarker[4] = {'\x1e', 'f', 'h', '\xff'};
+
+// Where the fields of a record start, and the smallest possible record: its marker, size, hash,
+// timestamp, command length and path count.
+static constexpr size_t kHistoryBinaryTimestampOffset = 4 + 4 + 4;
+static constexpr size_t kHistoryBinaryCommandOffset = kHistoryBinaryTimestampOffset + 8;
+static constexpr size_t kHistoryBinaryMinRecordSize = kHistoryBinaryCommandOffset + 4 + 4;
+
+/// Append the low \p size bytes of \p value to \p out, in little-endian order.
+static void history_append_le(std::string *out, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        out->push_back((char)(value >> (8 * i)));
+    }
+}
+
+/// Read a little-endian integer of \p size bytes.
+static uint64_t history_read_le(const char *bytes, size_t size) {
+    uint64_t result = 0;
+    for (size_t i = size; i-- > 0;) {
+        result = result << 8 | (unsigned char)bytes[i];
     }
     return result;
 }
 
+/// Hash some bytes with FNV-1a. Pass the result of a previous call as \p hash to continue hashing.
+static uint32_t history_hash_bytes(const char *bytes, size_t len, uint32_t hash = 2166136261u) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/// Return the header that starts a binary history file.
+static std::string history_binary_header() {
+    std::string result(kHistoryBinaryMagic, sizeof kHistoryBinaryMagic);
+    history_append_le(&result, kHistoryBinaryVersion, 4);
+    return result;
+}
+
+/// Return the size of the binary history record at the given offset, or 0 if there is no complete
+/// record there. This does not check the record's hash; see history_binary_verified_record_size().
+static size_t history_binary_record_size(const char *begin, size_t mmap_length, size_t offset) {
+    if (offset > mmap_length || mmap_length - offset < kHistoryBinaryMinRecordSize) return 0;
+    if (memcmp(begin + offset, kHistoryBinaryRecordMarker, sizeof kHistoryBinaryRecordMarker)) {
+        return 0;
+    }
+    size_t size = (size_t)history_read_le(begin + offset + 4, 4);
+    if (size < kHistoryBinaryMinRecordSize || size > mmap_length - offset) return 0;
+    return size;
+}
+
+/// Like history_binary_record_size(), but also returns 0 if the record's hash does not match it.
+static size_t history_binary_verified_record_size(const char *begin, size_t mmap_length,
+                                                  size_t offset) {
+    size_t size = history_binary_record_size(begin, mmap_length, offset);
+    if (size == 0) return 0;
+    const char *hashed = begin + offset + kHistoryBinaryTimestampOffset;
+    uint32_t hash = (uint32_t)history_read_le(begin + offset + 8, 4);
+    return history_hash_bytes(hashed, size - kHistoryBinaryTimestampOffset) == hash ? size : 0;
+}
+
+/// Return the creation timestamp of the binary history record at the given offset, which must be
+/// complete.
+static time_t history_binary_record_timestamp(const char *begin, size_t offset) {
+    return (time_t)(int64_t)history_read_le(begin + offset + kHistoryBinaryTimestampOffset, 8);
+}
+
+/// Locate the command of the binary history record at the given offset. Returns false if there is
+/// no well-formed record there.
+static bool history_binary_record_command(const char *begin, size_t mmap_length, size_t offset,
+                                          const char **out_cmd, size_t *out_len) {
+    size_t size = history_binary_record_size(begin, mmap_length, offset);
+    if (size == 0) return false;
+    const size_t cmd_start = kHistoryBinaryCommandOffset + 4;
+    size_t cmd_len = (size_t)history_read_le(begin + offset + kHistoryBinaryCommandOffset, 4);
+    if (cmd_len > size - cmd_start) return false;
+    *out_cmd = begin + offset + cmd_start;
+    *out_len = cmd_len;
+    return true;
+}
+
+/// Try to infer the history file type based on inspecting the data. \p binary_file is whether the
+/// data comes from the binary history file rather than the text one. Returns unknown if there is
+/// no data, and unrecognized if it is not something this version of fish may write to.
+static history_file_type_t infer_file_type(const char *data, size_t len, bool binary_file) {
+    if (len == 0) return history_type_unknown;
+    const bool has_magic = len >= sizeof kHistoryBinaryMagic &&
+                           !memcmp(data, kHistoryBinaryMagic, sizeof kHistoryBinaryMagic);
+    if (binary_file) {
+        // We can't read binary files from future versions.
+        if (has_magic && len >= kHistoryBinaryHeaderSize &&
+            history_read_le(data + sizeof kHistoryBinaryMagic, 4) == kHistoryBinaryVersion) {
+            return history_type_binary;
+        }
+        return history_type_unrecognized;
+    }
+    // A binary file where the text file belongs was not written by us.
+    if (has_magic) return history_type_unrecognized;
+    // Old fish started with a #; otherwise, assume new fish.
+    return data[0] == '#' ? history_type_fish_1_x : history_type_fish_2_0;
+}
+
 /// Decode an item via the fish 1.x format. Adapted from fish 1.x's item_get().
 static history_item_t decode_item_fish_1_x(const char *begin, size_t length) {
     const char *end = begin + length;
@@ -416,7 +551,34 @@ static history_item_t decode_item_fish_2_0(const char *base, size_t len) {
     return result;
 }
 
+/// Decode an item via the binary format.
+static history_item_t decode_item_binary(const char *base, size_t len) {
+    const char *cmd;
+    size_t cmd_len;
+    if (!history_binary_record_command(base, len, 0, &cmd, &cmd_len)) return history_item_t(L"");
+
+    const char *cursor = cmd + cmd_len;
+    const char *const end = base + history_binary_record_size(base, len, 0);
+    path_list_t paths;
+    if (end - cursor >= 4) {
+        size_t path_count = (size_t)history_read_le(cursor, 4);
+        cursor += 4;
+        for (size_t i = 0; i < path_count && end - cursor >= 4; i++) {
+            size_t path_len = (size_t)history_read_le(cursor, 4);
+            cursor += 4;
+            if ((size_t)(end - cursor) < path_len) break;
+            paths.push_back(str2wcstring(cursor, path_len));
+            cursor += path_len;
+        }
+    }
+
+    history_item_t result(str2wcstring(cmd, cmd_len), history_binary_record_timestamp(base, 0));
+    result.set_required_paths(paths);
+    return result;
+}
+
 static history_item_t decode_item(const char *base, size_t len, history_file_type_t type) {
+    if (type == history_type_binary) return decode_item_binary(base, len);
     if (type == history_type_fish_2_0) return decode_item_fish_2_0(base, len);
     if (type == history_type_fish_1_x) return decode_item_fish_1_x(base, len);
     return history_item_t(L"");
@@ -439,38 +601,63 @@ bool history_item_t::merge(const history_item_t &item) {
     return result;
 }
 
-#if 0
-history_item_t::history_item_t(const wcstring &str)
-    : contents(str), contents_lower(L""), creation_timestamp(time(NULL)), identifier(0) {
-        for (wcstring::const_iterator it = str.begin(); it != str.end(); ++it) {
-                contents_lower.push_back(towlower(*it));
-        }
-    }
-#endif
-
 history_item_t::history_item_t(const wcstring &str, time_t when, history_identifier_t ident)
-    : contents(str), contents_lower(L""), creation_timestamp(when), identifier(ident) {
-    for (wcstring::const_iterator it = str.begin(); it != str.end(); ++it) {
-        contents_lower.push_back(towlower(*it));
+    : contents(str), creation_timestamp(when), identifier(ident) {}
+
+/// Compare two characters, folding case if \p case_sensitive is false. \p term_c comes from a
+/// search term, which has already been lowercased for case insensitive searches.
+static inline bool search_char_matches(wchar_t term_c, wchar_t c, bool case_sensitive) {
+    return term_c == c || (!case_sensitive && term_c == (wchar_t)towlower(c));
+}
+
+/// Return whether \p term matches \p contents at offset \p pos, folding case if requested.
+static bool search_term_matches_at(const wcstring &term, const wcstring &contents, size_t pos,
+                                   bool case_sensitive) {
+    if (contents.size() - pos < term.size()) return false;
+    for (size_t i = 0; i < term.size(); i++) {
+        if (!search_char_matches(term[i], contents[pos + i], case_sensitive)) return false;
     }
+    return true;
 }
 
 bool history_item_t::matches_search(const wcstring &term, enum history_search_type_t type,
                                     bool case_sensitive) const {
-    // Note that this->term has already been lowercased when constructing the
-    // search object if we're doing a case insensitive search.
-    const wcstring &content_to_match = case_sensitive ? contents : contents_lower;
-
+    // Note that this->term has already been lowercased when constructing the search object if
+    // we're doing a case insensitive search. The plain search types fold the case of our
+    // contents one character at a time, so they never copy them.
     switch (type) {
         case HISTORY_SEARCH_TYPE_EXACT: {
-            return term == content_to_match;
+            return term.size() == contents.size() &&
+                   search_term_matches_at(term, contents, 0, case_sensitive);
         }
         case HISTORY_SEARCH_TYPE_CONTAINS: {
-            return content_to_match.find(term) != wcstring::npos;
+            if (case_sensitive) return contents.find(term) != wcstring::npos;
+            if (term.size() > contents.size()) return false;
+            for (size_t pos = 0; pos + term.size() <= contents.size(); pos++) {
+                if (search_term_matches_at(term, contents, pos, false)) return true;
+            }
+            return false;
         }
         case HISTORY_SEARCH_TYPE_PREFIX: {
-            return string_prefixes_string(term, content_to_match);
+            return search_term_matches_at(term, contents, 0, case_sensitive);
+        }
+        case HISTORY_SEARCH_TYPE_CONTAINS_GLOB:
+        case HISTORY_SEARCH_TYPE_PREFIX_GLOB: {
+            break;
         }
+    }
+
+    // The wildcard matcher can't fold case, so glob searches need a lowercase copy.
+    wcstring contents_lower;
+    if (!case_sensitive) {
+        contents_lower.reserve(contents.size());
+        for (wchar_t c : contents) {
+            contents_lower.push_back(towlower(c));
+        }
+    }
+    const wcstring &content_to_match = case_sensitive ? contents : contents_lower;
+
+    switch (type) {
         case HISTORY_SEARCH_TYPE_CONTAINS_GLOB: {
             wcstring wcpattern1 = parse_util_unescape_wildcards(term);
             if (wcpattern1.front() != ANY_STRING) wcpattern1.insert(0, 1, ANY_STRING);
@@ -482,17 +669,173 @@ bool history_item_t::matches_search(const wcstring &term, enum history_search_ty
             if (wcpattern2.back() != ANY_STRING) wcpattern2.push_back(ANY_STRING);
             return wildcard_match(content_to_match, wcpattern2);
         }
+        default: {
+            break;
+        }
     }
     DIE("unexpected history_search_type_t value");
 }
 
+/// A read-only mapping of a history file. It is unmapped when the last reference goes away.
+class history_mapping_t {
+    history_mapping_t(const history_mapping_t &) = delete;
+    void operator=(const history_mapping_t &) = delete;
+
+   public:
+    const char *const start;
+    const size_t length;
+
+    history_mapping_t(const char *start, size_t length) : start(start), length(length) {}
+    ~history_mapping_t() { munmap((void *)start, length); }
+};
+
+/// Whether a history file is being vacuumed in the background.
+struct history_vacuum_state_t {
+    std::mutex lock;
+    std::condition_variable cond;
+    bool running = false;
+};
+
+/// Fold an ASCII character to lowercase, independent of the locale.
+static inline uint32_t history_fold_ascii(uint32_t c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/// Read one byte of a stored command from the cursor. If \p escaped is set, the command is
+/// YAML-escaped, and the byte is unescaped like unescape_yaml() would.
+static inline char read_command_byte(const char **cursor, const char *end, bool escaped) {
+    char c = *(*cursor)++;
+    if (escaped && c == '\\' && *cursor < end) {
+        if (**cursor == '\\') {
+            ++*cursor;
+        } else if (**cursor == 'n') {
+            ++*cursor;
+            c = '\n';
+        }
+    }
+    return c;
+}
+
+/// Return whether the stored command [cursor, end) begins with term, once unescaped if \p escaped
+/// is set. If case_sensitive is false, ASCII letters are compared without regard to case.
+static bool command_has_prefix(const char *cursor, const char *end, const std::string &term,
+                               bool case_sensitive, bool require_exact, bool escaped) {
+    for (char term_c : term) {
+        if (cursor >= end) return false;
+        char c = read_command_byte(&cursor, end, escaped);
+        if (!case_sensitive) {
+            c = (char)history_fold_ascii((unsigned char)c);
+            term_c = (char)history_fold_ascii((unsigned char)term_c);
+        }
+        if (c != term_c) return false;
+    }
+    return !require_exact || cursor == end;
+}
+
+history_item_view_t::history_item_view_t() : offset(0), type(history_type_unknown) {}
+
+history_item_view_t history_item_view_t::ruled_out_view() {
+    history_item_view_t result;
+    result.excluded = true;
+    return result;
+}
+
+history_item_view_t::history_item_view_t(std::shared_ptr<const history_mapping_t> mapping,
+                                         size_t offset, history_file_type_t type)
+    : mapping(std::move(mapping)), offset(offset), type(type) {}
+
+history_item_view_t::history_item_view_t(const history_item_t &item)
+    : offset(0), type(history_type_unknown), decoded(item) {}
+
+history_item_view_t::~history_item_view_t() = default;
+
+const history_item_t &history_item_view_t::item() const {
+    if (!decoded) {
+        assert(mapping && "Cannot decode an empty history item view");
+        decoded = decode_item(mapping->start + offset, mapping->length - offset, type);
+    }
+    return *decoded;
+}
+
+bool history_item_view_t::may_match(const std::string &narrow_term, history_search_type_t type,
+                                    bool case_sensitive) const {
+    // We only know how to look at the bytes of undecoded fish 2.0 and binary items, and not for
+    // globs.
+    if (decoded || !mapping || type == HISTORY_SEARCH_TYPE_CONTAINS_GLOB ||
+        type == HISTORY_SEARCH_TYPE_PREFIX_GLOB) {
+        return true;
+    }
+
+    const char *cmd, *line_end;
+    const bool escaped = this->type == history_type_fish_2_0;
+    if (this->type == history_type_binary) {
+        size_t cmd_len;
+        if (!history_binary_record_command(mapping->start, mapping->length, offset, &cmd,
+                                           &cmd_len)) {
+            return true;
+        }
+        line_end = cmd + cmd_len;
+    } else if (this->type == history_type_fish_2_0) {
+        // Find the command, which is the rest of the "- cmd: " line. See decode_item_fish_2_0().
+        const char *line = mapping->start + offset;
+        const size_t avail = mapping->length - offset;
+        line_end = (const char *)memchr(line, '\n', avail);
+        if (!line_end) line_end = line + avail;
+        const size_t prefix_len = strlen("- cmd:");
+        if ((size_t)(line_end - line) < prefix_len || memcmp(line, "- cmd:", prefix_len) != 0) {
+            return true;
+        }
+        cmd = line + prefix_len;
+        if (cmd < line_end && *cmd == ' ') cmd++;
+    } else {
+        return true;
+    }
+
+    // Lowercasing a non-ASCII character may produce an ASCII one, and vice versa, so we can only
+    // do case insensitive comparisons between ASCII strings.
+    if (!case_sensitive) {
+        for (const char *cursor = cmd; cursor < line_end; cursor++) {
+            if ((unsigned char)*cursor >= 0x80) return true;
+        }
+        for (char c : narrow_term) {
+            if ((unsigned char)c >= 0x80) return true;
+        }
+    }
+
+    switch (type) {
+        case HISTORY_SEARCH_TYPE_EXACT: {
+            return command_has_prefix(cmd, line_end, narrow_term, case_sensitive, true, escaped);
+        }
+        case HISTORY_SEARCH_TYPE_PREFIX: {
+            return command_has_prefix(cmd, line_end, narrow_term, case_sensitive, false, escaped);
+        }
+        case HISTORY_SEARCH_TYPE_CONTAINS: {
+            const char *cursor = cmd;
+            for (;;) {
+                if (command_has_prefix(cursor, line_end, narrow_term, case_sensitive, false,
+                                       escaped)) {
+                    return true;
+                }
+                if (cursor >= line_end) return false;
+                read_command_byte(&cursor, line_end, escaped);
+            }
+        }
+        default: {
+            return true;
+        }
+    }
+}
+
 /// Append our YAML history format to the provided vector at the given offset, updating the offset.
-static void append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp,
-                                  const path_list_t &required_paths,
-                                  history_output_buffer_t *buffer) {
+/// Returns the hash of the item's first line, for use in the history index.
+static uint32_t append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp,
+                                      const path_list_t &required_paths,
+                                      history_output_buffer_t *buffer) {
     std::string cmd = wcs2string(wcmd);
     escape_yaml(&cmd);
     buffer->append("- cmd: ", cmd.c_str(), "\n");
+    uint32_t hash = history_hash_bytes("- cmd: ", strlen("- cmd: "));
+    hash = history_hash_bytes(cmd.data(), cmd.size(), hash);
 
     char timestamp_str[96];
     snprintf(timestamp_str, sizeof timestamp_str, "%ld", (long)timestamp);
@@ -508,6 +851,34 @@ static void append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp,
             buffer->append("    - ", path.c_str(), "\n");
         }
     }
+    return hash;
+}
+
+/// Append an item in the binary history format to the provided buffer.
+static void append_binary_to_buffer(const wcstring &wcmd, time_t timestamp,
+                                    const path_list_t &required_paths,
+                                    history_output_buffer_t *buffer) {
+    // Leave room for the size and hash, which we fill in at the end.
+    std::string record(kHistoryBinaryRecordMarker, sizeof kHistoryBinaryRecordMarker);
+    record.append(8, '\0');
+    history_append_le(&record, (uint64_t)(int64_t)timestamp, 8);
+    std::string cmd = wcs2string(wcmd);
+    history_append_le(&record, cmd.size(), 4);
+    record.append(cmd);
+    history_append_le(&record, required_paths.size(), 4);
+    for (const wcstring &wpath : required_paths) {
+        std::string path = wcs2string(wpath);
+        history_append_le(&record, path.size(), 4);
+        record.append(path);
+    }
+    std::string size_and_hash;
+    history_append_le(&size_and_hash, record.size(), 4);
+    history_append_le(&size_and_hash,
+                      history_hash_bytes(record.data() + kHistoryBinaryTimestampOffset,
+                                         record.size() - kHistoryBinaryTimestampOffset),
+                      4);
+    record.replace(4, 8, size_and_hash);
+    buffer->append_bytes(record);
 }
 
 /// Parse a timestamp line that looks like this: spaces, "when:", spaces, timestamp, newline
@@ -692,12 +1063,52 @@ static size_t offset_of_next_item_fish_1_x(const char *begin, size_t mmap_length
     return result;
 }
 
+/// Return the offset of the first record marker at or after \p offset, or \p mmap_length if none.
+static size_t history_binary_next_marker(const char *begin, size_t mmap_length, size_t offset) {
+    const size_t marker_len = sizeof kHistoryBinaryRecordMarker;
+    for (; offset + marker_len <= mmap_length; offset++) {
+        const void *next = memchr(begin + offset, kHistoryBinaryRecordMarker[0],
+                                  mmap_length - offset - marker_len + 1);
+        if (!next) break;
+        offset = (const char *)next - begin;
+        if (!memcmp(next, kHistoryBinaryRecordMarker, marker_len)) return offset;
+    }
+    return mmap_length;
+}
+
+/// Same as offset_of_next_item_fish_2_0, but for the binary format.
+static size_t offset_of_next_item_binary(const char *begin, size_t mmap_length,
+                                         size_t *inout_cursor, time_t cutoff_timestamp) {
+    size_t cursor = std::max(*inout_cursor, kHistoryBinaryHeaderSize);
+    size_t result = (size_t)-1;
+    while (cursor < mmap_length) {
+        size_t size = history_binary_verified_record_size(begin, mmap_length, cursor);
+        if (size == 0) {
+            // This record is damaged or incomplete. Resume at the next marker after its start.
+            cursor = history_binary_next_marker(begin, mmap_length, cursor + 1);
+            continue;
+        }
+        size_t offset = cursor;
+        cursor += size;
+        // Skip items created after our cutoff, like offset_of_next_item_fish_2_0().
+        if (cutoff_timestamp == 0 ||
+            history_binary_record_timestamp(begin, offset) <= cutoff_timestamp) {
+            result = offset;
+            break;
+        }
+    }
+    *inout_cursor = cursor;
+    return result;
+}
+
 /// Returns the offset of the next item based on the given history type, or -1.
 static size_t offset_of_next_item(const char *begin, size_t mmap_length,
                                   history_file_type_t mmap_type, size_t *inout_cursor,
                                   time_t cutoff_timestamp) {
     size_t result = (size_t)-1;
-    if (mmap_type == history_type_fish_2_0) {
+    if (mmap_type == history_type_binary) {
+        result = offset_of_next_item_binary(begin, mmap_length, inout_cursor, cutoff_timestamp);
+    } else if (mmap_type == history_type_fish_2_0) {
         result = offset_of_next_item_fish_2_0(begin, mmap_length, inout_cursor, cutoff_timestamp);
     } else if (mmap_type == history_type_fish_1_x) {
         result = offset_of_next_item_fish_1_x(begin, mmap_length, inout_cursor);
@@ -705,6 +1116,302 @@ static size_t offset_of_next_item(const char *begin, size_t mmap_length,
     return result;
 }
 
+// The history index is a file next to the history file which caches the location of each item in
+// a fish 2.0 history file, so that we do not have to scan the whole file every time we map it. It
+// is a header followed by one fixed-size record per item, in file order. It is written in full
+// when the history file is rewritten, and appended to (under the history file's lock) when items
+// are appended to the history file. The index is only a cache: if it does not describe the history
+// file we mapped, it is ignored and we scan the file. Items appended by someone who did not update
+// the index are found by scanning only the part of the file past the last indexed item.
+struct history_index_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // The device and inode of the indexed history file.
+    uint64_t device;
+    uint64_t inode;
+};
+
+struct history_index_record_t {
+    // Offset of the item in the history file.
+    uint64_t offset;
+    // Creation timestamp of the item, or 0 if it has none.
+    int64_t timestamp;
+    // Number of bytes from the start of this item to the start of the next one.
+    uint32_t length;
+    // Hash of the first line of the item, as computed by history_hash_bytes().
+    uint32_t content_hash;
+};
+
+static const char kHistoryIndexMagic[8] = {'f', 'i', 's', 'h', 'h', 'i', 'd', 'x'};
+static constexpr uint32_t kHistoryIndexVersion = 1;
+
+/// Return the hash of the first line of the item at the given offset, matching what
+/// append_yaml_to_buffer() returned when it wrote the item. For binary files, this is the hash of
+/// the whole record.
+static uint32_t history_item_hash_at(const char *begin, size_t mmap_length, size_t offset,
+                                     history_file_type_t type) {
+    if (type == history_type_binary) {
+        return history_hash_bytes(begin + offset,
+                                  history_binary_record_size(begin, mmap_length, offset));
+    }
+    const char *start = begin + offset;
+    const char *newline = (const char *)memchr(start, '\n', mmap_length - offset);
+    size_t len = newline ? newline - start : mmap_length - offset;
+    return history_hash_bytes(start, len);
+}
+
+/// Try to locate the items of the given mapped history file via its index. Offsets of items whose
+/// timestamp is not after \p cutoff_timestamp are appended to \p offsets. Returns the number of
+/// bytes of the history file described by the index, from which a scan should resume; returns 0 if
+/// the index is missing or does not match the file, in which case \p offsets is not modified.
+static size_t load_offsets_from_history_index(const wcstring &index_path,
+                                              const file_id_t &file_id, const char *begin,
+                                              size_t mmap_length, time_t cutoff_timestamp,
+                                              std::deque<size_t> *offsets) {
+    int fd = wopen_cloexec(index_path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    size_t result = 0;
+    struct stat buf = {};
+    const size_t header_size = sizeof(history_index_header_t);
+    const size_t record_size = sizeof(history_index_record_t);
+    if (fstat(fd, &buf) == 0 && (size_t)buf.st_size > header_size) {
+        size_t index_length = (size_t)buf.st_size;
+        void *index_map = mmap(0, index_length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (index_map != MAP_FAILED) {
+            const char *index_start = (const char *)index_map;
+            history_index_header_t header;
+            memcpy(&header, index_start, header_size);
+            // Ignore a trailing partial record, which may be in the middle of being appended.
+            size_t record_count = (index_length - header_size) / record_size;
+            bool valid = !memcmp(header.magic, kHistoryIndexMagic, sizeof header.magic) &&
+                         header.version == kHistoryIndexVersion &&
+                         header.device == (uint64_t)file_id.device &&
+                         header.inode == (uint64_t)file_id.inode && record_count > 0;
+
+            // Check that the last indexed item is where the index says it is, which catches the
+            // history file having been replaced by one that reused its inode.
+            history_index_record_t last;
+            if (valid) {
+                memcpy(&last, index_start + header_size + (record_count - 1) * record_size,
+                       record_size);
+                valid = last.offset + last.length <= mmap_length &&
+                        last.content_hash == history_item_hash_at(begin, mmap_length, last.offset,
+                                                                  history_type_fish_2_0);
+            }
+
+            const size_t original_count = offsets->size();
+            uint64_t expected_offset = 0;
+            for (size_t i = 0; valid && i < record_count; i++) {
+                history_index_record_t record;
+                memcpy(&record, index_start + header_size + i * record_size, record_size);
+                // Items must be contiguous, apart from any junk before the first one.
+                valid = (i == 0 ? record.offset >= expected_offset
+                                : record.offset == expected_offset);
+                expected_offset = record.offset + record.length;
+                if (valid && (record.timestamp == 0 || record.timestamp <= cutoff_timestamp)) {
+                    offsets->push_back((size_t)record.offset);
+                }
+            }
+
+            if (valid) {
+                result = (size_t)(last.offset + last.length);
+            } else {
+                offsets->resize(original_count);
+            }
+            munmap(index_map, index_length);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/// Return the command of the history item at the given offset as bytes, without decoding it into a
+/// history_item_t.
+static std::string history_item_command_bytes(const char *begin, size_t mmap_length, size_t offset,
+                                              history_file_type_t type) {
+    std::string key, value, line;
+    const char *cmd;
+    size_t cmd_len;
+    if (type == history_type_binary) {
+        if (history_binary_record_command(begin, mmap_length, offset, &cmd, &cmd_len)) {
+            value.assign(cmd, cmd_len);
+        }
+    } else if (type == history_type_fish_2_0) {
+        // This matches the first step of decode_item_fish_2_0().
+        read_line(begin, offset, mmap_length, line);
+        trim_leading_spaces(line);
+        if (extract_prefix_and_unescape_yaml(&key, &value, line) && key == "- cmd") {
+            return value;
+        }
+    } else if (type == history_type_fish_1_x) {
+        value = wcs2string(decode_item_fish_1_x(begin + offset, mmap_length - offset).str());
+    }
+    return value;
+}
+
+/// Return the key for three ASCII characters in the search index.
+static inline uint32_t history_trigram(uint32_t a, uint32_t b, uint32_t c) {
+    return history_fold_ascii(a) << 14 | history_fold_ascii(b) << 7 | history_fold_ascii(c);
+}
+
+/// An index over the contents of the items in a mapped history file, which lets a search rule out
+/// items without decoding them. It maps each run of three ASCII characters ("trigram"), folded to
+/// lowercase, to the items containing it; an item containing a search term must contain all of the
+/// term's trigrams. Unlike old_item_offsets, it covers every item in the file regardless of
+/// timestamp, so when the file is remapped after items have been appended, only the new items need
+/// to be indexed.
+class history_search_index_t {
+    // The file we indexed, and how much of it.
+    file_id_t file_id;
+    size_t indexed_length;
+
+    // The hash of the first line of the last indexed item, to check that a remapped file is still
+    // the one we indexed.
+    uint32_t last_item_hash;
+
+    // Offsets of the indexed items, in increasing order. Items are identified by their position in
+    // this list ("ordinal").
+    std::vector<size_t> item_offsets;
+
+    // Ordinals of the items containing each trigram, in increasing order.
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+
+    // Ordinals of the items containing non-ASCII characters. Lowercasing those characters may
+    // produce ASCII characters, so these items may match any case insensitive search.
+    std::vector<uint32_t> non_ascii_items;
+
+    // Incremented whenever the index changes, so that searches know to recompute their
+    // candidates.
+    uint64_t generation;
+
+    void clear();
+    void add_item(size_t offset, const std::string &contents);
+
+   public:
+    history_search_index_t() : generation(0) { clear(); }
+
+    /// Index any items in the given mapped file that we have not indexed yet. If the file is not
+    /// the one we indexed before, start over.
+    void update(const file_id_t &id, const char *begin, size_t mmap_length,
+                history_file_type_t type);
+
+    /// Return whether the candidates were computed against the index as it is now.
+    bool is_current(const history_search_candidates_t &candidates) const {
+        return candidates.generation == generation;
+    }
+
+    /// Compute the items that may contain the candidates' search term.
+    void query(history_search_candidates_t *candidates) const;
+};
+
+void history_search_index_t::clear() {
+    file_id = kInvalidFileID;
+    indexed_length = 0;
+    last_item_hash = 0;
+    item_offsets.clear();
+    postings.clear();
+    non_ascii_items.clear();
+}
+
+void history_search_index_t::add_item(size_t offset, const std::string &contents) {
+    const uint32_t ordinal = (uint32_t)item_offsets.size();
+    item_offsets.push_back(offset);
+
+    bool non_ascii = false;
+    for (size_t i = 0; i < contents.size(); i++) {
+        const unsigned char c = contents[i];
+        if (c >= 0x80) {
+            non_ascii = true;
+            continue;
+        }
+        if (i < 2 || (unsigned char)contents[i - 1] >= 0x80 ||
+            (unsigned char)contents[i - 2] >= 0x80) {
+            continue;
+        }
+        std::vector<uint32_t> &items =
+            postings[history_trigram(contents[i - 2], contents[i - 1], c)];
+        if (items.empty() || items.back() != ordinal) items.push_back(ordinal);
+    }
+    if (non_ascii) non_ascii_items.push_back(ordinal);
+}
+
+void history_search_index_t::update(const file_id_t &id, const char *begin, size_t mmap_length,
+                                    history_file_type_t type) {
+    bool same_file = !item_offsets.empty() && id.device == file_id.device &&
+                     id.inode == file_id.inode && indexed_length <= mmap_length &&
+                     history_item_hash_at(begin, mmap_length, item_offsets.back(), type) ==
+                         last_item_hash;
+    if (!same_file) clear();
+    file_id = id;
+    if (begin == NULL) return;
+
+    size_t cursor = indexed_length;
+    for (;;) {
+        size_t offset = offset_of_next_item(begin, mmap_length, type, &cursor, 0);
+        if (offset == (size_t)-1) break;
+        add_item(offset, history_item_command_bytes(begin, mmap_length, offset, type));
+    }
+    indexed_length = cursor;
+    if (!item_offsets.empty()) {
+        last_item_hash = history_item_hash_at(begin, mmap_length, item_offsets.back(), type);
+    }
+
+    // Searches must recompute their candidates, since there may be new ones.
+    generation++;
+}
+
+void history_search_index_t::query(history_search_candidates_t *candidates) const {
+    const wcstring &term = candidates->term;
+    candidates->generation = generation;
+    candidates->offsets.clear();
+
+    std::vector<uint32_t> keys;
+    for (size_t i = 2; i < term.size(); i++) {
+        if ((uint32_t)term[i - 2] < 0x80 && (uint32_t)term[i - 1] < 0x80 &&
+            (uint32_t)term[i] < 0x80) {
+            keys.push_back(history_trigram(term[i - 2], term[i - 1], term[i]));
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    // A term without any trigrams rules out nothing.
+    candidates->usable = !keys.empty();
+    if (!candidates->usable) return;
+
+    // Intersect the postings of each trigram, starting with the shortest.
+    static const std::vector<uint32_t> none;
+    std::vector<const std::vector<uint32_t> *> lists;
+    for (uint32_t key : keys) {
+        auto iter = postings.find(key);
+        lists.push_back(iter == postings.end() ? &none : &iter->second);
+    }
+    std::sort(lists.begin(), lists.end(),
+              [](const std::vector<uint32_t> *a, const std::vector<uint32_t> *b) {
+                  return a->size() < b->size();
+              });
+    std::vector<uint32_t> ordinals = *lists.front(), scratch;
+    for (size_t i = 1; i < lists.size() && !ordinals.empty(); i++) {
+        scratch.clear();
+        std::set_intersection(ordinals.begin(), ordinals.end(), lists[i]->begin(),
+                              lists[i]->end(), std::back_inserter(scratch));
+        ordinals.swap(scratch);
+    }
+    if (!candidates->case_sensitive) {
+        scratch.clear();
+        std::set_union(ordinals.begin(), ordinals.end(), non_ascii_items.begin(),
+                       non_ascii_items.end(), std::back_inserter(scratch));
+        ordinals.swap(scratch);
+    }
+
+    candidates->offsets.reserve(ordinals.size());
+    for (uint32_t ordinal : ordinals) {
+        candidates->offsets.push_back(item_offsets.at(ordinal));
+    }
+}
+
 history_t &history_collection_t::get_creating(const wcstring &name) {
     // Return a history for the given name, creating it if necessary
     // Note that histories are currently never deleted, so we can return a reference to them without
@@ -733,8 +1440,12 @@ history_t::history_t(wcstring pname)
       boundary_timestamp(time(NULL)),
       countdown_to_vacuum(-1),
       loaded_old(false),
+      rewrite_type(history_type_unknown),
+      vacuum_state(std::make_shared<history_vacuum_state_t>()),
       chaos_mode(false) {}
 
+history_t::~history_t() = default;
+
 void history_t::add(const history_item_t &item, bool pending) {
     scoped_lock locker(lock);
 
@@ -778,10 +1489,17 @@ void history_t::save_internal_unless_disabled() {
         vacuum = true;
     }
 
-    // This might be a good candidate for moving to a background thread.
-    time_profiler_t profiler(vacuum ? "save_internal vacuum"       //!OCLINT(unused var)
-                                    : "save_internal no vacuum");  //!OCLINT(side-effect)
-    this->save_internal(vacuum);
+    // Vacuuming reads and rewrites the whole file, so we append our items as usual and leave the
+    // vacuum to a background thread.
+    if (vacuum && is_main_thread()) {
+        time_profiler_t profiler("save_internal vacuum");  //!OCLINT(side-effect)
+        this->save_internal(false);
+        this->start_background_vacuum();
+    } else {
+        time_profiler_t profiler(vacuum ? "save_internal vacuum"       //!OCLINT(unused var)
+                                        : "save_internal no vacuum");  //!OCLINT(side-effect)
+        this->save_internal(vacuum);
+    }
 
     // Update our countdown.
     assert(countdown_to_vacuum > 0);
@@ -891,14 +1609,8 @@ history_item_t history_t::item_at_index_assume_locked(size_t idx) {
     assert(idx > 0);
     idx--;
 
-    // Determine how many "resolved" (non-pending) items we have. We can have at most one pending
-    // item, and it's always the last one.
-    size_t resolved_new_item_count = new_items.size();
-    if (this->has_pending_item && resolved_new_item_count > 0) {
-        resolved_new_item_count -= 1;
-    }
-
     // idx == 0 corresponds to the last resolved item.
+    const size_t resolved_new_item_count = this->resolved_new_item_count();
     if (idx < resolved_new_item_count) {
         return new_items.at(resolved_new_item_count - idx - 1);
     }
@@ -922,6 +1634,70 @@ history_item_t history_t::item_at_index(size_t idx) {
     return item_at_index_assume_locked(idx);
 }
 
+size_t history_t::resolved_new_item_count() const {
+    ASSERT_IS_LOCKED(lock);
+    // We can have at most one pending item, and it's always the last one.
+    size_t result = new_items.size();
+    if (this->has_pending_item && result > 0) {
+        result -= 1;
+    }
+    return result;
+}
+
+history_item_view_t history_t::item_view_at_index(size_t idx,
+                                                  history_search_candidates_t *candidates) {
+    scoped_lock locker(lock);
+
+    // 0 is considered an invalid index.
+    assert(idx > 0);
+    idx--;
+
+    // idx == 0 corresponds to the last resolved item.
+    const size_t resolved_new_item_count = this->resolved_new_item_count();
+    if (idx < resolved_new_item_count) {
+        return history_item_view_t(new_items.at(resolved_new_item_count - idx - 1));
+    }
+
+    // Now look in our old items.
+    idx -= resolved_new_item_count;
+    load_old_if_needed();
+    size_t old_item_count = old_item_offsets.size();
+    if (idx < old_item_count) {
+        // idx == 0 corresponds to last item in old_item_offsets.
+        size_t offset = old_item_offsets.at(old_item_count - idx - 1);
+        if (candidates && !old_item_may_match(offset, candidates)) {
+            return history_item_view_t::ruled_out_view();
+        }
+        return history_item_view_t(mmap_mapping, offset, mmap_type);
+    }
+
+    // Index past the valid range, so return an empty view.
+    return history_item_view_t();
+}
+
+bool history_t::old_item_may_match(size_t offset, history_search_candidates_t *candidates) {
+    ASSERT_IS_LOCKED(lock);
+    // The search index knows nothing about globs.
+    if (candidates->type == HISTORY_SEARCH_TYPE_CONTAINS_GLOB ||
+        candidates->type == HISTORY_SEARCH_TYPE_PREFIX_GLOB) {
+        return true;
+    }
+
+    if (!search_index) {
+        time_profiler_t profiler("build search index");  //!OCLINT(side-effect)
+        search_index = make_unique<history_search_index_t>();
+        update_search_index();
+    }
+    if (!search_index->is_current(*candidates)) search_index->query(candidates);
+    return !candidates->usable || std::binary_search(candidates->offsets.begin(),
+                                                     candidates->offsets.end(), offset);
+}
+
+void history_t::update_search_index() {
+    ASSERT_IS_LOCKED(lock);
+    search_index->update(mmap_file_id, mmap_start, mmap_length, mmap_type);
+}
+
 std::unordered_map<long, wcstring> history_t::items_at_indexes(const std::vector<long> &idxs) {
     scoped_lock locker(lock);
     std::unordered_map<long, wcstring> result;
@@ -942,9 +1718,15 @@ std::unordered_map<long, wcstring> history_t::items_at_indexes(const std::vector
     return result;
 }
 
-void history_t::populate_from_mmap() {
-    mmap_type = infer_file_type(mmap_start, mmap_length);
+void history_t::populate_from_mmap(bool binary_file) {
+    mmap_type = infer_file_type(mmap_start, mmap_length, binary_file);
     size_t cursor = 0;
+    if (mmap_type == history_type_fish_2_0) {
+        // Skip past whatever part of the file is described by our index.
+        cursor = load_offsets_from_history_index(history_filename(name, HISTORY_INDEX_SUFFIX),
+                                                 mmap_file_id, mmap_start, mmap_length,
+                                                 boundary_timestamp, &old_item_offsets);
+    }
     for (;;) {
         size_t offset =
             offset_of_next_item(mmap_start, mmap_length, mmap_type, &cursor, boundary_timestamp);
@@ -954,9 +1736,15 @@ void history_t::populate_from_mmap() {
         // Remember this item.
         old_item_offsets.push_back(offset);
     }
+
+    // If we've been searched before, index whatever is new in the file.
+    if (search_index) update_search_index();
 }
 
-bool history_t::map_fd(int fd, const char **out_map_start, size_t *out_map_len) const {
+/// Do a private, read-only map of the entirety of the history file open as \p fd. Returns true if
+/// successful. Returns the mapped memory region by reference.
+static bool history_map_fd(int fd, bool take_lock, const char **out_map_start,
+                           size_t *out_map_len) {
     if (fd < 0) {
         return false;
     }
@@ -970,9 +1758,9 @@ bool history_t::map_fd(int fd, const char **out_map_start, size_t *out_map_len)
     // if it did not fail. The risk is that we may get an incomplete history item; this is
     // unlikely because we only treat an item as valid if it has a terminating newline.
     //
-    // Simulate a failing lock in chaos_mode.
+    // Chaos mode simulates a failing lock by not taking it at all.
     bool result = false;
-    if (!chaos_mode) history_file_lock(fd, LOCK_SH);
+    if (take_lock) history_file_lock(fd, LOCK_SH);
     off_t len = lseek(fd, 0, SEEK_END);
     if (len != (off_t)-1) {
         size_t mmap_length = (size_t)len;
@@ -986,15 +1774,15 @@ bool history_t::map_fd(int fd, const char **out_map_start, size_t *out_map_len)
             }
         }
     }
-    if (!chaos_mode) history_file_lock(fd, LOCK_UN);
+    if (take_lock) history_file_lock(fd, LOCK_UN);
     return result;
 }
 
 /// Do a private, read-only map of the entirety of a history file with the given name. Returns true
 /// if successful. Returns the mapped memory region by reference.
 bool history_t::map_file(const wcstring &name, const char **out_map_start, size_t *out_map_len,
-                         file_id_t *file_id) const {
-    wcstring filename = history_filename(name, L"");
+                         file_id_t *file_id, bool *out_binary) const {
+    wcstring filename = history_file_path(name, out_binary);
     if (filename.empty()) {
         return false;
     }
@@ -1006,7 +1794,7 @@ bool history_t::map_file(const wcstring &name, const char **out_map_start, size_
 
     // Get the file ID if requested.
     if (file_id != NULL) *file_id = file_id_for_fd(fd);
-    bool result = this->map_fd(fd, out_map_start, out_map_len);
+    bool result = history_map_fd(fd, !chaos_mode, out_map_start, out_map_len);
     close(fd);
     return result;
 }
@@ -1016,11 +1804,13 @@ bool history_t::load_old_if_needed() {
     loaded_old = true;
 
     bool ok = false;
-    if (map_file(name, &mmap_start, &mmap_length, &mmap_file_id)) {
+    bool binary_file = false;
+    if (map_file(name, &mmap_start, &mmap_length, &mmap_file_id, &binary_file)) {
         // Here we've mapped the file.
         ok = true;
+        mmap_mapping = std::make_shared<const history_mapping_t>(mmap_start, mmap_length);
         time_profiler_t profiler("populate_from_mmap");  //!OCLINT(side-effect)
-        this->populate_from_mmap();
+        this->populate_from_mmap(binary_file);
     }
 
     return ok;
@@ -1060,13 +1850,23 @@ bool history_search_t::go_backwards() {
             return false;
         }
 
-        const history_item_t item = history->item_at_index(idx);
-        // We're done if it's empty or we cancelled.
-        if (item.empty()) {
+        // The history skips items its search index can rule out, without decoding them.
+        history_item_view_t view = history->item_view_at_index(idx, &candidates);
+        // We're done if we ran off the end.
+        if (view.empty()) {
             return false;
         }
+        if (view.ruled_out()) {
+            continue;
+        }
+
+        // Rule out what we can without decoding the item.
+        if (!view.may_match(narrow_term, search_type, case_sensitive)) {
+            continue;
+        }
 
         // Look for a term that matches and that we haven't seen before.
+        const history_item_t &item = view.item();
         const wcstring &str = item.str();
         if (item.matches_search(term, search_type, case_sensitive) && !match_already_made(str) &&
             !should_skip_match(str)) {
@@ -1091,15 +1891,12 @@ void history_search_t::go_to_beginning() {
     }
 }
 
-history_item_t history_search_t::current_item() const {
+const history_item_t &history_search_t::current_item() const {
     assert(!prev_matches.empty());  //!OCLINT(double negative)
     return prev_matches.back().second;
 }
 
-wcstring history_search_t::current_string() const {
-    history_item_t item = this->current_item();
-    return item.str();
-}
+wcstring history_search_t::current_string() const { return this->current_item().str(); }
 
 bool history_search_t::match_already_made(const wcstring &match) const {
     for (std::vector<prev_match_t>::const_iterator iter = prev_matches.begin();
@@ -1168,12 +1965,21 @@ static wcstring history_filename(const wcstring &session_id, const wcstring &suf
     return result;
 }
 
+/// Return the path of the file holding the given history session: the binary file if there is one,
+/// and otherwise the text file, which older versions of fish use. If \p out_binary is not NULL, it
+/// is set to whether that is the binary file.
+static wcstring history_file_path(const wcstring &name, bool *out_binary) {
+    wcstring binary_path = history_filename(name, HISTORY_BINARY_SUFFIX);
+    const bool binary = !binary_path.empty() && waccess(binary_path, F_OK) == 0;
+    if (out_binary) *out_binary = binary;
+    return binary ? binary_path : history_filename(name, L"");
+}
+
 void history_t::clear_file_state() {
     ASSERT_IS_LOCKED(lock);
-    // Erase everything we know about our file.
-    if (mmap_start != NULL && mmap_start != MAP_FAILED) {
-        munmap((void *)mmap_start, mmap_length);
-    }
+    // Erase everything we know about our file. The file is unmapped once no item views refer to
+    // it.
+    mmap_mapping.reset();
     mmap_start = NULL;
     mmap_length = 0;
     loaded_old = false;
@@ -1201,13 +2007,53 @@ void history_t::compact_new_items() {
     }
 }
 
+namespace {
+/// Everything needed to rewrite a history file. This is a snapshot of the state of a history, so
+/// that the file can be rewritten without holding the history's lock.
+struct history_rewrite_t {
+    // The file to read existing items from, and the file to write with the index of the text file.
+    // The source and target differ only when converting between the text and binary files.
+    wcstring source_name;
+    wcstring target_name;
+    wcstring index_name;
+    bool source_binary;
+    bool target_binary;
+
+    // Whether to remove the source file once the target has replaced it.
+    bool remove_source = false;
+
+    // Items which have not been written to the file yet.
+    history_item_list_t unwritten_items;
+
+    // Commands to remove from the file.
+    std::unordered_set<wcstring> deleted_items;
+
+    // Whether to write the file if it does not exist. If not, only an existing file is rewritten,
+    // and only if nobody else has replaced it in the meantime.
+    bool create = true;
+
+    bool chaos_mode = false;
+
+    // Rewrite the given history in the given format, or in its current one if the type is unknown.
+    history_rewrite_t(const wcstring &name, history_file_type_t type, bool chaos_mode)
+        : index_name(history_filename(name, HISTORY_INDEX_SUFFIX)), chaos_mode(chaos_mode) {
+        source_name = history_file_path(name, &source_binary);
+        target_binary = type == history_type_unknown ? source_binary : type == history_type_binary;
+        target_name = target_binary ? history_filename(name, HISTORY_BINARY_SUFFIX)
+                                    : history_filename(name, L"");
+        // Converting to binary leaves the text file for older versions of fish. Converting to text
+        // makes the text file current again, so the binary file has to go.
+        remove_source = source_binary && !target_binary;
+    }
+};
+}  // anonymous namespace
+
 // Given the fd of an existing history file, or -1 if none, write
 // a new history file to temp_fd. Returns true on success, false
 // on error
-bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
-    // This must be called while locked.
-    ASSERT_IS_LOCKED(lock);
-
+static bool rewrite_to_temporary_file(const history_rewrite_t &rewrite, int existing_fd,
+                                      int dst_fd,
+                                      std::vector<history_index_record_t> *index_records) {
     // We are reading FROM existing_fd and writing TO dst_fd
     // dst_fd must be valid; existing_fd does not need to be
     assert(dst_fd >= 0);
@@ -1219,9 +2065,17 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
     // old mmap'd data).
     const char *local_mmap_start = NULL;
     size_t local_mmap_size = 0;
-    if (existing_fd >= 0 && map_fd(existing_fd, &local_mmap_start, &local_mmap_size)) {
+    if (existing_fd >= 0 &&
+        history_map_fd(existing_fd, !rewrite.chaos_mode, &local_mmap_start, &local_mmap_size)) {
         const history_file_type_t local_mmap_type =
-            infer_file_type(local_mmap_start, local_mmap_size);
+            infer_file_type(local_mmap_start, local_mmap_size, rewrite.source_binary);
+        if (local_mmap_type == history_type_unrecognized) {
+            // Replacing a file we can't read would lose its contents.
+            debug(2, L"Not rewriting history file '%ls' of unrecognized format",
+                  rewrite.source_name.c_str());
+            munmap((void *)local_mmap_start, local_mmap_size);
+            return false;
+        }
         size_t cursor = 0;
         for (;;) {
             size_t offset =
@@ -1233,7 +2087,7 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
             const history_item_t old_item =
                 decode_item(local_mmap_start + offset, local_mmap_size - offset, local_mmap_type);
 
-            if (old_item.empty() || deleted_items.count(old_item.str()) > 0) {
+            if (old_item.empty() || rewrite.deleted_items.count(old_item.str()) > 0) {
                 // debug(0, L"Item is deleted : %s\n", old_item.str().c_str());
                 continue;
             }
@@ -1244,9 +2098,8 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
     }
 
     // Insert any unwritten new items
-    for (auto iter = new_items.cbegin() + this->first_unwritten_new_item_index;
-         iter != new_items.cend(); ++iter) {
-        lru.add_item(*iter);
+    for (const history_item_t &item : rewrite.unwritten_items) {
+        lru.add_item(item);
     }
 
     // Stable-sort our items by timestamp
@@ -1256,13 +2109,30 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
         return item1.timestamp < item2.timestamp;
     });
 
-    // Write them out.
+    // Write them out. Binary files don't need an index, since it's cheap to find their items; for
+    // text files, remember where each item went.
     bool ok = true;
+    size_t flushed_size = 0;
     history_output_buffer_t buffer(HISTORY_OUTPUT_BUFFER_SIZE);
+    index_records->clear();
+    if (rewrite.target_binary) {
+        buffer.append_bytes(history_binary_header());
+    } else {
+        index_records->reserve(lru.size());
+    }
     for (const auto &key_item : lru) {
         const history_lru_item_t &item = key_item.second;
-        append_yaml_to_buffer(item.text, item.timestamp, item.required_paths, &buffer);
+        if (rewrite.target_binary) {
+            append_binary_to_buffer(item.text, item.timestamp, item.required_paths, &buffer);
+        } else {
+            size_t offset = flushed_size + buffer.output_size();
+            uint32_t hash =
+                append_yaml_to_buffer(item.text, item.timestamp, item.required_paths, &buffer);
+            uint32_t length = (uint32_t)(flushed_size + buffer.output_size() - offset);
+            index_records->push_back({offset, (int64_t)item.timestamp, length, hash});
+        }
         if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE) {
+            flushed_size += buffer.output_size();
             ok = buffer.flush_to_fd(dst_fd);
             if (!ok) {
                 debug(2, L"Error %d when writing to temporary history file", errno);
@@ -1294,34 +2164,111 @@ static int create_temporary_file(const wcstring &name_template, wcstring *out_pa
     return out_fd;
 }
 
-bool history_t::save_internal_via_rewrite() {
-    // This must be called while locked.
-    ASSERT_IS_LOCKED(lock);
+/// Write a complete index for the history file open as \p history_fd, and move it into place.
+static void write_history_index(int history_fd, const wcstring &index_path,
+                                const std::vector<history_index_record_t> &records) {
+    struct stat buf = {};
+    if (fstat(history_fd, &buf) != 0) return;
+
+    wcstring tmp_path;
+    int tmp_fd = create_temporary_file(index_path + L".XXXXXX", &tmp_path);
+    if (tmp_fd < 0) return;
+
+    history_index_header_t header = {};
+    memcpy(header.magic, kHistoryIndexMagic, sizeof header.magic);
+    header.version = kHistoryIndexVersion;
+    header.device = (uint64_t)buf.st_dev;
+    header.inode = (uint64_t)buf.st_ino;
+    bool ok = write_loop(tmp_fd, (const char *)&header, sizeof header) >= 0;
+    if (ok && !records.empty()) {
+        ok = write_loop(tmp_fd, (const char *)records.data(),
+                        records.size() * sizeof(history_index_record_t)) >= 0;
+    }
+    if (ok && fchmod(tmp_fd, history_file_mode) == -1) {
+        debug(2, L"Error %d when changing mode of history index", errno);
+    }
+    if (!ok || wrename(tmp_path, index_path) == -1) {
+        debug(2, L"Error %d when writing history index", errno);
+        wunlink(tmp_path);
+    }
+    close(tmp_fd);
+}
+
+/// Append records for newly appended items to the index of the history file open as \p
+/// history_fd. \p append_offset is where the new items begin in the history file. The index is
+/// only extended if it describes exactly the part of the history file before that offset;
+/// otherwise it is left alone, and readers will scan whatever it is missing.
+static void append_to_history_index(int history_fd, const wcstring &index_path,
+                                    size_t append_offset,
+                                    const std::vector<history_index_record_t> &records) {
+    if (records.empty()) return;
+    int fd = wopen_cloexec(index_path, O_RDWR | O_APPEND);
+    if (fd < 0) return;
+
+    const size_t header_size = sizeof(history_index_header_t);
+    const size_t record_size = sizeof(history_index_record_t);
+    struct stat history_buf = {}, index_buf = {};
+    history_index_header_t header;
+    bool in_sync = fstat(history_fd, &history_buf) == 0 && fstat(fd, &index_buf) == 0 &&
+                   (size_t)index_buf.st_size >= header_size &&
+                   ((size_t)index_buf.st_size - header_size) % record_size == 0 &&
+                   pread(fd, &header, header_size, 0) == (ssize_t)header_size &&
+                   !memcmp(header.magic, kHistoryIndexMagic, sizeof header.magic) &&
+                   header.version == kHistoryIndexVersion &&
+                   header.device == (uint64_t)history_buf.st_dev &&
+                   header.inode == (uint64_t)history_buf.st_ino;
+    if (in_sync) {
+        size_t indexed_length = 0;
+        if ((size_t)index_buf.st_size > header_size) {
+            history_index_record_t last;
+            in_sync = pread(fd, &last, record_size, index_buf.st_size - record_size) ==
+                      (ssize_t)record_size;
+            indexed_length = (size_t)(last.offset + last.length);
+        }
+        in_sync = in_sync && indexed_length == append_offset;
+    }
+    if (in_sync &&
+        write_loop(fd, (const char *)records.data(), records.size() * record_size) < 0) {
+        debug(2, L"Error %d when appending to history index", errno);
+    }
+    close(fd);
+}
+
+/// Rewrite a history file as described by \p rewrite. Returns true if the file was replaced.
+static bool rewrite_history_file(const history_rewrite_t &rewrite) {
     bool ok = false;
 
     // We want to rewrite the file, while holding the lock for as briefly as possible
     // To do this, we speculatively write a file, and then lock and see if our original file changed
     // Repeat until we succeed or give up
-    const wcstring target_name = history_filename(name, wcstring());
-    const wcstring tmp_name_template = history_filename(name, L".XXXXXX");
-    if (target_name.empty() || tmp_name_template.empty()) {
+    const wcstring &target_name = rewrite.target_name;
+    if (target_name.empty()) {
         return false;
     }
 
     // Make our temporary file
     // Remember that we have to close this fd!
     wcstring tmp_name;
-    int tmp_fd = create_temporary_file(tmp_name_template, &tmp_name);
+    int tmp_fd = create_temporary_file(target_name + L".XXXXXX", &tmp_name);
     if (tmp_fd < 0) {
         return false;
     }
 
+    // When converting, the items come from the other file, which we don't create.
+    const wcstring &source_name = rewrite.source_name;
+    std::vector<history_index_record_t> index_records;
+    const bool create_source = rewrite.create && source_name == target_name;
+    const int open_flags = create_source ? O_RDONLY | O_CREAT : O_RDONLY;
     bool done = false;
     for (int i = 0; i < max_save_tries && !done; i++) {
-        // Open any target file, but do not lock it right away
-        int target_fd_before = wopen_cloexec(target_name, O_RDONLY | O_CREAT, history_file_mode);
+        // Open any source file, but do not lock it right away
+        int target_fd_before = wopen_cloexec(source_name, open_flags, history_file_mode);
+        if (target_fd_before < 0 && !rewrite.create) {
+            // There is nothing to rewrite.
+            break;
+        }
         file_id_t orig_file_id = file_id_for_fd(target_fd_before);  // possibly invalid
-        bool wrote = this->rewrite_to_temporary_file(target_fd_before, tmp_fd);
+        bool wrote = rewrite_to_temporary_file(rewrite, target_fd_before, tmp_fd, &index_records);
         if (target_fd_before >= 0) {
             close(target_fd_before);
         }
@@ -1334,14 +2281,19 @@ bool history_t::save_internal_via_rewrite() {
         // were rewriting it. Make an effort to take the lock before checking, to avoid racing.
         // If the open fails, then proceed; this may be because there is no current history
         file_id_t new_file_id = kInvalidFileID;
-        int target_fd_after = wopen_cloexec(target_name, O_RDONLY);
+        int target_fd_after = wopen_cloexec(source_name, O_RDONLY);
         if (target_fd_after >= 0) {
             // critical to take the lock before checking file IDs,
             // and hold it until after we are done replacing
             // Also critical to check the file at the path, NOT based on our fd
             // It's only OK to replace the file while holding the lock
             history_file_lock(target_fd_after, LOCK_EX);
-            new_file_id = file_id_for_path(target_name);
+            new_file_id = file_id_for_path(source_name);
+        }
+        if (new_file_id == kInvalidFileID && !rewrite.create) {
+            // Someone removed the file (e.g. by clearing the history); don't bring it back.
+            if (target_fd_after >= 0) close(target_fd_after);
+            break;
         }
         bool can_replace_file = (new_file_id == orig_file_id || new_file_id == kInvalidFileID);
         if (!can_replace_file) {
@@ -1369,9 +2321,23 @@ bool history_t::save_internal_via_rewrite() {
                 }
             }
 
-            // Slide it into place
+            // Slide it into place, and index it while we still hold the lock. Binary files have no
+            // index; the index of the text file stays with it.
+            const wcstring &index_name = rewrite.index_name;
             if (wrename(tmp_name, target_name) == -1) {
                 debug(2, L"Error %d when renaming history file", errno);
+            } else {
+                ok = true;
+                if (rewrite.remove_source) {
+                    wunlink(source_name);
+                }
+                if (rewrite.target_binary) {
+                    // The index belongs to the text file, which we left alone.
+                } else if (index_records.empty()) {
+                    wunlink(index_name);
+                } else {
+                    write_history_index(tmp_fd, index_name, index_records);
+                }
             }
 
             // We did it
@@ -1386,8 +2352,19 @@ bool history_t::save_internal_via_rewrite() {
     // Ensure we never leave the old file around
     wunlink(tmp_name);
     close(tmp_fd);
+    return ok;
+}
+
+bool history_t::save_internal_via_rewrite() {
+    // This must be called while locked.
+    ASSERT_IS_LOCKED(lock);
 
-    if (done) {
+    history_rewrite_t rewrite(name, rewrite_type, chaos_mode);
+    rewrite.unwritten_items.assign(new_items.begin() + first_unwritten_new_item_index,
+                                   new_items.end());
+    rewrite.deleted_items = deleted_items;
+    bool ok = rewrite_history_file(rewrite);
+    if (ok) {
         // We've saved everything, so we have no more unsaved items.
         this->first_unwritten_new_item_index = new_items.size();
 
@@ -1398,10 +2375,41 @@ bool history_t::save_internal_via_rewrite() {
         // file.
         this->clear_file_state();
     }
-
     return ok;
 }
 
+void history_t::start_background_vacuum() {
+    ASSERT_IS_LOCKED(lock);
+    if (first_unwritten_new_item_index < new_items.size() || !deleted_items.empty()) return;
+
+    // Only rewrite the file if it is still there and nobody else rewrites it first, since we have
+    // nothing of our own to write.
+    history_rewrite_t rewrite(name, history_type_unknown, chaos_mode);
+    rewrite.create = false;
+    if (rewrite.target_name.empty()) return;
+    {
+        std::lock_guard<std::mutex> locker(vacuum_state->lock);
+        if (vacuum_state->running) return;
+        vacuum_state->running = true;
+    }
+
+    // Once the file is replaced, our next append will notice and remap it.
+    std::shared_ptr<history_vacuum_state_t> state = vacuum_state;
+    iothread_perform([rewrite, state]() {
+        rewrite_history_file(rewrite);
+        std::lock_guard<std::mutex> locker(state->lock);
+        state->running = false;
+        state->cond.notify_all();
+    });
+}
+
+void history_t::wait_for_background_vacuum() {
+    std::unique_lock<std::mutex> locker(vacuum_state->lock);
+    while (vacuum_state->running) {
+        vacuum_state->cond.wait(locker);
+    }
+}
+
 // Function called to save our unwritten history file by appending to the existing history file
 // Returns true on success, false on failure.
 bool history_t::save_internal_via_appending() {
@@ -1417,7 +2425,8 @@ bool history_t::save_internal_via_appending() {
     bool file_changed = false;
 
     // Get the path to the real history file.
-    wcstring history_path = history_filename(name, wcstring());
+    bool binary = false;
+    wcstring history_path = history_file_path(name, &binary);
     if (history_path.empty()) {
         return true;
     }
@@ -1429,7 +2438,7 @@ bool history_t::save_internal_via_appending() {
     // Limit our max tries so we don't do this forever
     int history_fd = -1;
     for (int i = 0; i < max_save_tries; i++) {
-        int fd = wopen_cloexec(history_path, O_WRONLY | O_APPEND);
+        int fd = wopen_cloexec(history_path, O_RDWR | O_APPEND);
         if (fd < 0) {
             // can't open, we're hosed
             break;
@@ -1482,10 +2491,36 @@ bool history_t::save_internal_via_appending() {
         bool errored = false;
         // Use a small buffer size for appending, we usually only have 1 item
         history_output_buffer_t buffer(64);
-        while (first_unwritten_new_item_index < new_items.size()) {
+        // Never append to a file we can't read; rewriting it will fail too, so our items are kept
+        // in memory. An empty binary file needs its header first.
+        char header[kHistoryBinaryHeaderSize];
+        ssize_t header_len = pread(history_fd, header, sizeof header, 0);
+        const history_file_type_t file_type =
+            infer_file_type(header, header_len > 0 ? (size_t)header_len : 0, binary);
+        if (file_type == history_type_unrecognized) {
+            errored = true;
+        } else if (binary && file_type == history_type_unknown) {
+            buffer.append_bytes(history_binary_header());
+        }
+        // Remember where our items land, so we can add them to the index.
+        off_t append_offset = lseek(history_fd, 0, SEEK_END);
+        size_t flushed_size = 0;
+        std::vector<history_index_record_t> index_records;
+        while (!errored && first_unwritten_new_item_index < new_items.size()) {
             const history_item_t &item = new_items.at(first_unwritten_new_item_index);
-            append_yaml_to_buffer(item.str(), item.timestamp(), item.get_required_paths(), &buffer);
+            if (binary) {
+                append_binary_to_buffer(item.str(), item.timestamp(), item.get_required_paths(),
+                                        &buffer);
+            } else {
+                size_t offset = append_offset + flushed_size + buffer.output_size();
+                uint32_t hash = append_yaml_to_buffer(item.str(), item.timestamp(),
+                                                      item.get_required_paths(), &buffer);
+                uint32_t length =
+                    (uint32_t)(append_offset + flushed_size + buffer.output_size() - offset);
+                index_records.push_back({offset, (int64_t)item.timestamp(), length, hash});
+            }
             if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE) {
+                flushed_size += buffer.output_size();
                 errored = !buffer.flush_to_fd(history_fd);
                 if (errored) break;
             }
@@ -1496,6 +2531,11 @@ bool history_t::save_internal_via_appending() {
 
         if (!errored && buffer.flush_to_fd(history_fd)) {
             ok = true;
+            // We still hold the lock, so nobody else can append to either file right now.
+            if (append_offset >= 0) {
+                append_to_history_index(history_fd, history_filename(name, HISTORY_INDEX_SUFFIX),
+                                        (size_t)append_offset, index_records);
+            }
         }
 
         // Since we just modified the file, update our mmap_file_id to match its current state
@@ -1581,6 +2621,104 @@ static void format_history_record(const history_item_t &item, const wchar_t *sho
 
 /// This handles the slightly unusual case of someone searching history for
 /// specific terms/patterns.
+std::vector<history_item_t> history_t::find_matching_items(const wcstring &term,
+                                                           history_search_type_t type,
+                                                           bool case_sensitive, size_t max_items,
+                                                           bool parallel) {
+    std::vector<history_item_t> result;
+    if (max_items == 0) return result;
+
+    history_search_t searcher(*this, term, type, case_sensitive);
+    if (!parallel) {
+        while (result.size() < max_items && searcher.go_backwards()) {
+            result.push_back(searcher.current_item());
+        }
+        return result;
+    }
+
+    // The searcher has lowercased the term if necessary.
+    const wcstring &search_term = searcher.get_term();
+    const std::string narrow_term = wcs2string(search_term);
+
+    // Our new items are the most recent, and there are few of them, so check them here. Then take
+    // a snapshot of the file; the mapping keeps it alive even if the history is modified while the
+    // threads are scanning it.
+    std::vector<history_item_t> new_matches;
+    std::shared_ptr<const history_mapping_t> mapping;
+    std::vector<size_t> offsets;
+    history_file_type_t file_type;
+    {
+        scoped_lock locker(lock);
+        for (size_t i = this->resolved_new_item_count(); i-- > 0;) {
+            const history_item_t &item = new_items.at(i);
+            if (item.matches_search(search_term, type, case_sensitive)) {
+                new_matches.push_back(item);
+            }
+        }
+        load_old_if_needed();
+        mapping = mmap_mapping;
+        offsets.assign(old_item_offsets.begin(), old_item_offsets.end());
+        file_type = mmap_type;
+    }
+
+    // Merges matches into the result, most recent first, and returns whether it is now full.
+    std::unordered_set<wcstring> seen;
+    auto merge = [&](std::vector<history_item_t> &matches) {
+        for (history_item_t &item : matches) {
+            if (result.size() == max_items) break;
+            if (seen.insert(item.str()).second) result.push_back(std::move(item));
+        }
+        return result.size() == max_items;
+    };
+    if (merge(new_matches)) return result;
+
+    // Chunk 0 holds the most recent items of the file; each chunk is scanned from its most recent
+    // item backwards, and chunks are started in order. Duplicates within a chunk are dropped as we
+    // go. When a chunk finishes, it and any finished chunks after it are merged into the result,
+    // as long as every more recent chunk has been merged already. Once the result is full, the
+    // chunks still scanning hold only older items, so they stop.
+    size_t chunk_count = offsets.size() / history_parallel_search_min_chunk;
+    chunk_count = std::max(std::min(chunk_count, history_parallel_search_max_chunks), size_t(1));
+    const size_t chunk_size = (offsets.size() + chunk_count - 1) / chunk_count;
+
+    std::vector<std::vector<history_item_t>> chunk_matches(chunk_count);
+    std::vector<bool> chunk_done(chunk_count, false);
+    size_t merged_chunks = 0;
+    std::mutex merge_lock;
+    std::atomic<bool> cancelled{false}, full{false};
+    std::vector<std::function<void(void)>> tasks;
+    for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+        tasks.push_back([&, chunk]() {
+            const size_t end = offsets.size() - std::min(chunk * chunk_size, offsets.size());
+            const size_t begin = end - std::min(chunk_size, end);
+            std::unordered_set<wcstring> chunk_seen;
+            std::vector<history_item_t> &matches = chunk_matches.at(chunk);
+            for (size_t i = end; i-- > begin;) {
+                // Only the main thread may look for ^C; it tells everyone else to stop.
+                if (i % 1024 == 0 && is_main_thread() && reader_interrupted()) cancelled = true;
+                if (cancelled || full) return;
+
+                history_item_view_t view(mapping, offsets.at(i), file_type);
+                if (!view.may_match(narrow_term, type, case_sensitive)) continue;
+                const history_item_t &item = view.item();
+                if (item.matches_search(search_term, type, case_sensitive) &&
+                    chunk_seen.insert(item.str()).second) {
+                    matches.push_back(item);
+                }
+            }
+
+            std::lock_guard<std::mutex> locker(merge_lock);
+            chunk_done.at(chunk) = true;
+            while (!full && merged_chunks < chunk_count && chunk_done.at(merged_chunks)) {
+                if (merge(chunk_matches.at(merged_chunks++))) full = true;
+            }
+        });
+    }
+    iothread_perform_all(std::move(tasks));
+    if (cancelled) result.clear();
+    return result;
+}
+
 bool history_t::search_with_args(history_search_type_t search_type, wcstring_list_t search_args,
                                  const wchar_t *show_time_format, size_t max_items,
                                  bool case_sensitive, bool null_terminate, bool reverse,
@@ -1588,6 +2726,8 @@ bool history_t::search_with_args(history_search_type_t search_type, wcstring_lis
     wcstring_list_t results;
     size_t hist_size = this->size();
     if (max_items > hist_size) max_items = hist_size;
+    const bool parallel = hist_size >= history_parallel_search_min_items &&
+                          max_items > history_parallel_search_max_serial_results;
 
     for (wcstring_list_t::const_iterator iter = search_args.begin(); iter != search_args.end();
          ++iter) {
@@ -1596,11 +2736,9 @@ bool history_t::search_with_args(history_search_type_t search_type, wcstring_lis
             streams.err.append_format(L"Searching for the empty string isn't allowed");
             return false;
         }
-        history_search_t searcher =
-            history_search_t(*this, search_string, search_type, case_sensitive);
-        while (searcher.go_backwards()) {
+        for (const history_item_t &cur_item : find_matching_items(
+                 search_string, search_type, case_sensitive, max_items, parallel)) {
             wcstring result;
-            auto cur_item = searcher.current_item();
             format_history_record(cur_item, show_time_format, null_terminate, result);
             if (reverse) {
                 results.push_back(result);
@@ -1674,10 +2812,24 @@ void history_t::clear() {
     first_unwritten_new_item_index = 0;
     old_item_offsets.clear();
     wcstring filename = history_filename(name, L"");
-    if (!filename.empty()) wunlink(filename);
+    if (!filename.empty()) {
+        wunlink(filename);
+        wunlink(history_filename(name, HISTORY_INDEX_SUFFIX));
+        wunlink(history_filename(name, HISTORY_BINARY_SUFFIX));
+    }
     this->clear_file_state();
 }
 
+bool history_t::convert(history_file_type_t type) {
+    scoped_lock locker(lock);
+    if (history_filename(name, L"").empty()) return false;
+    this->compact_new_items();
+    rewrite_type = type;
+    bool ok = this->save_internal_via_rewrite();
+    rewrite_type = history_type_unknown;
+    return ok;
+}
+
 bool history_t::is_empty() {
     scoped_lock locker(lock);
 
@@ -1691,7 +2843,7 @@ bool history_t::is_empty() {
     } else {
         // If we have not loaded old items, don't actually load them (which may be expensive); just
         // stat the file and see if it exists and is nonempty.
-        const wcstring where = history_filename(name, L"");
+        const wcstring where = history_file_path(name);
         if (where.empty()) {
             return true;
         }
@@ -1837,10 +2989,11 @@ void history_t::incorporate_external_changes() {
 }
 
 void history_collection_t::save() {
-    // Save all histories
+    // Save all histories, and don't leave any vacuum half done (e.g. when exiting).
     auto &&h = histories.acquire();
     for (auto &p : h.value) {
         p.second->save();
+        p.second->wait_for_background_vacuum();
     }
 }
 
@@ -19,9 +19,13 @@
 #include <vector>
 
 #include "common.h"
+#include "maybe.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 struct io_streams_t;
+struct history_vacuum_state_t;
+class history_mapping_t;
+class history_search_index_t;
 
 // Fish supports multiple shells writing to history at once. Here is its strategy:
 //
@@ -30,7 +34,10 @@ struct io_streams_t;
 // 2. A history file may be re-written ("vacuumed"). This involves reading in the file and writing a
 // new one, while performing maintenance tasks: discarding items in an LRU fashion until we reach
 // the desired maximum count, removing duplicates, and sorting them by timestamp (eventually, not
-// implemented yet). The new file is atomically moved into place via rename().
+// implemented yet). The new file is atomically moved into place via rename(). The new file is
+// written without holding any lock; the write lock is only taken to check that nobody changed the
+// old file in the meantime (in which case we start over), and to rename. The periodic vacuum runs
+// on a background thread, after our new items have been appended as usual.
 //
 // 3. History files are mapped in via mmap(). Before the file is mapped, the file takes a fcntl read
 // lock. The purpose of this lock is to avoid seeing a transient state where partial data has been
@@ -58,6 +65,25 @@ enum history_search_type_t {
 
 typedef uint32_t history_identifier_t;
 
+// The items of a history file that may match one search, as found by the history's search index.
+// Each search keeps its own, so that searches of the same history (say, an autosuggestion and a
+// history search on the main thread) don't keep making each other start over.
+struct history_search_candidates_t {
+    // The search: its term (lowercased if not case sensitive) and type.
+    wcstring term;
+    history_search_type_t type = HISTORY_SEARCH_TYPE_CONTAINS;
+    bool case_sensitive = true;
+
+    // The search index generation the candidates were computed for, or 0 if they never were.
+    uint64_t generation = 0;
+
+    // Whether the index could rule out any items for this search. If not, all items may match.
+    bool usable = false;
+
+    // Offsets into the history file of the items that may match, in increasing order.
+    std::vector<size_t> offsets;
+};
+
 class history_item_t {
     friend class history_t;
     friend class history_tests_t;
@@ -66,9 +92,8 @@ class history_item_t {
     // Attempts to merge two compatible history items together.
     bool merge(const history_item_t &item);
 
-    // The actual contents of the entry.
-    wcstring contents;        // value as entered by the user
-    wcstring contents_lower;  // value normalized to all lowercase for case insensitive comparisons
+    // The actual contents of the entry, as entered by the user.
+    wcstring contents;
 
     // Original creation time for the entry.
     time_t creation_timestamp;
@@ -83,7 +108,6 @@ class history_item_t {
     explicit history_item_t(const wcstring &str, time_t when = 0, history_identifier_t ident = 0);
 
     const wcstring &str() const { return contents; }
-    const wcstring &str_lower() const { return contents_lower; }
 
     bool empty() const { return contents.empty(); }
 
@@ -104,8 +128,68 @@ class history_item_t {
 
 typedef std::deque<history_item_t> history_item_list_t;
 
-// The type of file that we mmap'd.
-enum history_file_type_t { history_type_unknown, history_type_fish_2_0, history_type_fish_1_x };
+// The type of file that we mmap'd. An empty file has unknown type. An unrecognized file, such as
+// one written by a later version of fish, is neither read nor written.
+enum history_file_type_t {
+    history_type_unknown,
+    history_type_fish_2_0,
+    history_type_fish_1_x,
+    history_type_binary,
+    history_type_unrecognized
+};
+
+// A view of a history item, which avoids decoding the item until it is needed. A view of an item
+// from the history file refers directly to the mapped file, which it keeps alive, and can compare
+// the item against a search term byte by byte. Items that are not in the file are held decoded.
+class history_item_view_t {
+    friend class history_t;
+
+   private:
+    // The mapped file containing the item, or null if the item is held decoded.
+    std::shared_ptr<const history_mapping_t> mapping;
+
+    // The offset of the item in the mapped file, and the file's format.
+    size_t offset;
+    history_file_type_t type;
+
+    // The decoded item. This is set up front for items that are not in the file, and on first use
+    // otherwise.
+    mutable maybe_t<history_item_t> decoded;
+
+    // Whether the item was ruled out by a search; see ruled_out().
+    bool excluded = false;
+
+    history_item_view_t(std::shared_ptr<const history_mapping_t> mapping, size_t offset,
+                        history_file_type_t type);
+    explicit history_item_view_t(const history_item_t &item);
+
+    // Constructs a view of an item that was ruled out by a search.
+    static history_item_view_t ruled_out_view();
+
+   public:
+    // Constructs a view of no item; see empty().
+    history_item_view_t();
+    history_item_view_t(history_item_view_t &&) = default;
+    history_item_view_t &operator=(history_item_view_t &&) = default;
+    ~history_item_view_t();
+
+    // Whether this view is of no item at all, i.e. past the end of history.
+    bool empty() const { return !mapping && !decoded && !excluded; }
+
+    // Whether this view stands for an item that the history's search index showed cannot match
+    // the search it was asked for. There is no item to look at.
+    bool ruled_out() const { return excluded; }
+
+    // Return the decoded item, decoding it if necessary.
+    const history_item_t &item() const;
+
+    // Return whether the item could match a search for the given term, which is the
+    // narrow-encoded search term (lowercased if case_sensitive is false). This does not decode the
+    // item, or allocate. It may return true for an item that does not match, but never returns
+    // false for one that does.
+    bool may_match(const std::string &narrow_term, history_search_type_t type,
+                   bool case_sensitive) const;
+};
 
 class history_t {
     friend class history_tests_t;
@@ -146,7 +230,9 @@ class history_t {
     // Deleted item contents.
     std::unordered_set<wcstring> deleted_items;
 
-    // The mmaped region for the history file.
+    // The mmaped region for the history file. It is owned by mmap_mapping, which is shared with
+    // any item views into it.
+    std::shared_ptr<const history_mapping_t> mmap_mapping;
     const char *mmap_start;
 
     // The size of the mmap'd region.
@@ -167,8 +253,9 @@ class history_t {
     // How many items we add until the next vacuum. Initially a random value.
     int countdown_to_vacuum;
 
-    // Figure out the offsets of our mmap data.
-    void populate_from_mmap(void);
+    // Figure out the offsets of our mmap data, which came from the binary history file if
+    // binary_file is set.
+    void populate_from_mmap(bool binary_file);
 
     // List of old items, as offsets into out mmap data.
     std::deque<size_t> old_item_offsets;
@@ -176,6 +263,22 @@ class history_t {
     // Whether we've loaded old items.
     bool loaded_old;
 
+    // The format to use for the next rewrite of the history file. If unknown, the file keeps its
+    // current format (a fish 1.x file is upgraded to fish 2.0).
+    history_file_type_t rewrite_type;
+
+    // Index over the contents of the items in our mmap'd file, used to skip items that cannot
+    // match a search without decoding them. Built the first time it's needed, and extended as the
+    // file grows.
+    std::unique_ptr<history_search_index_t> search_index;
+
+    // Brings the search index up to date with our mmap'd file.
+    void update_search_index();
+
+    // Return whether the old item at the given offset into our mmap'd file may match the search
+    // described by candidates, computing them if needed.
+    bool old_item_may_match(size_t offset, history_search_candidates_t *candidates);
+
     // Loads old if necessary.
     bool load_old_if_needed(void);
 
@@ -185,10 +288,6 @@ class history_t {
     // Deletes duplicates in new_items.
     void compact_new_items();
 
-    // Attempts to rewrite the existing file to a target temporary file
-    // Returns false on error, true on success
-    bool rewrite_to_temporary_file(int existing_fd, int dst_fd) const;
-
     // Saves history by rewriting the file.
     bool save_internal_via_rewrite();
 
@@ -201,13 +300,19 @@ class history_t {
     // Saves history unless doing so is disabled.
     void save_internal_unless_disabled();
 
-    // Do a private, read-only map of the entirety of a history file with the given name. Returns
-    // true if successful. Returns the mapped memory region by reference.
-    bool map_file(const wcstring &name, const char **out_map_start, size_t *out_map_len,
-                  file_id_t *file_id) const;
+    // Whether a vacuum of our file is running in the background. This is shared with the
+    // background thread, which does not otherwise touch the history.
+    std::shared_ptr<history_vacuum_state_t> vacuum_state;
 
-    // Like map_file but takes a file descriptor
-    bool map_fd(int fd, const char **out_map_start, size_t *out_map_len) const;
+    // Starts vacuuming our file in the background, unless a vacuum is already running. Only the
+    // contents of the file are vacuumed, so all of our items must already have been saved.
+    void start_background_vacuum();
+
+    // Do a private, read-only map of the entirety of the history file with the given name: the
+    // binary file if there is one, else the text file. Returns true if successful. Returns the
+    // mapped memory region, and whether it is the binary file, by reference.
+    bool map_file(const wcstring &name, const char **out_map_start, size_t *out_map_len,
+                  file_id_t *file_id, bool *out_binary) const;
 
     // Whether we're in maximum chaos mode, useful for testing.
     bool chaos_mode;
@@ -215,8 +320,12 @@ class history_t {
     // Implementation of item_at_index and items_at_indexes
     history_item_t item_at_index_assume_locked(size_t idx);
 
+    // Returns the number of new items, not counting any pending item.
+    size_t resolved_new_item_count() const;
+
    public:
     explicit history_t(wcstring );  // constructor
+    ~history_t();
 
     // Returns history with the given name, creating it if necessary.
     static history_t &history_with_name(const wcstring &name);
@@ -244,6 +353,9 @@ class history_t {
     // Saves history.
     void save();
 
+    // Waits for any vacuum of the history file running in the background to finish.
+    void wait_for_background_vacuum();
+
     // Searches history.
     bool search(history_search_type_t search_type, wcstring_list_t search_args,
                 const wchar_t *show_time_format, size_t max_items, bool case_sensitive,
@@ -252,6 +364,16 @@ class history_t {
                           const wchar_t *show_time_format, size_t max_items, bool case_sensitive,
                           bool null_terminate, bool reverse, io_streams_t &streams);
 
+    // Returns up to max_items items matching a search for the given term, most recent first and
+    // without duplicates, just as history_search_t would find them. If parallel is set, the items
+    // from the history file are split into chunks which are scanned concurrently on the iothread
+    // pool, most recent first, and the scan stops once max_items have been found. This may be
+    // called from any thread; only a search on the main thread can be cancelled with ^C.
+    std::vector<history_item_t> find_matching_items(const wcstring &term,
+                                                    history_search_type_t type,
+                                                    bool case_sensitive, size_t max_items,
+                                                    bool parallel);
+
     // Enable / disable automatic saving. Main thread only!
     void disable_automatic_saving();
     void enable_automatic_saving();
@@ -259,6 +381,11 @@ class history_t {
     // Irreversibly clears history.
     void clear();
 
+    // Rewrites the history file in the given format, which later saves keep using. Converting to
+    // binary leaves the text file alone, for older versions of fish; converting to text replaces
+    // it and removes the binary file. Returns false if the history could not be saved.
+    bool convert(history_file_type_t type);
+
     // Populates from older location ()in config path, rather than data path).
     void populate_from_config_path();
 
@@ -284,6 +411,13 @@ class history_t {
     // commandline. (So the most recent item is at index 1.)
     history_item_t item_at_index(size_t idx);
 
+    // Like item_at_index, but returns a view of the item without decoding it. Returns an empty
+    // view if the index is past the end of history. If candidates is set, items from the file that
+    // the search index shows cannot match that search are returned as ruled out views; the
+    // candidates are computed on first use and kept there for later calls.
+    history_item_view_t item_view_at_index(size_t idx,
+                                           history_search_candidates_t *candidates = NULL);
+
     // Return the number of history entries.
     size_t size();
 };
@@ -296,10 +430,16 @@ class history_search_t {
     // The search term.
     wcstring term;
 
+    // The search term, narrow-encoded for matching against item views.
+    std::string narrow_term;
+
     // Our search type.
     enum history_search_type_t search_type;
     bool case_sensitive;
 
+    // The items of the history file that may match, as found by the history's search index.
+    history_search_candidates_t candidates;
+
     // Our list of previous matches as index, value. The end is the current match.
     typedef std::pair<size_t, history_item_t> prev_match_t;
     std::vector<prev_match_t> prev_matches;
@@ -335,7 +475,7 @@ class history_search_t {
     void go_to_beginning(void);
 
     // Returns the current search result item. asserts if there is no current item.
-    history_item_t current_item(void) const;
+    const history_item_t &current_item(void) const;
 
     // Returns the current search result item contents. asserts if there is no current item.
     wcstring current_string(void) const;
@@ -351,6 +491,10 @@ class history_search_t {
                 term.push_back(towlower(*it));
             }
         }
+        narrow_term = wcs2string(term);
+        candidates.term = term;
+        candidates.type = type;
+        candidates.case_sensitive = case_sensitive;
     }
 
     // Default constructor.
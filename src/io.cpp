@@ -4,15 +4,128 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <wchar.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#include <sys/time.h>  // IWYU pragma: keep
+#include <sys/types.h>
 
 #include "common.h"
 #include "exec.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "io.h"
+#include "iothread.h"
+#include "util.h"
 #include "wutil.h"  // IWYU pragma: keep
 
+/// How much we try to read from a buffer's pipe at once.
+#define FILL_READ_SIZE 65536
+
+/// Size of the first chunk of a chunked_buffer_t. Each chunk is twice as large as the previous one,
+/// up to the maximum.
+#define CHUNK_MIN_SIZE 4096
+#define CHUNK_MAX_SIZE (4 * 1024 * 1024)
+
+void chunked_buffer_t::append(const char *ptr, size_t count) {
+    while (count > 0) {
+        if (chunks.empty() || chunks.back().used == chunks.back().capacity) {
+            size_t capacity =
+                chunks.empty() ? CHUNK_MIN_SIZE : mini<size_t>(chunks.back().capacity * 2,
+                                                                 CHUNK_MAX_SIZE);
+            chunks.push_back(chunk_t{std::unique_ptr<char[]>(new char[capacity]), capacity, 0});
+        }
+        chunk_t &chunk = chunks.back();
+        size_t amt = mini(count, chunk.capacity - chunk.used);
+        char *dst = chunk.data.get() + chunk.used;
+        memcpy(dst, ptr, amt);
+
+        // Index the newlines in what we just stored.
+        const char *cursor = dst, *end = dst + amt;
+        while (const char *nl = (const char *)memchr(cursor, '\n', end - cursor)) {
+            newline_offsets.push_back(size_ + (nl - dst));
+            cursor = nl + 1;
+        }
+
+        chunk.used += amt;
+        size_ += amt;
+        ptr += amt;
+        count -= amt;
+    }
+}
+
+void chunked_buffer_t::clear() {
+    chunks.clear();
+    newline_offsets.clear();
+    size_ = 0;
+}
+
+std::string chunked_buffer_t::contents() const {
+    std::string result;
+    result.reserve(size_);
+    for (const chunk_t &chunk : chunks) {
+        result.append(chunk.data.get(), chunk.used);
+    }
+    return result;
+}
+
+void chunked_buffer_t::for_each_chunk(const std::function<void(const char *, size_t)> &func) const {
+    for (const chunk_t &chunk : chunks) {
+        func(chunk.data.get(), chunk.used);
+    }
+}
+
+void chunked_buffer_t::for_each_line(const std::function<void(const char *, size_t)> &func) const {
+    // The chunk containing the start of the current line, and the offset at which it starts.
+    size_t chunk_idx = 0, chunk_start = 0;
+    std::string scratch;
+    // Pass the bytes in [start, end) to func. Lines come in order, so we only walk forwards.
+    auto emit = [&](size_t start, size_t end) {
+        while (chunk_start + chunks.at(chunk_idx).used <= start && start < size_) {
+            chunk_start += chunks.at(chunk_idx).used;
+            chunk_idx++;
+        }
+        if (start == end) {
+            func("", 0);
+        } else if (end <= chunk_start + chunks.at(chunk_idx).used) {
+            func(chunks.at(chunk_idx).data.get() + (start - chunk_start), end - start);
+        } else {
+            // The line spans chunks, so assemble it.
+            scratch.clear();
+            size_t idx = chunk_idx, idx_start = chunk_start;
+            while (idx_start < end) {
+                const chunk_t &chunk = chunks.at(idx);
+                size_t from = maxi(start, idx_start) - idx_start;
+                size_t to = mini(end, idx_start + chunk.used) - idx_start;
+                scratch.append(chunk.data.get() + from, to - from);
+                idx_start += chunk.used;
+                idx++;
+            }
+            func(scratch.data(), scratch.size());
+        }
+    };
+
+    size_t line_start = 0;
+    for (size_t nl : newline_offsets) {
+        emit(line_start, nl);
+        line_start = nl + 1;
+    }
+    if (line_start < size_) {
+        emit(line_start, size_);
+    }
+}
+
+int chunked_buffer_t::write_to(int fd) const {
+    for (const chunk_t &chunk : chunks) {
+        if (write_loop(fd, chunk.data.get(), chunk.used) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 io_data_t::~io_data_t() = default;
 
 void io_close_t::print() const { fwprintf(stderr, L"close %d\n", fd); }
@@ -27,13 +140,120 @@ void io_pipe_t::print() const {
 }
 
 void io_buffer_t::print() const {
-    fwprintf(stderr, L"buffer %p (input: %s, size %lu)\n", out_buffer_ptr(),
+    fwprintf(stderr, L"buffer %p (input: %s, size %lu)\n", (const void *)this,
              is_input ? "yes" : "no", (unsigned long)out_buffer_size());
 }
 
+void io_buffer_t::out_buffer_append_locked(const char *ptr, size_t count) {
+    ASSERT_IS_LOCKED(append_lock);
+    if (discard) return;
+    if (buffer_limit && out_buffer.size() + count > buffer_limit) {
+        discard = true;
+        out_buffer.clear();
+        return;
+    }
+    out_buffer.append(ptr, count);
+}
+
+void io_buffer_t::out_buffer_append(const char *ptr, size_t count) {
+    scoped_lock locker(append_lock);
+    // Output already in the pipe was written before this, so it goes first.
+    if (fill_fd >= 0) fill_from_pipe_locked();
+    out_buffer_append_locked(ptr, count);
+}
+
+bool io_buffer_t::fill_from_pipe_locked() {
+    ASSERT_IS_LOCKED(append_lock);
+    assert(fill_fd >= 0);
+    for (;;) {
+        char b[FILL_READ_SIZE];
+        ssize_t amt = ::read(fill_fd, b, sizeof b);
+        if (amt > 0) {
+            out_buffer_append_locked(b, amt);
+        } else if (amt == 0) {
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                const wchar_t *fmt =
+                    _(L"An error occured while reading output from code block on fd %d");
+                debug(1, fmt, fill_fd);
+                wperror(L"io_buffer_t::fill_from_pipe_locked");
+                return true;
+            }
+            return false;
+        }
+    }
+}
+
+void *io_buffer_t::fill_thread_main(void *param) {
+    io_buffer_t *self = static_cast<io_buffer_t *>(param);
+    const int fill_fd = self->fill_fd;
+    const int stop_fd = self->fill_stop_pipe[0];
+    for (;;) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fill_fd, &fds);
+        FD_SET(stop_fd, &fds);
+        int ret = select(maxi(fill_fd, stop_fd) + 1, &fds, NULL, NULL, NULL);
+        if (ret < 0 && errno != EINTR) {
+            wperror(L"select");
+            break;
+        }
+        // Once asked to stop, we read what's left in the pipe and then exit, even if some
+        // background process still has the write end open.
+        bool stopping = ret > 0 && FD_ISSET(stop_fd, &fds);
+        scoped_lock locker(self->append_lock);
+        bool eof = self->fill_from_pipe_locked();
+        if (stopping || eof) break;
+    }
+    return NULL;
+}
+
+bool io_buffer_t::start_filling() {
+    assert(fill_fd < 0 && pipe_fd[0] >= 0);
+    if (exec_pipe(fill_stop_pipe) == -1) {
+        wperror(L"pipe");
+        return false;
+    }
+    // The fill thread owns the read end from now on. Take it out of pipe_fd so nothing else reads
+    // it, and so that moving fds out of the way of redirections leaves it alone.
+    fill_fd = pipe_fd[0];
+    pipe_fd[0] = -1;
+    if (!make_pthread(&fill_thread, fill_thread_main, this)) {
+        pipe_fd[0] = fill_fd;
+        fill_fd = -1;
+        exec_close(fill_stop_pipe[0]);
+        exec_close(fill_stop_pipe[1]);
+        fill_stop_pipe[0] = fill_stop_pipe[1] = -1;
+        return false;
+    }
+    return true;
+}
+
+void io_buffer_t::stop_filling() {
+    assert(fill_fd >= 0);
+    char c = 0;
+    ssize_t ignored = write(fill_stop_pipe[1], &c, 1);
+    UNUSED(ignored);
+    DIE_ON_FAILURE(pthread_join(fill_thread, NULL));
+
+    exec_close(fill_stop_pipe[0]);
+    exec_close(fill_stop_pipe[1]);
+    fill_stop_pipe[0] = fill_stop_pipe[1] = -1;
+    exec_close(fill_fd);
+    fill_fd = -1;
+}
+
 void io_buffer_t::read() {
     exec_close(pipe_fd[1]);
 
+    if (fill_fd >= 0) {
+        stop_filling();
+        return;
+    }
+
     if (io_mode == IO_BUFFER) {
 #if 0
         if (fcntl( pipe_fd[0], F_SETFL, 0)) {
@@ -61,7 +281,8 @@ void io_buffer_t::read() {
 
                 break;
             } else {
-                out_buffer_append(b, l);
+                scoped_lock locker(append_lock);
+                out_buffer_append_locked(b, l);
             }
         }
     }
@@ -92,6 +313,9 @@ shared_ptr<io_buffer_t> io_buffer_t::create(int fd, const io_chain_t &conflicts,
         debug(1, PIPE_ERROR);
         wperror(L"fcntl");
         success = false;
+    } else if (!buffer_redirect->start_filling()) {
+        // Not fatal; the job machinery will poll the pipe instead.
+        debug(2, L"Could not start a thread to fill io buffer, falling back to polling");
     }
 
     if (!success) {
@@ -101,6 +325,9 @@ shared_ptr<io_buffer_t> io_buffer_t::create(int fd, const io_chain_t &conflicts,
 }
 
 io_buffer_t::~io_buffer_t() {
+    if (fill_fd >= 0) {
+        stop_filling();
+    }
     if (pipe_fd[0] >= 0) {
         exec_close(pipe_fd[0]);
     }
@@ -108,6 +335,16 @@ io_buffer_t::~io_buffer_t() {
     // the buffer.
 }
 
+void output_stream_t::flush() {
+    if (stream_fd < 0 || buffer_.empty()) return;
+    const std::string narrow = wcs2string(buffer_);
+    buffer_.clear();
+    // EPIPE just means nobody is reading any more; the rest of the output is dropped as well.
+    if (write_loop(stream_fd, narrow.data(), narrow.size()) < 0 && errno != EPIPE) {
+        wperror(L"write");
+    }
+}
+
 void io_chain_t::remove(const shared_ptr<const io_data_t> &element) {
     // See if you can guess why std::find doesn't work here.
     for (io_chain_t::iterator iter = this->begin(); iter != this->end(); ++iter) {
@@ -201,6 +438,7 @@ static int move_fd_to_unused(int fd, const io_chain_t &io_chain) {
 bool pipe_avoid_conflicts_with_io_chain(int fds[2], const io_chain_t &ios) {
     bool success = true;
     for (int i = 0; i < 2; i++) {
+        if (fds[i] < 0) continue;  // e.g. a buffer whose read end belongs to its fill thread
         fds[i] = move_fd_to_unused(fds[i], ios);
         if (fds[i] < 0) {
             success = false;
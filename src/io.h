@@ -1,10 +1,13 @@
 #ifndef FISH_IO_H
 #define FISH_IO_H
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
 
+#include <functional>
+#include <string>
 #include <vector>
 // Note that we have to include something to get any _LIBCPP_VERSION defined so we can detect libc++
 // So it's key that vector go above. If we didn't need vector for other reasons, we might include
@@ -91,6 +94,9 @@ class io_pipe_t : public io_data_t {
    public:
     int pipe_fd[2];
     const bool is_input;
+    /// Set on the write end of a pipe when the process reading from it has already been started,
+    /// so output may be written into it directly without waiting for the reader.
+    bool reader_running = false;
 
     void print() const override;
 
@@ -98,6 +104,60 @@ class io_pipe_t : public io_data_t {
 };
 
 class io_chain_t;
+
+/// A byte buffer which stores its contents in a list of chunks, so appending never moves data that
+/// is already stored. The position of each newline is recorded as data is appended, so the contents
+/// can be split into lines without scanning them again.
+class chunked_buffer_t {
+    struct chunk_t {
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t used;
+    };
+    /// The chunks, in order. All but the last are full. Chunks get bigger as the buffer grows, so
+    /// small outputs stay small and large ones need few chunks.
+    std::vector<chunk_t> chunks;
+    /// Total number of bytes stored.
+    size_t size_ = 0;
+    /// Offset of every newline in the buffer, in increasing order.
+    std::vector<size_t> newline_offsets;
+
+   public:
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /// Number of newlines in the buffer.
+    size_t newline_count() const { return newline_offsets.size(); }
+
+    void append(const char *ptr, size_t count);
+
+    /// Release all contents.
+    void clear();
+
+    /// Return the contents as one contiguous string.
+    std::string contents() const;
+
+    /// Whether the last byte stored is a newline.
+    bool ends_with_newline() const {
+        return !newline_offsets.empty() && newline_offsets.back() + 1 == size_;
+    }
+
+    /// Call func with the contents of each chunk, in order, without copying.
+    void for_each_chunk(const std::function<void(const char *, size_t)> &func) const;
+
+    /// Call func with each newline-terminated line, excluding the newline, followed by any text
+    /// after the last newline. Lines within a single chunk are passed without copying.
+    void for_each_line(const std::function<void(const char *, size_t)> &func) const;
+
+    /// Write the contents to fd. This does not allocate, so it is safe to use after fork. Returns
+    /// -1 on error.
+    int write_to(int fd) const;
+};
+
+/// An io_buffer_t collects the output written to a pipe, e.g. by a command substitution. The read
+/// end of the pipe is drained continuously by a dedicated fill thread, so writers never stall on a
+/// full pipe while the main thread is busy or waiting. If the thread cannot be started, the read
+/// end stays in pipe_fd[0] and is polled by the job machinery instead.
 class io_buffer_t : public io_pipe_t {
    private:
     /// True if we're discarding input.
@@ -105,34 +165,62 @@ class io_buffer_t : public io_pipe_t {
     /// Limit on how much data we'll buffer. Zero means no limit.
     size_t buffer_limit;
     /// Buffer to save output in.
-    std::vector<char> out_buffer;
+    chunked_buffer_t out_buffer;
+
+    /// Protects discard and out_buffer while the fill thread is running, and serializes reads from
+    /// fill_fd so that output is appended in the order it was written.
+    fish_mutex_t append_lock;
+    /// The read end of the pipe, owned by the fill thread. -1 if there is no fill thread.
+    int fill_fd;
+    /// Writing to the write end of this pipe tells the fill thread to finish up.
+    int fill_stop_pipe[2];
+    /// The fill thread, valid if fill_fd is not -1.
+    pthread_t fill_thread;
 
     explicit io_buffer_t(int f, size_t limit)
         : io_pipe_t(IO_BUFFER, f, false /* not input */),
           discard(false),
           buffer_limit(limit),
-          out_buffer() {}
+          fill_fd(-1),
+          fill_thread() {
+        fill_stop_pipe[0] = fill_stop_pipe[1] = -1;
+    }
+
+    /// Append to the buffer. append_lock must be held.
+    void out_buffer_append_locked(const char *ptr, size_t count);
+
+    /// Read whatever is currently available from fill_fd into the buffer. append_lock must be held.
+    /// Returns true if the pipe has reached EOF.
+    bool fill_from_pipe_locked();
+
+    /// Start the fill thread, handing it the read end of the pipe. Returns false if it could not be
+    /// started, in which case nothing has changed.
+    bool start_filling();
+
+    /// Tell the fill thread to read what remains in the pipe and exit, and wait for it.
+    void stop_filling();
+
+    /// The body of the fill thread.
+    static void *fill_thread_main(void *param);
 
    public:
     void print() const override;
 
     ~io_buffer_t() override;
 
-    /// Function to append to the buffer.
-    void out_buffer_append(const char *ptr, size_t count) {
-        if (discard) return;
-        if (buffer_limit && out_buffer.size() + count > buffer_limit) {
-            discard = true;
-            out_buffer.clear();
-            return;
-        }
-        out_buffer.insert(out_buffer.end(), ptr, ptr + count);
-    }
+    /// Function to append to the buffer. Anything already sitting in the pipe is read first, so
+    /// output appended here is ordered after output written to the pipe.
+    void out_buffer_append(const char *ptr, size_t count);
 
-    /// Function to get a pointer to the buffer.
-    char *out_buffer_ptr(void) { return out_buffer.empty() ? NULL : &out_buffer.at(0); }
+    /// Function to get the buffer. Only valid once read() has been called.
+    const chunked_buffer_t &get_out_buffer(void) const { return out_buffer; }
 
-    const char *out_buffer_ptr(void) const { return out_buffer.empty() ? NULL : &out_buffer.at(0); }
+    /// Take the contents of the buffer, leaving it empty. Only valid once read() has been called.
+    chunked_buffer_t take_out_buffer() {
+        chunked_buffer_t result = std::move(out_buffer);
+        out_buffer.clear();
+        return result;
+    }
 
     /// Function to get the size of the buffer.
     size_t out_buffer_size(void) const { return out_buffer.size(); }
@@ -143,6 +231,7 @@ class io_buffer_t : public io_pipe_t {
     /// Function to explicitly put the object in discard mode. Meant to be used when moving
     /// the results from an output_stream_t to an io_buffer_t.
     void set_discard(void) {
+        scoped_lock locker(append_lock);
         discard = true;
         out_buffer.clear();
     }
@@ -153,7 +242,8 @@ class io_buffer_t : public io_pipe_t {
     /// Ensures that the pipes do not conflict with any fd redirections in the chain.
     bool avoid_conflicts_with_io_chain(const io_chain_t &ios);
 
-    /// Close output pipe, and read from input pipe until eof.
+    /// Close output pipe, and collect everything written to the pipe so far. After this returns, no
+    /// other thread touches the buffer.
     void read();
 
     /// Create a IO_BUFFER type io redirection, complete with a pipe and a vector<char> for output.
@@ -187,7 +277,7 @@ shared_ptr<io_data_t> io_chain_get(io_chain_t &src, int fd);
 /// Given a pair of fds, if an fd is used by the given io chain, duplicate that fd repeatedly until
 /// we find one that does not conflict, or we run out of fds. Returns the new fds by reference,
 /// closing the old ones. If we get an error, returns false (in which case both fds are closed and
-/// set to -1).
+/// set to -1). Fds which are already -1 are left alone.
 bool pipe_avoid_conflicts_with_io_chain(int fds[2], const io_chain_t &ios);
 
 /// Class representing the output that a builtin can generate.
@@ -203,15 +293,34 @@ class output_stream_t {
 
     wcstring buffer_;
 
+    /// If not -1, the fd that output is written to as it accumulates, instead of being held until
+    /// the builtin is done.
+    int stream_fd;
+
     void check_for_overflow() {
         if (buffer_limit && buffer_.size() > buffer_limit) {
             discard = true;
             buffer_.clear();
+        } else if (stream_fd >= 0 && buffer_.size() >= OUTPUT_STREAM_FLUSH_SIZE) {
+            flush();
         }
     }
 
    public:
-    output_stream_t(size_t buffer_limit_) : buffer_limit(buffer_limit_), discard(false) {}
+    /// How much output a streaming output_stream_t holds before it writes it out, in characters.
+    static const size_t OUTPUT_STREAM_FLUSH_SIZE = 16 * 1024;
+
+    output_stream_t(size_t buffer_limit_)
+        : buffer_limit(buffer_limit_), discard(false), stream_fd(-1) {}
+
+    /// Write output to the given fd as it accumulates, or stop doing so if fd is -1. This must only
+    /// be used for fds whose reader is running, since writing may block until it catches up. Any
+    /// output still buffered when the builtin finishes must be written by the caller. Streams with a
+    /// buffer limit are never written early, since the limit applies to all of their output.
+    void set_stream_fd(int fd) { stream_fd = buffer_limit ? -1 : fd; }
+
+    /// Write out and clear the buffered output, if there is a stream fd.
+    void flush();
 
 #if 0
     void set_buffer_limit(size_t buffer_limit_) { buffer_limit = buffer_limit_; }
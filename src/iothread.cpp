@@ -10,7 +10,10 @@
 #include <atomic>
 
 #include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <vector>
 
 #include "common.h"
 #include "iothread.h"
@@ -148,8 +151,7 @@ static void *iothread_worker(void *unused) {
     return NULL;
 }
 
-/// Spawn another thread. No lock is held when this is called.
-static void iothread_spawn() {
+bool make_pthread(pthread_t *result, void *(*func)(void *), void *param) {
     // The spawned thread inherits our signal mask. We don't want the thread to ever receive signals
     // on the spawned thread, so temporarily block all signals, spawn the thread, and then restore
     // it.
@@ -157,25 +159,32 @@ static void iothread_spawn() {
     sigfillset(&new_set);
     DIE_ON_FAILURE(pthread_sigmask(SIG_BLOCK, &new_set, &saved_set));
 
-    // Spawn a thread. If this fails, it means there's already a bunch of threads; it is very
-    // unlikely that they are all on the verge of exiting, so one is likely to be ready to handle
-    // extant requests. So we can ignore failure with some confidence.
-    pthread_t thread = 0;
-    pthread_create(&thread, NULL, iothread_worker, NULL);
+    int err = pthread_create(result, NULL, func, param);
+    if (err == 0) {
+        debug(5, "pthread %p spawned", (void *)(intptr_t)*result);
+    } else {
+        debug(5, "pthread_create failed with error %d", err);
+    }
 
-    // We will never join this thread.
-    DIE_ON_FAILURE(pthread_detach(thread));
-    debug(5, "pthread %p spawned", (void *)(intptr_t)thread);
     // Restore our sigmask.
     DIE_ON_FAILURE(pthread_sigmask(SIG_SETMASK, &saved_set, NULL));
+    return err == 0;
 }
 
-int iothread_perform_impl(void_function_t &&func, void_function_t &&completion) {
-    ASSERT_IS_MAIN_THREAD();
-    ASSERT_IS_NOT_FORKED_CHILD();
-    iothread_init();
+/// Spawn another thread. No lock is held when this is called.
+static void iothread_spawn() {
+    // Spawn a thread. If this fails, it means there's already a bunch of threads; it is very
+    // unlikely that they are all on the verge of exiting, so one is likely to be ready to handle
+    // extant requests. So we can ignore failure with some confidence.
+    pthread_t thread = 0;
+    if (make_pthread(&thread, iothread_worker, NULL)) {
+        // We will never join this thread.
+        DIE_ON_FAILURE(pthread_detach(thread));
+    }
+}
 
-    struct spawn_request_t req(std::move(func), std::move(completion));
+/// Enqueue a request, spawning a thread to service it if we are under the thread limit.
+static int iothread_enqueue(spawn_request_t &&req) {
     int local_thread_count = -1;
     bool spawn_new_thread = false;
     {
@@ -197,6 +206,59 @@ int iothread_perform_impl(void_function_t &&func, void_function_t &&completion)
     return local_thread_count;
 }
 
+int iothread_perform_impl(void_function_t &&func, void_function_t &&completion) {
+    ASSERT_IS_MAIN_THREAD();
+    ASSERT_IS_NOT_FORKED_CHILD();
+    iothread_init();
+    return iothread_enqueue(spawn_request_t(std::move(func), std::move(completion)));
+}
+
+void iothread_perform_all(std::vector<void_function_t> &&funcs) {
+    ASSERT_IS_NOT_FORKED_CHILD();
+    if (funcs.empty()) return;
+
+    // The functions are handed out in order to whichever thread asks next. The calling thread
+    // participates too, so every function gets run even if no background thread ever becomes
+    // available; this also makes it safe to call from a background thread.
+    struct group_t {
+        std::mutex lock;
+        std::condition_variable cond;
+        std::vector<void_function_t> funcs;
+        size_t next = 0;
+        size_t outstanding;
+
+        explicit group_t(std::vector<void_function_t> &&f)
+            : funcs(std::move(f)), outstanding(funcs.size()) {}
+
+        // Run the next function, returning false if there are none left to start.
+        bool run_one() {
+            void_function_t func;
+            {
+                std::lock_guard<std::mutex> locker(lock);
+                if (next == funcs.size()) return false;
+                func = std::move(funcs[next++]);
+            }
+            func();
+            std::lock_guard<std::mutex> locker(lock);
+            if (--outstanding == 0) cond.notify_all();
+            return true;
+        }
+    };
+    auto group = std::make_shared<group_t>(std::move(funcs));
+
+    // One function is reserved for the calling thread. Helpers that find nothing left to do simply
+    // return.
+    for (size_t i = 1; i < group->funcs.size(); i++) {
+        iothread_enqueue(spawn_request_t([group]() { while (group->run_one()) continue; }, {}));
+    }
+    while (group->run_one()) continue;
+
+    std::unique_lock<std::mutex> locker(group->lock);
+    while (group->outstanding > 0) {
+        group->cond.wait(locker);
+    }
+}
+
 int iothread_port() {
     iothread_init();
     return s_read_pipe;
@@ -2,8 +2,11 @@
 #ifndef FISH_IOTHREAD_H
 #define FISH_IOTHREAD_H
 
+#include <pthread.h>
+
 #include <functional>
 #include <type_traits>
+#include <vector>
 
 /// Runs a command on a thread.
 ///
@@ -27,6 +30,10 @@ void iothread_service_completion(void);
 /// Waits for all iothreads to terminate.
 void iothread_drain_all(void);
 
+/// Creates a joinable pthread running func(param), with all signals blocked so that signals are
+/// only ever delivered to the main thread. Returns false on failure.
+bool make_pthread(pthread_t *result, void *(*func)(void *), void *param);
+
 // Internal implementation
 int iothread_perform_impl(std::function<void(void)> &&func, std::function<void(void)> &&completion);
 
@@ -72,6 +79,11 @@ inline int iothread_perform(std::function<void(void)> &&func) {
     return iothread_perform_impl(std::move(func), std::function<void(void)>());
 }
 
+/// Performs each of the given functions, spreading them across background threads and the calling
+/// thread, and returns once all of them have completed. Functions are started in order. Unlike
+/// iothread_perform, this may be called from any thread.
+void iothread_perform_all(std::vector<std::function<void(void)>> &&funcs);
+
 /// Performs a function on the main thread, blocking until it completes.
 void iothread_perform_on_main(std::function<void(void)> &&func);
 
@@ -495,8 +495,8 @@ parse_execution_result_t parse_execution_context_t::run_switch_statement(
         if (case_result == parse_execution_success) {
             for (const wcstring &arg : case_args) {
                 // Unescape wildcards so they can be expanded again.
-                wcstring unescaped_arg = parse_util_unescape_wildcards(arg);
-                bool match = wildcard_match(switch_value_expanded, unescaped_arg);
+                const wildcard_pattern_t pattern(parse_util_unescape_wildcards(arg));
+                bool match = pattern.match(switch_value_expanded);
 
                 // If this matched, we're done.
                 if (match) {
@@ -817,16 +817,15 @@ parse_execution_result_t parse_execution_context_t::expand_arguments_from_nodes(
     // Get all argument nodes underneath the statement. We guess we'll have that many arguments (but
     // may have more or fewer, if there are wildcards involved).
     out_arguments->reserve(out_arguments->size() + argument_nodes.size());
-    std::vector<completion_t> arg_expanded;
     for (const auto arg_node : argument_nodes) {
         // Expect all arguments to have source.
         assert(arg_node.has_source());
         const wcstring arg_str = arg_node.get_source(pstree->src);
 
-        // Expand this string.
+        // Expand this string, appending the results directly to our arguments. This is called very
+        // frequently, so it uses the variant of expand_string that doesn't build completions.
         parse_error_list_t errors;
-        arg_expanded.clear();
-        int expand_ret = expand_string(arg_str, &arg_expanded, EXPAND_NO_DESCRIPTIONS, &errors);
+        int expand_ret = expand_string(arg_str, out_arguments, EXPAND_NO_DESCRIPTIONS, &errors);
         parse_error_offset_source_start(&errors, arg_node.source_range()->start);
         switch (expand_ret) {
             case EXPAND_ERROR: {
@@ -850,13 +849,6 @@ parse_execution_result_t parse_execution_context_t::expand_arguments_from_nodes(
                 break;
             }
         }
-
-        // Now copy over any expanded arguments. Use std::move() to avoid extra allocations; this
-        // is called very frequently.
-        out_arguments->reserve(out_arguments->size() + arg_expanded.size());
-        for (completion_t &new_arg : arg_expanded) {
-            out_arguments->push_back(std::move(new_arg.completion));
-        }
     }
 
     return parse_execution_success;
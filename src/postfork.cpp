@@ -366,6 +366,16 @@ bool fork_actions_make_spawn_properties(posix_spawnattr_t *attr,
     sigemptyset(&sigmask);
     if (!err && reset_sigmask) err = posix_spawnattr_setsigmask(attr, &sigmask);
 
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
+    // If the job is going to the foreground, have the child take the terminal for its new process
+    // group before it execs, just as a forked child would. This must precede the redirections, so
+    // that stdin is still the terminal.
+    if (!err && should_set_process_group_id && j->get_flag(JOB_TERMINAL) &&
+        j->get_flag(JOB_FOREGROUND)) {
+        err = posix_spawn_file_actions_addtcsetpgrp_np(actions, STDIN_FILENO);
+    }
+#endif
+
     for (size_t idx = 0; idx < io_chain.size(); idx++) {
         const shared_ptr<const io_data_t> io = io_chain.at(idx);
 
@@ -405,7 +415,10 @@ bool fork_actions_make_spawn_properties(posix_spawnattr_t *attr,
                 if (!err) err = posix_spawn_file_actions_adddup2(actions, from_fd, to_fd);
 
                 if (write_pipe_idx > 0) {
-                    if (!err) err = posix_spawn_file_actions_addclose(actions, io_pipe->pipe_fd[0]);
+                    // A buffer's read end may belong to its fill thread, in which case it is -1
+                    // here. It is close-on-exec anyway.
+                    if (!err && io_pipe->pipe_fd[0] >= 0)
+                        err = posix_spawn_file_actions_addclose(actions, io_pipe->pipe_fd[0]);
                     if (!err) err = posix_spawn_file_actions_addclose(actions, io_pipe->pipe_fd[1]);
                 } else {
                     if (!err) err = posix_spawn_file_actions_addclose(actions, io_pipe->pipe_fd[0]);
@@ -129,7 +129,40 @@ static event_t event(0);
 /// proc_pop_interactive.
 static std::vector<int> interactive_stack;
 
-void proc_init() { proc_push_interactive(0); }
+/// A pipe which the SIGCHLD handler writes a byte to, so that waiting for a job's output can also
+/// wait for its processes to change state. Both ends are non-blocking and close-on-exec. These are
+/// -1 until proc_init() creates the pipe, and are never closed afterwards.
+static int s_sigchld_pipe[2] = {-1, -1};
+
+/// Create the SIGCHLD notification pipe. Without it we fall back to polling.
+static void sigchld_pipe_init() {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        wperror(L"pipe");
+        return;
+    }
+    for (int fd : fds) {
+        set_cloexec(fd);
+        make_fd_nonblocking(fd);
+    }
+    // The signal handler only looks at the write end, so publish it last.
+    s_sigchld_pipe[0] = fds[0];
+    s_sigchld_pipe[1] = fds[1];
+}
+
+/// Discard any pending SIGCHLD notifications. The SIGCHLD generation count, not the pipe, records
+/// whether there are children to reap.
+static void sigchld_pipe_drain() {
+    char buff[64];
+    while (read(s_sigchld_pipe[0], buff, sizeof buff) > 0) {
+        ;  // keep reading
+    }
+}
+
+void proc_init() {
+    proc_push_interactive(0);
+    sigchld_pipe_init();
+}
 
 /// Remove job from list of jobs.
 static int job_remove(job_t *j) {
@@ -441,6 +474,17 @@ void job_handle_signal(int signal, siginfo_t *info, void *context) {
     UNUSED(context);
     // This is the only place that this generation count is modified. It's OK if it overflows.
     s_sigchld_generation_cnt += 1;
+
+    // Wake up anyone waiting in select_try(). If the pipe is full there is already a wakeup
+    // pending, so a failed write is fine.
+    int notify_fd = s_sigchld_pipe[1];
+    if (notify_fd >= 0) {
+        int saved_errno = errno;
+        char c = 0;
+        ssize_t ignored = write(notify_fd, &c, 1);
+        UNUSED(ignored);
+        errno = saved_errno;
+    }
 }
 
 /// Given a command like "cat file", truncate it to a reasonable length.
@@ -703,11 +747,15 @@ void proc_update_jiffies() {
 
 #endif
 
-/// Check if there are buffers associated with the job, and select on them for a while if available.
+/// Check if there are buffers associated with the job which we must read ourselves, and if so wait
+/// until one of them has data or a child process changes state. This waits on the buffers together
+/// with the SIGCHLD notification pipe, so no time is lost polling. Buffers that have their own fill
+/// thread are skipped.
 ///
 /// \param j the job to test
 ///
-/// \return 1 if buffers were available, zero otherwise
+/// \return 1 if buffers were available, 0 if we were woken for some other reason (a child changed
+/// state, or a signal arrived), and -1 if the job has no buffers to read.
 static int select_try(job_t *j) {
     fd_set fds;
     int maxfd = -1;
@@ -720,6 +768,8 @@ static int select_try(job_t *j) {
         if (io->io_mode == IO_BUFFER) {
             const io_pipe_t *io_pipe = static_cast<const io_pipe_t *>(io);
             int fd = io_pipe->pipe_fd[0];
+            // Buffers with a fill thread drain themselves, and have no read end here.
+            if (fd < 0) continue;
             // fwprintf( stderr, L"fd %d on job %ls\n", fd, j->command );
             FD_SET(fd, &fds);
             maxfd = maxi(maxfd, fd);
@@ -728,15 +778,27 @@ static int select_try(job_t *j) {
     }
 
     if (maxfd >= 0) {
+        const int notify_fd = s_sigchld_pipe[0];
         int retval;
-        struct timeval tv;
-
-        tv.tv_sec = 0;
-        tv.tv_usec = 10000;
-
-        retval = select(maxfd + 1, &fds, 0, 0, &tv);
+        if (notify_fd >= 0) {
+            // Any SIGCHLD which arrives after our caller last reaped children has left a byte in
+            // the pipe, so we cannot miss one by blocking here.
+            FD_SET(notify_fd, &fds);
+            retval = select(maxi(maxfd, notify_fd) + 1, &fds, 0, 0, NULL);
+            if (retval > 0 && FD_ISSET(notify_fd, &fds)) {
+                sigchld_pipe_drain();
+                FD_CLR(notify_fd, &fds);
+                retval -= 1;
+            }
+        } else {
+            // No notification pipe, so poll for child state changes.
+            struct timeval tv;
+            tv.tv_sec = 0;
+            tv.tv_usec = 10000;
+            retval = select(maxfd + 1, &fds, 0, 0, &tv);
+        }
         if (retval == 0) {
-            debug(3, L"select_try hit timeout");
+            debug(3, L"select_try woke without buffer data");
         }
         return retval > 0;
     }
@@ -759,7 +821,8 @@ static void read_try(job_t *j) {
         }
     }
 
-    if (buff) {
+    // Buffers with a fill thread drain themselves.
+    if (buff && buff->pipe_fd[0] >= 0) {
         debug(3, L"proc::read_try('%ls')", j->command_wcstr());
         while (1) {
             char b[BUFFER_SIZE];
@@ -135,6 +135,14 @@ static unsigned int read_generation_count() {
     return s_generation_count.load(std::memory_order_relaxed);
 }
 
+/// Whether an autosuggestion is being computed on a background thread. We only ever run one at a
+/// time, so that fast typing does not pile up stale requests in the thread pool.
+static bool s_autosuggestion_in_flight = false;
+
+/// Whether the autosuggestion was invalidated while one was in flight. Any number of keystrokes are
+/// coalesced into a single new request, made once the in-flight one completes.
+static bool s_autosuggestion_pending = false;
+
 static void set_command_line_and_position(editable_line_t *el, const wcstring &new_str, size_t pos);
 
 void editable_line_t::insert_string(const wcstring &str, size_t start, size_t len) {
@@ -1135,9 +1143,14 @@ static std::function<autosuggestion_result_t(void)> get_autosuggestion_performer
     return [=]() -> autosuggestion_result_t {
         ASSERT_IS_BACKGROUND_THREAD();
 
+        // Our result is unwanted once the command line has changed.
+        const cancel_checker_t cancel = [generation_count] {
+            return generation_count != read_generation_count();
+        };
+
         const autosuggestion_result_t nothing = {};
         // If the main thread has moved on, skip all the work.
-        if (generation_count != read_generation_count()) {
+        if (cancel()) {
             return nothing;
         }
 
@@ -1150,8 +1163,8 @@ static std::function<autosuggestion_result_t(void)> get_autosuggestion_performer
         }
 
         history_search_t searcher(*history, search_string, HISTORY_SEARCH_TYPE_PREFIX);
-        while (!reader_thread_job_is_stale() && searcher.go_backwards()) {
-            history_item_t item = searcher.current_item();
+        while (!cancel() && searcher.go_backwards()) {
+            const history_item_t &item = searcher.current_item();
 
             // Skip items with newlines because they make terrible autosuggestions.
             if (item.str().find('\n') != wcstring::npos) continue;
@@ -1163,7 +1176,7 @@ static std::function<autosuggestion_result_t(void)> get_autosuggestion_performer
         }
 
         // Maybe cancel here.
-        if (reader_thread_job_is_stale()) return nothing;
+        if (cancel()) return nothing;
 
         // Here we do something a little funny. If the line ends with a space, and the cursor is not
         // at the end, don't use completion autosuggestions. It ends up being pretty weird seeing
@@ -1177,7 +1190,8 @@ static std::function<autosuggestion_result_t(void)> get_autosuggestion_performer
 
         // Try normal completions.
         std::vector<completion_t> completions;
-        complete(search_string, &completions, COMPLETION_REQUEST_AUTOSUGGESTION);
+        complete(search_string, &completions, COMPLETION_REQUEST_AUTOSUGGESTION, cancel);
+        if (cancel()) return nothing;
         completions_sort_and_prioritize(&completions);
         if (!completions.empty()) {
             const completion_t &comp = completions.at(0);
@@ -1200,8 +1214,21 @@ static bool can_autosuggest() {
            el == &data->command_line && el->text.find_first_not_of(whitespace) != wcstring::npos;
 }
 
+static void update_autosuggestion();
+
 // Called after an autosuggestion has been computed on a background thread
 static void autosuggest_completed(autosuggestion_result_t result) {
+    ASSERT_IS_MAIN_THREAD();
+    assert(s_autosuggestion_in_flight);
+    s_autosuggestion_in_flight = false;
+    if (s_autosuggestion_pending) {
+        // The command line changed while we were busy, so this result is stale. Start over with
+        // whatever it is now.
+        s_autosuggestion_pending = false;
+        update_autosuggestion();
+        return;
+    }
+
     if (!result.suggestion.empty() && can_autosuggest() &&
         result.search_string == data->command_line.text &&
         string_prefixes_string_case_insensitive(result.search_string, result.suggestion)) {
@@ -1218,8 +1245,14 @@ static void update_autosuggestion() {
     data->autosuggestion.clear();
     if (data->allow_autosuggestion && !data->suppress_autosuggestion &&
         !data->command_line.empty() && data->history_search.is_at_end()) {
+        if (s_autosuggestion_in_flight) {
+            // Wait for the current request to finish; it will notice it is stale and try again.
+            s_autosuggestion_pending = true;
+            return;
+        }
         const editable_line_t *el = data->active_edit_line();
         auto performer = get_autosuggestion_performer(el->text, el->position, data->history);
+        s_autosuggestion_in_flight = true;
         iothread_perform(performer, &autosuggest_completed);
     }
 }
@@ -2560,7 +2593,7 @@ const wchar_t *reader_readline(int nchars) {
                     complete_flags_t complete_flags = COMPLETION_REQUEST_DEFAULT |
                                                       COMPLETION_REQUEST_DESCRIPTIONS |
                                                       COMPLETION_REQUEST_FUZZY_MATCH;
-                    data->complete_func(buffcpy, &comp, complete_flags);
+                    data->complete_func(buffcpy, &comp, complete_flags, cancel_checker_t());
 
                     // Munge our completions.
                     completions_sort_and_prioritize(&comp);
@@ -154,8 +154,10 @@ void reader_pop();
 ///
 /// - The command to be completed as a null terminated array of wchar_t
 /// - An array_list_t in which completions will be inserted.
+/// - The completion request flags.
+/// - A cancellation checker, which may be empty.
 typedef void (*complete_function_t)(const wcstring &, std::vector<completion_t> *,
-                                    completion_request_flags_t);
+                                    completion_request_flags_t, const cancel_checker_t &);
 void reader_set_complete_function(complete_function_t);
 
 /// The type of a highlight function.
@@ -5,20 +5,30 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stddef.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "common.h"
 #include "complete.h"
 #include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "iothread.h"
 #include "reader.h"
 #include "wildcard.h"
 #include "wutil.h"  // IWYU pragma: keep
@@ -326,18 +336,79 @@ bool wildcard_match(const wcstring &str, const wcstring &wc, bool leading_dots_f
     return match != fuzzy_match_none;
 }
 
+static bool is_wildcard_char(wchar_t c) {
+    return c == ANY_CHAR || c == ANY_STRING || c == ANY_STRING_RECURSIVE;
+}
+
+wildcard_pattern_t::wildcard_pattern_t(wcstring w, bool leading_dots)
+    : wc(std::move(w)),
+      leading_dots_fail_to_match(leading_dots),
+      has_wildcards(false),
+      has_any_string(false),
+      min_length(0),
+      prefix_length(0),
+      suffix_length(0) {
+    const size_t len = wc.size();
+    size_t run_start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && !is_wildcard_char(wc[i])) {
+            min_length++;
+            continue;
+        }
+        // We are at a wildcard character or the end, which ends a literal run.
+        if (i == len) {
+            if (has_wildcards) suffix_length = len - run_start;
+        } else {
+            if (!has_wildcards) prefix_length = i;
+            if (has_wildcards && i - run_start > required.size()) {
+                required.assign(wc, run_start, i - run_start);
+            }
+            has_wildcards = true;
+            if (wc[i] == ANY_CHAR) {
+                min_length++;
+            } else {
+                has_any_string = true;
+            }
+        }
+        run_start = i + 1;
+    }
+    if (!has_wildcards) prefix_length = len;
+}
+
+bool wildcard_pattern_t::match(const wcstring &str) const {
+    const size_t len = str.size();
+    if (len < min_length || (!has_any_string && len != min_length)) return false;
+    if (wmemcmp(str.data(), wc.data(), prefix_length) != 0) return false;
+    if (!has_wildcards) return true;
+    if (wmemcmp(str.data() + len - suffix_length, wc.data() + wc.size() - suffix_length,
+                suffix_length) != 0) {
+        return false;
+    }
+    if (!required.empty()) {
+        size_t pos = str.find(required, prefix_length);
+        if (pos == wcstring::npos || pos + required.size() > len - suffix_length) return false;
+    }
+
+    // Run the full matcher on the whole string: it treats the first character specially, so it
+    // can't simply resume after the prefix.
+    return wildcard_match_internal(str.c_str(), wc.c_str(), leading_dots_fail_to_match) !=
+           fuzzy_match_none;
+}
+
 /// Obtain a description string for the file specified by the filename.
 ///
 /// The returned value is a string constant and should not be free'd.
 ///
-/// \param filename The file for which to find a description string
+/// \param dir The directory containing the file
+/// \param name The name of the file within dir
 /// \param lstat_res The result of calling lstat on the file
 /// \param lbuf The struct buf output of calling lstat on the file
 /// \param stat_res The result of calling stat on the file
 /// \param buf The struct buf output of calling stat on the file
 /// \param err The errno value after a failed stat call on the file.
-static wcstring file_get_desc(const wcstring &filename, int lstat_res, const struct stat &lbuf,
-                              int stat_res, const struct stat &buf, int err) {
+static wcstring file_get_desc(const dir_iter_t &dir, const char *name, int lstat_res,
+                              const struct stat &lbuf, int stat_res, const struct stat &buf,
+                              int err) {
     if (lstat_res) {
         return COMPLETE_FILE_DESC;
     }
@@ -347,7 +418,7 @@ static wcstring file_get_desc(const wcstring &filename, int lstat_res, const str
             if (S_ISDIR(buf.st_mode)) {
                 return COMPLETE_DIRECTORY_SYMLINK_DESC;
             }
-            if (buf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH) && waccess(filename, X_OK) == 0) {
+            if (buf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH) && dir.access(name, X_OK) == 0) {
                 // Weird group permissions and other such issues make it non-trivial to find out if
                 // we can actually execute a file using the result from stat. It is much safer to
                 // use the access function, since it tells us exactly what we want to know.
@@ -371,7 +442,7 @@ static wcstring file_get_desc(const wcstring &filename, int lstat_res, const str
         return COMPLETE_SOCKET_DESC;
     } else if (S_ISDIR(buf.st_mode)) {
         return COMPLETE_DIRECTORY_DESC;
-    } else if (buf.st_mode & (S_IXUSR | S_IXGRP | S_IXGRP) && waccess(filename, X_OK) == 0) {
+    } else if (buf.st_mode & (S_IXUSR | S_IXGRP | S_IXGRP) && dir.access(name, X_OK) == 0) {
         // Weird group permissions and other such issues make it non-trivial to find out if we can
         // actually execute a file using the result from stat. It is much safer to use the access
         // function, since it tells us exactly what we want to know.
@@ -383,53 +454,66 @@ static wcstring file_get_desc(const wcstring &filename, int lstat_res, const str
 
 /// Test if the given file is an executable (if EXECUTABLES_ONLY) or directory (if
 /// DIRECTORIES_ONLY). If it matches, call wildcard_complete() with some description that we make
-/// up. Note that the filename came from a readdir() call, so we know it exists.
-static bool wildcard_test_flags_then_complete(const wcstring &filepath, const wcstring &filename,
-                                              const wchar_t *wc, expand_flags_t expand_flags,
+/// up. Note that the entry came from a readdir() call, so we know it exists.
+static bool wildcard_test_flags_then_complete(const dir_iter_t &dir,
+                                              const dir_iter_t::entry_t &entry,
+                                              const wcstring &filename, const wchar_t *wc,
+                                              expand_flags_t expand_flags,
                                               std::vector<completion_t> *out) {
     // Check if it will match before stat().
     if (!wildcard_complete(filename, wc, NULL, NULL, NULL, expand_flags, 0)) {
         return false;
     }
 
+    const bool need_directory = expand_flags & DIRECTORIES_ONLY;
+    const bool executables_only = expand_flags & EXECUTABLES_ONLY;
+    const bool need_description = !(expand_flags & EXPAND_NO_DESCRIPTIONS);
+
     struct stat lstat_buf = {}, stat_buf = {};
     int stat_res = -1;
     int stat_errno = 0;
-    int lstat_res = lwstat(filepath, &lstat_buf);
-    if (lstat_res >= 0) {
-        if (S_ISLNK(lstat_buf.st_mode)) {
-            stat_res = wstat(filepath, &stat_buf);
-
-            if (stat_res < 0) {
-                // In order to differentiate between e.g. rotten symlinks and symlink loops, we also
-                // need to know the error status of wstat.
-                stat_errno = errno;
+    int lstat_res = -1;
+    bool is_directory = false;
+    bool is_executable = false;
+    if (entry.type_known() && !executables_only && !need_description) {
+        // readdir() told us the type, and it's all we need: we only have to know whether this is
+        // a directory.
+        is_directory = entry.is_dir();
+    } else {
+        lstat_res = dir.lstat(entry.name, &lstat_buf);
+        if (lstat_res >= 0) {
+            if (S_ISLNK(lstat_buf.st_mode)) {
+                stat_res = dir.stat(entry.name, &stat_buf);
+
+                if (stat_res < 0) {
+                    // In order to differentiate between e.g. rotten symlinks and symlink loops, we
+                    // also need to know the error status of stat.
+                    stat_errno = errno;
+                }
+            } else {
+                stat_buf = lstat_buf;
+                stat_res = lstat_res;
             }
-        } else {
-            stat_buf = lstat_buf;
-            stat_res = lstat_res;
         }
+        is_directory = stat_res == 0 && S_ISDIR(stat_buf.st_mode);
+        is_executable = stat_res == 0 && S_ISREG(stat_buf.st_mode);
     }
 
-    const long long file_size = stat_res == 0 ? stat_buf.st_size : 0;
-    const bool is_directory = stat_res == 0 && S_ISDIR(stat_buf.st_mode);
-    const bool is_executable = stat_res == 0 && S_ISREG(stat_buf.st_mode);
-
-    const bool need_directory = expand_flags & DIRECTORIES_ONLY;
     if (need_directory && !is_directory) {
         return false;
     }
 
-    const bool executables_only = expand_flags & EXECUTABLES_ONLY;
-    if (executables_only && (!is_executable || waccess(filepath, X_OK) != 0)) {
+    if (executables_only && (!is_executable || dir.access(entry.name, X_OK) != 0)) {
         return false;
     }
 
     // Compute the description.
     wcstring desc;
-    if (!(expand_flags & EXPAND_NO_DESCRIPTIONS)) {
-        desc = file_get_desc(filepath, lstat_res, lstat_buf, stat_res, stat_buf, stat_errno);
+    if (need_description) {
+        desc = file_get_desc(dir, entry.name, lstat_res, lstat_buf, stat_res, stat_buf,
+                             stat_errno);
 
+        const long long file_size = stat_res == 0 ? stat_buf.st_size : 0;
         if (file_size >= 0) {
             if (!desc.empty()) desc.append(L", ");
             desc.append(format_size(file_size));
@@ -445,6 +529,23 @@ static bool wildcard_test_flags_then_complete(const wcstring &filepath, const wc
     return wildcard_complete(filename, wc, desc.c_str(), NULL, out, expand_flags, 0);
 }
 
+/// Cheap test on the raw name of a directory entry, before converting it: names with leading dots
+/// can only match wildcards that start with a literal dot, because wildcards never match hidden
+/// files.
+static bool hidden_name_cannot_match(const char *name, const wcstring &wc) {
+    return name[0] == '.' && (wc.empty() || wc.at(0) != L'.');
+}
+
+/// The number of threads that walk the directory tree for a recursive wildcard, including the
+/// thread that asked for the expansion.
+static const size_t wildcard_walk_thread_count = 8;
+
+/// How often the thread that asked for a parallel expansion checks for cancellation while it waits
+/// for other threads.
+static const std::chrono::milliseconds wildcard_walk_poll_interval(10);
+
+class wildcard_walk_t;
+
 class wildcard_expander_t {
     // The working directory to resolve paths against
     const wcstring working_directory;
@@ -456,6 +557,8 @@ class wildcard_expander_t {
     const expand_flags_t flags;
     // Resolved items get inserted into here. This is transient of course.
     std::vector<completion_t> *resolved_completions;
+    // If set, tells us when to give up. This is transient too.
+    const cancel_checker_t &cancel_checker;
     // Whether we have been interrupted.
     bool did_interrupt;
     // Whether we have successfully added any completions.
@@ -464,37 +567,44 @@ class wildcard_expander_t {
     // This variable is a little suspicious - it should be passed along, not stored here
     // If we ever try to do parallel wildcard expansion we'll have to remove this
     bool has_fuzzy_ancestor;
+    // If set, directories matched by intermediate segments are handed to this walk to be expanded
+    // on some thread, instead of being descended into directly.
+    wildcard_walk_t *walk;
 
     /// We are a trailing slash - expand at the end.
     void expand_trailing_slash(const wcstring &base_dir, const wcstring &prefix);
 
-    /// Given a directory base_dir, which is opened as base_dir_fp, expand an intermediate segment
+    /// Given a directory base_dir, which is opened as dir, expand an intermediate segment
     /// of the wildcard. Treat ANY_STRING_RECURSIVE as ANY_STRING. wc_segment is the wildcard
     /// segment for this directory, wc_remainder is the wildcard for subdirectories,
     /// prefix is the prefix for completions.
-    void expand_intermediate_segment(const wcstring &base_dir, DIR *base_dir_fp,
+    void expand_intermediate_segment(const wcstring &base_dir, dir_iter_t &dir,
                                      const wcstring &wc_segment, const wchar_t *wc_remainder,
                                      const wcstring &prefix);
 
-    /// Given a directory base_dir, which is opened as base_dir_fp, expand an intermediate literal
+    /// Given a directory base_dir, which is opened as dir, expand an intermediate literal
     /// segment. Use a fuzzy matching algorithm.
-    void expand_literal_intermediate_segment_with_fuzz(const wcstring &base_dir, DIR *base_dir_fp,
+    void expand_literal_intermediate_segment_with_fuzz(const wcstring &base_dir, dir_iter_t &dir,
                                                        const wcstring &wc_segment,
                                                        const wchar_t *wc_remainder,
                                                        const wcstring &prefix);
 
-    /// Given a directory base_dir, which is opened as base_dir_fp, expand the last segment of the
+    /// Given a directory base_dir, which is opened as dir, expand the last segment of the
     /// wildcard. Treat ANY_STRING_RECURSIVE as ANY_STRING. wc is the wildcard segment to use for
     /// matching, wc_remainder is the wildcard for subdirectories, prefix is the prefix for
     /// completions.
-    void expand_last_segment(const wcstring &base_dir, DIR *base_dir_fp, const wcstring &wc,
+    void expand_last_segment(const wcstring &base_dir, dir_iter_t &dir, const wcstring &wc,
                              const wcstring &prefix);
 
     /// Indicate whether we should cancel wildcard expansion. This latches 'interrupt'.
     bool interrupted() {
         if (!did_interrupt) {
-            did_interrupt =
-                (is_main_thread() ? reader_interrupted() : reader_thread_job_is_stale());
+            if (cancel_checker) {
+                did_interrupt = cancel_checker();
+            } else {
+                did_interrupt =
+                    (is_main_thread() ? reader_interrupted() : reader_thread_job_is_stale());
+            }
         }
         return did_interrupt;
     }
@@ -509,31 +619,28 @@ class wildcard_expander_t {
         }
     }
 
-    // Given a start point as an absolute path, for any directory that has exactly one non-hidden
-    // entity in it which is itself a directory, return that. The result is a relative path. For
-    // example, if start_point is '/usr' we may return 'local/bin/'.
+    // Given a start point as a directory within parent, for any directory that has exactly one
+    // non-hidden entity in it which is itself a directory, return that. The result is a relative
+    // path. For example, if start_point is 'usr' in '/' we may return 'local/bin/'.
     //
     // The result does not have a leading slash, but does have a trailing slash if non-empty.
-    wcstring descend_unique_hierarchy(const wcstring &start_point) {
-        assert(!start_point.empty() && start_point.at(0) == L'/');
-
+    wcstring descend_unique_hierarchy(const dir_iter_t &parent, const char *start_point) {
         wcstring unique_hierarchy;
-        wcstring abs_unique_hierarchy = start_point;
 
+        // Each directory is opened relative to the one above it, so we never resolve full paths.
+        std::unique_ptr<dir_iter_t> dir = make_unique<dir_iter_t>(parent, start_point);
         bool stop_descent = false;
-        DIR *dir;
-        while (!stop_descent && (dir = wopendir(abs_unique_hierarchy))) {
+        while (!stop_descent && dir->valid()) {
             // We keep track of the single unique_entry entry. If we get more than one, it's not
             // unique and we stop the descent.
-            wcstring unique_entry;
+            std::string unique_entry;
 
-            bool child_is_dir;
-            wcstring child_entry;
-            while (wreaddir_resolving(dir, abs_unique_hierarchy, child_entry, &child_is_dir)) {
-                if (child_entry.empty() || child_entry.at(0) == L'.') {
+            while (const dir_iter_t::entry_t *entry = dir->next()) {
+                if (entry->name[0] == '.') {
                     continue;  // either hidden, or . and .. entries -- skip them
-                } else if (child_is_dir && unique_entry.empty()) {
-                    unique_entry = child_entry;  // first candidate
+                }
+                if (dir->entry_is_dir(*entry) && unique_entry.empty()) {
+                    unique_entry = entry->name;  // first candidate
                 } else {
                     // We either have two or more candidates, or the child is not a directory. We're
                     // done.
@@ -549,27 +656,23 @@ class wildcard_expander_t {
 
             if (!stop_descent) {
                 // We have an entry in the unique hierarchy!
-                append_path_component(unique_hierarchy, unique_entry);
+                append_path_component(unique_hierarchy, str2wcstring(unique_entry));
                 unique_hierarchy.push_back(L'/');
 
-                append_path_component(abs_unique_hierarchy, unique_entry);
-                abs_unique_hierarchy.push_back(L'/');
+                dir = make_unique<dir_iter_t>(*dir, unique_entry.c_str());
             }
-            closedir(dir);
         }
         return unique_hierarchy;
     }
 
-    void try_add_completion_result(const wcstring &filepath, const wcstring &filename,
-                                   const wcstring &wildcard, const wcstring &prefix) {
+    void try_add_completion_result(const dir_iter_t &dir, const dir_iter_t::entry_t &entry,
+                                   const wcstring &filename, const wcstring &wildcard,
+                                   const wcstring &prefix) {
         // This function is only for the completions case.
         assert(this->flags & EXPAND_FOR_COMPLETIONS);
 
-        wcstring abs_path = this->working_directory;
-        append_path_component(abs_path, filepath);
-
         size_t before = this->resolved_completions->size();
-        if (wildcard_test_flags_then_complete(abs_path, filename, wildcard.c_str(), this->flags,
+        if (wildcard_test_flags_then_complete(dir, entry, filename, wildcard.c_str(), this->flags,
                                               this->resolved_completions)) {
             // Hack. We added this completion result based on the last component of the wildcard.
             // Prepend our prefix to each wildcard that replaces its token.
@@ -590,7 +693,7 @@ class wildcard_expander_t {
             // Only descend deepest unique for cd autosuggest and not for cd tab completion
             // (issue #4402).
             if (flags & EXPAND_SPECIAL_FOR_CD_AUTOSUGGEST) {
-                wcstring unique_hierarchy = this->descend_unique_hierarchy(abs_path);
+                wcstring unique_hierarchy = this->descend_unique_hierarchy(dir, entry.name);
                 if (!unique_hierarchy.empty()) {
                     for (size_t i = before; i < after; i++) {
                         completion_t &c = this->resolved_completions->at(i);
@@ -603,21 +706,31 @@ class wildcard_expander_t {
         }
     }
 
+    // Hand a directory to our walk, along with the directories above it, for symlink loop
+    // detection.
+    void add_to_walk(const wcstring &base_dir, const wchar_t *wc);
+
+    // Expand directories from the walk until it is finished.
+    void run_walk_worker(wildcard_walk_t *walk, bool is_caller);
+
     // Helper to resolve using our prefix.
-    DIR *open_dir(const wcstring &base_dir) const {
+    wcstring resolve_dir(const wcstring &base_dir) const {
         wcstring path = this->working_directory;
         append_path_component(path, base_dir);
-        return wopendir(path);
+        return path;
     }
 
    public:
-    wildcard_expander_t(wcstring wd, expand_flags_t f, std::vector<completion_t> *r)
+    wildcard_expander_t(wcstring wd, expand_flags_t f, std::vector<completion_t> *r,
+                        const cancel_checker_t &cancel)
         : working_directory(std::move(wd)),
           flags(f),
           resolved_completions(r),
+          cancel_checker(cancel),
           did_interrupt(false),
           did_add(false),
-          has_fuzzy_ancestor(false) {
+          has_fuzzy_ancestor(false),
+          walk(NULL) {
         assert(resolved_completions != NULL);
 
         // Insert initial completions into our set to avoid duplicates.
@@ -630,6 +743,11 @@ class wildcard_expander_t {
     // Do wildcard expansion. This is recursive.
     void expand(const wcstring &base_dir, const wchar_t *wc, const wcstring &prefix);
 
+    // Do wildcard expansion, spreading the directories to visit across threads. This is only for
+    // the non-completions case, where the results are sorted afterwards and so may be found in any
+    // order.
+    void expand_in_parallel(const wcstring &base_dir, const wchar_t *wc);
+
     int status_code() const {
         if (this->did_interrupt) {
             return -1;
@@ -651,34 +769,38 @@ void wildcard_expander_t::expand_trailing_slash(const wcstring &base_dir, const
         }
     } else {
         // Trailing slashes and accepting incomplete, e.g. `echo /xyz/<tab>`. Everything is added.
-        DIR *dir = open_dir(base_dir);
-        if (dir) {
-            wcstring next;
-            while (wreaddir(dir, next) && !interrupted()) {
-                if (!next.empty() && next.at(0) != L'.') {
-                    this->try_add_completion_result(base_dir + next, next, L"", prefix);
+        dir_iter_t dir(resolve_dir(base_dir), true /* cached */);
+        if (dir.valid()) {
+            const dir_iter_t::entry_t *entry;
+            while ((entry = dir.next()) && !interrupted()) {
+                if (entry->name[0] != '.') {
+                    this->try_add_completion_result(dir, *entry, str2wcstring(entry->name), L"",
+                                                    prefix);
                 }
             }
-            closedir(dir);
         }
     }
 }
 
-void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir, DIR *base_dir_fp,
+void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir, dir_iter_t &dir,
                                                       const wcstring &wc_segment,
                                                       const wchar_t *wc_remainder,
                                                       const wcstring &prefix) {
-    wcstring name_str;
-    while (!interrupted() && wreaddir_for_dirs(base_dir_fp, &name_str)) {
-        // Note that it's critical we ignore leading dots here, else we may descend into . and ..
-        if (!wildcard_match(name_str, wc_segment, true)) {
+    // Note that it's critical we ignore leading dots here, else we may descend into . and ..
+    const wildcard_pattern_t pattern(wc_segment, true);
+    const dir_iter_t::entry_t *entry;
+    while (!interrupted() && (entry = dir.next())) {
+        // Only directories can match an intermediate segment.
+        if (!entry->maybe_dir() || hidden_name_cannot_match(entry->name, wc_segment)) continue;
+
+        const wcstring name_str = str2wcstring(entry->name);
+        if (!pattern.match(name_str)) {
             // Doesn't match the wildcard for this segment, skip it.
             continue;
         }
 
-        wcstring full_path = base_dir + name_str;
         struct stat buf;
-        if (0 != wstat(full_path, &buf) || !S_ISDIR(buf.st_mode)) {
+        if (0 != dir.stat(entry->name, &buf) || !S_ISDIR(buf.st_mode)) {
             // We either can't stat it, or we did but it's not a directory.
             continue;
         }
@@ -691,8 +813,13 @@ void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir,
 
         // We made it through. Perform normal wildcard expansion on this new directory, starting at
         // our tail_wc, which includes the ANY_STRING_RECURSIVE guy.
+        wcstring full_path = base_dir + name_str;
         full_path.push_back(L'/');
-        this->expand(full_path, wc_remainder, prefix + wc_segment + L'/');
+        if (this->walk) {
+            this->add_to_walk(full_path, wc_remainder);
+        } else {
+            this->expand(full_path, wc_remainder, prefix + wc_segment + L'/');
+        }
 
         // Now remove the visited file. This is for #2414: only directories "beneath" us should be
         // considered visited.
@@ -701,21 +828,21 @@ void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir,
 }
 
 void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wcstring &base_dir,
-                                                                        DIR *base_dir_fp,
+                                                                        dir_iter_t &dir,
                                                                         const wcstring &wc_segment,
                                                                         const wchar_t *wc_remainder,
                                                                         const wcstring &prefix) {
     // This only works with tab completions. Ordinary wildcard expansion should never go fuzzy.
-    wcstring name_str;
-
     // Mark that we are fuzzy for the duration of this function
     const scoped_push<bool> scoped_fuzzy(&this->has_fuzzy_ancestor, true);
 
-    while (!interrupted() && wreaddir_for_dirs(base_dir_fp, &name_str)) {
-        // Don't bother with . and ..
-        if (name_str == L"." || name_str == L"..") {
+    const dir_iter_t::entry_t *entry;
+    while (!interrupted() && (entry = dir.next())) {
+        // Don't bother with . and .., or things that can't be directories.
+        if (!entry->maybe_dir() || !strcmp(entry->name, ".") || !strcmp(entry->name, "..")) {
             continue;
         }
+        const wcstring name_str = str2wcstring(entry->name);
 
         // Skip cases that don't match or match exactly. The match-exactly case was handled directly
         // in expand().
@@ -727,7 +854,7 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
         wcstring new_full_path = base_dir + name_str;
         new_full_path.push_back(L'/');
         struct stat buf;
-        if (0 != wstat(new_full_path, &buf) || !S_ISDIR(buf.st_mode)) {
+        if (0 != dir.stat(entry->name, &buf) || !S_ISDIR(buf.st_mode)) {
             /* We either can't stat it, or we did but it's not a directory */
             continue;
         }
@@ -762,21 +889,141 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
     }
 }
 
-void wildcard_expander_t::expand_last_segment(const wcstring &base_dir, DIR *base_dir_fp,
+void wildcard_expander_t::expand_last_segment(const wcstring &base_dir, dir_iter_t &dir,
                                               const wcstring &wc, const wcstring &prefix) {
-    wcstring name_str;
-    while (wreaddir(base_dir_fp, name_str)) {
+    const wildcard_pattern_t pattern(wc, true /* skip files with leading dots */);
+    while (const dir_iter_t::entry_t *entry = dir.next()) {
         if (flags & EXPAND_FOR_COMPLETIONS) {
-            this->try_add_completion_result(base_dir + name_str, name_str, wc, prefix);
-        } else {
+            this->try_add_completion_result(dir, *entry, str2wcstring(entry->name), wc, prefix);
+        } else if (!hidden_name_cannot_match(entry->name, wc)) {
             // Normal wildcard expansion, not for completions.
-            if (wildcard_match(name_str, wc, true /* skip files with leading dots */)) {
+            const wcstring name_str = str2wcstring(entry->name);
+            if (pattern.match(name_str)) {
                 this->add_expansion_result(base_dir + name_str);
             }
         }
     }
 }
 
+/// The directories left to visit for a recursive wildcard, which any number of threads take from
+/// and add to.
+class wildcard_walk_t {
+   public:
+    struct task_t {
+        wcstring base_dir;
+        const wchar_t *wc;
+        std::vector<file_id_t> ancestors;
+    };
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<task_t> tasks;
+    // Tasks that have been added but not yet finished, including those being worked on.
+    size_t unfinished = 0;
+    // Set when the expansion is cancelled, to tell every thread to stop.
+    std::atomic<bool> cancelled{false};
+    // Results from threads that are done.
+    std::vector<completion_t> results;
+
+    void add(task_t &&task) {
+        std::lock_guard<std::mutex> locker(lock);
+        tasks.push_back(std::move(task));
+        unfinished++;
+        cond.notify_one();
+    }
+
+    /// Take the next task, waiting for one if other threads are still working. Returns false once
+    /// the walk is finished or cancelled. If poll is set, call it periodically while waiting.
+    bool take(task_t *task, const std::function<void()> &poll) {
+        std::unique_lock<std::mutex> locker(lock);
+        for (;;) {
+            if (cancelled) return false;
+            if (!tasks.empty()) break;
+            if (unfinished == 0) return false;
+            if (poll) {
+                cond.wait_for(locker, wildcard_walk_poll_interval);
+                locker.unlock();
+                poll();
+                locker.lock();
+            } else {
+                cond.wait(locker);
+            }
+        }
+        *task = std::move(tasks.front());
+        tasks.pop_front();
+        return true;
+    }
+
+    void finish_task() {
+        std::lock_guard<std::mutex> locker(lock);
+        if (--unfinished == 0) cond.notify_all();
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> locker(lock);
+        cancelled = true;
+        cond.notify_all();
+    }
+};
+
+void wildcard_expander_t::add_to_walk(const wcstring &base_dir, const wchar_t *wc) {
+    wildcard_walk_t::task_t task;
+    task.base_dir = base_dir;
+    task.wc = wc;
+    task.ancestors.assign(this->visited_files.begin(), this->visited_files.end());
+    this->walk->add(std::move(task));
+}
+
+void wildcard_expander_t::run_walk_worker(wildcard_walk_t *walk, bool is_caller) {
+    // Only the thread that asked for the expansion may check for cancellation. It tells everyone
+    // else to stop.
+    std::function<void()> poll;
+    if (is_caller) {
+        poll = [&]() {
+            if (this->interrupted()) walk->cancel();
+        };
+    }
+
+    std::vector<completion_t> results;
+    const cancel_checker_t cancelled = [walk]() { return walk->cancelled.load(); };
+    wildcard_expander_t worker(this->working_directory, this->flags, &results, cancelled);
+    worker.walk = walk;
+
+    wildcard_walk_t::task_t task;
+    for (;;) {
+        if (poll) poll();
+        if (!walk->take(&task, poll)) break;
+        worker.visited_files.clear();
+        worker.visited_files.insert(task.ancestors.begin(), task.ancestors.end());
+        worker.expand(task.base_dir, task.wc, wcstring());
+        walk->finish_task();
+    }
+
+    std::lock_guard<std::mutex> locker(walk->lock);
+    std::move(results.begin(), results.end(), std::back_inserter(walk->results));
+}
+
+void wildcard_expander_t::expand_in_parallel(const wcstring &base_dir, const wchar_t *wc) {
+    assert(!(this->flags & EXPAND_FOR_COMPLETIONS));
+    wildcard_walk_t walk;
+    walk.add(wildcard_walk_t::task_t{base_dir, wc, {}});
+
+    const pthread_t caller = pthread_self();
+    std::vector<std::function<void(void)>> workers;
+    for (size_t i = 0; i < wildcard_walk_thread_count; i++) {
+        workers.push_back([&]() { run_walk_worker(&walk, pthread_equal(pthread_self(), caller)); });
+    }
+    iothread_perform_all(std::move(workers));
+
+    if (walk.cancelled) {
+        this->did_interrupt = true;
+        return;
+    }
+    for (const completion_t &result : walk.results) {
+        this->add_expansion_result(result.completion);
+    }
+}
+
 /// The real implementation of wildcard expansion is in this function. Other functions are just
 /// wrappers around this one.
 ///
@@ -842,17 +1089,18 @@ void wildcard_expander_t::expand(const wcstring &base_dir, const wchar_t *wc,
         if (allow_fuzzy && this->resolved_completions->size() == before &&
             waccess(intermediate_dirpath, F_OK) != 0) {
             assert(this->flags & EXPAND_FOR_COMPLETIONS);
-            DIR *base_dir_fd = open_dir(base_dir);
-            if (base_dir_fd != NULL) {
-                this->expand_literal_intermediate_segment_with_fuzz(
-                    base_dir, base_dir_fd, wc_segment, wc_remainder, effective_prefix);
-                closedir(base_dir_fd);
+            dir_iter_t dir(resolve_dir(base_dir), true /* cached */);
+            if (dir.valid()) {
+                this->expand_literal_intermediate_segment_with_fuzz(base_dir, dir, wc_segment,
+                                                                    wc_remainder, effective_prefix);
             }
         }
     } else {
         assert(!wc_segment.empty() && (segment_has_wildcards || is_last_segment));
-        DIR *dir = open_dir(base_dir);
-        if (dir) {
+        // Completions run on every keypress, and so may use cached listings. Expansions for
+        // execution always read the directory.
+        dir_iter_t dir(resolve_dir(base_dir), flags & EXPAND_FOR_COMPLETIONS);
+        if (dir.valid()) {
             if (is_last_segment) {
                 // Last wildcard segment, nonempty wildcard.
                 this->expand_last_segment(base_dir, dir, wc_segment, effective_prefix);
@@ -874,17 +1122,17 @@ void wildcard_expander_t::expand(const wcstring &base_dir, const wchar_t *wc,
                 assert(head_any.at(head_any.size() - 1) == ANY_STRING_RECURSIVE);
                 assert(any_tail[0] == ANY_STRING_RECURSIVE);
 
-                rewinddir(dir);
+                dir.rewind();
                 this->expand_intermediate_segment(base_dir, dir, head_any, any_tail,
                                                   effective_prefix);
             }
-            closedir(dir);
         }
     }
 }
 
 int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory,
-                           expand_flags_t flags, std::vector<completion_t> *output) {
+                           expand_flags_t flags, std::vector<completion_t> *output,
+                           const cancel_checker_t &cancel) {
     assert(output != NULL);
     // Fuzzy matching only if we're doing completions.
     assert((flags & (EXPAND_FUZZY_MATCH | EXPAND_FOR_COMPLETIONS)) != EXPAND_FUZZY_MATCH);
@@ -922,7 +1170,13 @@ int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory
         effective_wc = wc;
     }
 
-    wildcard_expander_t expander(prefix, flags, output);
-    expander.expand(base_dir, effective_wc.c_str(), base_dir);
+    wildcard_expander_t expander(prefix, flags, output, cancel);
+    if (!(flags & EXPAND_FOR_COMPLETIONS) &&
+        effective_wc.find(ANY_STRING_RECURSIVE) != wcstring::npos) {
+        // Recursive wildcards may visit a great many directories, so spread them across threads.
+        expander.expand_in_parallel(base_dir, effective_wc.c_str());
+    } else {
+        expander.expand(base_dir, effective_wc.c_str(), base_dir);
+    }
     return expander.status_code();
 }
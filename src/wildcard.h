@@ -40,10 +40,13 @@ enum {
 /// \param flags flags for the search. Can be any combination of EXPAND_FOR_COMPLETIONS and
 /// EXECUTABLES_ONLY
 /// \param out The list in which to put the output
+/// \param cancel If set, polled during expansion; returning true aborts it. If empty, expansion is
+/// aborted by ^C on the main thread, or by the reader moving on when on a background thread.
 ///
 /// \return 1 if matches where found, 0 otherwise. Return -1 on abort (I.e. ^C was pressed).
 int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory,
-                           expand_flags_t flags, std::vector<completion_t> *out);
+                           expand_flags_t flags, std::vector<completion_t> *out,
+                           const cancel_checker_t &cancel = cancel_checker_t());
 
 /// Test whether the given wildcard matches the string. Does not perform any I/O.
 ///
@@ -56,6 +59,39 @@ int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory
 bool wildcard_match(const wcstring &str, const wcstring &wc,
                     bool leading_dots_fail_to_match = false);
 
+/// A wildcard prepared for matching against many strings. The literal text at either end of the
+/// wildcard, and the longest literal run in between, are extracted up front, so that most strings
+/// which cannot match are rejected by comparing those instead of running the full matcher.
+class wildcard_pattern_t {
+    // The wildcard itself.
+    wcstring wc;
+    // Whether strings with leading dots are hidden files, which only match a literal dot.
+    bool leading_dots_fail_to_match;
+    // Whether the wildcard contains any wildcard characters at all.
+    bool has_wildcards;
+    // Whether the wildcard contains ANY_STRING or ANY_STRING_RECURSIVE, i.e. may match strings of
+    // any length from min_length up.
+    bool has_any_string;
+    // The number of characters any matching string must have.
+    size_t min_length;
+    // The length of the literal text before the first wildcard character.
+    size_t prefix_length;
+    // The length of the literal text after the last wildcard character.
+    size_t suffix_length;
+    // The longest literal run between wildcard characters, which must appear between the prefix
+    // and the suffix.
+    wcstring required;
+
+   public:
+    explicit wildcard_pattern_t(wcstring wc, bool leading_dots_fail_to_match = false);
+
+    /// \return the wildcard.
+    const wcstring &pattern() const { return wc; }
+
+    /// \return true if the wildcard matches the string. This is equivalent to wildcard_match().
+    bool match(const wcstring &str) const;
+};
+
 /// Check if the specified string contains wildcards.
 bool wildcard_has(const wcstring &, bool internal);
 bool wildcard_has(const wchar_t *, bool internal);
@@ -17,11 +17,14 @@
 #include <wchar.h>
 #include <wctype.h>
 
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "lru.h"
 #include "wutil.h"     // IWYU pragma: keep
 
 typedef std::string cstring;
@@ -40,52 +43,6 @@ const file_id_t kInvalidFileID = {(dev_t)-1LL, (ino_t)-1LL, (uint64_t)-1LL, -1,
 /// Map used as cache by wgettext.
 static owning_lock<std::unordered_map<wcstring, wcstring>> wgettext_map;
 
-bool wreaddir_resolving(DIR *dir, const wcstring &dir_path, wcstring &out_name, bool *out_is_dir) {
-    struct dirent d;
-    struct dirent *result = NULL;
-    int retval = readdir_r(dir, &d, &result);
-    if (retval || !result) {
-        out_name = L"";
-        return false;
-    }
-
-    out_name = str2wcstring(d.d_name);
-    if (!out_is_dir) return true;
-
-    // The caller cares if this is a directory, so check.
-    bool is_dir = false;
-    // We may be able to skip stat, if the readdir can tell us the file type directly.
-    bool check_with_stat = true;
-#ifdef HAVE_STRUCT_DIRENT_D_TYPE
-    if (d.d_type == DT_DIR) {
-        // Known directory.
-        is_dir = true;
-        check_with_stat = false;
-    } else if (d.d_type == DT_LNK || d.d_type == DT_UNKNOWN) {
-        // We want to treat symlinks to directories as directories. Use stat to resolve it.
-        check_with_stat = true;
-    } else {
-        // Regular file.
-        is_dir = false;
-        check_with_stat = false;
-    }
-#endif  // HAVE_STRUCT_DIRENT_D_TYPE
-    if (check_with_stat) {
-        // We couldn't determine the file type from the dirent; check by stat'ing it.
-        cstring fullpath = wcs2string(dir_path);
-        fullpath.push_back('/');
-        fullpath.append(d.d_name);
-        struct stat buf;
-        if (stat(fullpath.c_str(), &buf) != 0) {
-            is_dir = false;
-        } else {
-            is_dir = static_cast<bool>(S_ISDIR(buf.st_mode));
-        }
-    }
-    *out_is_dir = is_dir;
-    return true;
-}
-
 bool wreaddir(DIR *dir, wcstring &out_name) {
     // We need to use a union to ensure that the dirent struct is large enough to avoid stomping on
     // the stack. Some platforms incorrectly defined the `d_name[]` member as being one element
@@ -106,36 +63,126 @@ bool wreaddir(DIR *dir, wcstring &out_name) {
     return true;
 }
 
-bool wreaddir_for_dirs(DIR *dir, wcstring *out_name) {
-    struct dirent d;
-    struct dirent *result = NULL;
-    while (!result) {
-        int retval = readdir_r(dir, &d, &result);
-        if (retval || !result) break;
-
-#if HAVE_STRUCT_DIRENT_D_TYPE
-        switch (d.d_type) {
-            case DT_DIR:
-            case DT_LNK:
-            case DT_UNKNOWN: {
-                break;  // these may be directories
-            }
-            default: {
-                break;  // nothing else can
-            }
+/// The entries of a directory, as of when it had the given file ID.
+struct dir_listing_t {
+    file_id_t dir_id;
+    std::vector<std::string> names;
+    std::vector<unsigned char> types;
+};
+
+/// How many directory listings we cache.
+static const size_t dir_listing_cache_size = 64;
+
+/// How recently a directory may have been modified for us to still cache its listing. Timestamps
+/// may be coarse, so a directory that changes again within the same tick would keep its file ID.
+static const time_t dir_listing_min_age = 2;
+
+/// Cache of directory listings, keyed by device and inode.
+class dir_listing_cache_t
+    : public lru_cache_t<dir_listing_cache_t, std::shared_ptr<const dir_listing_t>> {
+   public:
+    dir_listing_cache_t() : lru_cache_t(dir_listing_cache_size) {}
+};
+static owning_lock<dir_listing_cache_t> s_dir_listing_cache;
+
+dir_iter_t::dir_iter_t(const wcstring &path, bool cached)
+    : dir_(NULL), entry_(), listing_pos_(0) {
+    const cstring tmp = wcs2string(path);
+    int fd = open(tmp.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && !(dir_ = fdopendir(fd))) close(fd);
+    if (dir_ && cached) load_listing();
+}
+
+dir_iter_t::dir_iter_t(const dir_iter_t &parent, const char *name)
+    : dir_(NULL), entry_(), listing_pos_(0) {
+    if (!parent.valid()) return;
+    int fd = openat(parent.fd(), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && !(dir_ = fdopendir(fd))) close(fd);
+}
+
+dir_iter_t::~dir_iter_t() {
+    if (dir_) closedir(dir_);
+}
+
+int dir_iter_t::fd() const { return dirfd(dir_); }
+
+void dir_iter_t::load_listing() {
+    struct stat buf;
+    if (fstat(fd(), &buf) != 0) return;
+    const file_id_t dir_id = file_id_t::file_id_from_stat(&buf);
+    const wcstring key = format_string(L"%llu:%llu", (unsigned long long)buf.st_dev,
+                                       (unsigned long long)buf.st_ino);
+    {
+        auto &&cache = s_dir_listing_cache.acquire();
+        std::shared_ptr<const dir_listing_t> *existing = cache.value.get(key);
+        if (existing && (*existing)->dir_id == dir_id) {
+            listing_ = *existing;
+            return;
         }
+    }
+
+    // Note we took the file ID before reading: if the directory changes while we read, the
+    // listing is stored under the old ID and will not be used again.
+    auto listing = std::make_shared<dir_listing_t>();
+    listing->dir_id = dir_id;
+    while (const entry_t *entry = next()) {
+        listing->names.push_back(entry->name);
+        listing->types.push_back(entry->type);
+    }
+    listing_ = listing;
+
+    if (time(NULL) - buf.st_mtime >= dir_listing_min_age) {
+        auto &&cache = s_dir_listing_cache.acquire();
+        cache.value.evict_node(key);
+        cache.value.insert(key, listing);
+    }
+}
+
+const dir_iter_t::entry_t *dir_iter_t::next() {
+    if (listing_) {
+        if (listing_pos_ >= listing_->names.size()) return NULL;
+        entry_.name = listing_->names[listing_pos_].c_str();
+        entry_.type = listing_->types[listing_pos_];
+        listing_pos_++;
+        return &entry_;
+    }
+
+    // readdir() is safe here: each iterator has its own stream, and readdir_r() is deprecated.
+    const struct dirent *d = readdir(dir_);
+    if (!d) return NULL;
+    entry_.name = d->d_name;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+    entry_.type = d->d_type;
 #else
-        // We can't determine if it's a directory or not, so just return it.
-        break;
+    entry_.type = DT_UNKNOWN;
 #endif
-    }
+    return &entry_;
+}
 
-    if (result && out_name) {
-        *out_name = str2wcstring(result->d_name);
+void dir_iter_t::rewind() {
+    if (listing_) {
+        listing_pos_ = 0;
+    } else {
+        rewinddir(dir_);
     }
-    return result != NULL;
 }
 
+bool dir_iter_t::entry_is_dir(const entry_t &entry) const {
+    if (entry.type_known()) return entry.is_dir();
+    struct stat buf;
+    return stat(entry.name, &buf) == 0 && S_ISDIR(buf.st_mode);
+}
+
+int dir_iter_t::stat(const char *name, struct stat *buf) const {
+    return fstatat(fd(), name, buf, 0);
+}
+
+int dir_iter_t::lstat(const char *name, struct stat *buf) const {
+    return fstatat(fd(), name, buf, AT_SYMLINK_NOFOLLOW);
+}
+
+int dir_iter_t::access(const char *name, int mode) const { return faccessat(fd(), name, mode, 0); }
+
 const wcstring wgetcwd() {
     char cwd[PATH_MAX];
     char *res = getcwd(cwd, sizeof(cwd));
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <time.h>
+#include <memory>
 #include <string>
 
 #include "common.h"
@@ -65,14 +66,87 @@ maybe_t<wcstring> wrealpath(const wcstring &pathname);
 
 /// Wide character version of readdir().
 bool wreaddir(DIR *dir, wcstring &out_name);
-bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, wcstring &out_name,
-                        bool *out_is_dir);
-
-/// Like wreaddir, but skip items that are known to not be directories. If this requires a stat
-/// (i.e. the file is a symlink), then return it. Note that this does not guarantee that everything
-/// returned is a directory, it's just an optimization for cases where we would check for
-/// directories anyways.
-bool wreaddir_for_dirs(DIR *dir, wcstring *out_name);
+
+// Not every system reports file types from readdir(). Those that don't are always DT_UNKNOWN.
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_LNK 10
+#endif
+
+struct dir_listing_t;
+
+/// Class for iterating over the entries of a directory without converting their names or building
+/// their paths. Entries report the type that readdir() gave for them, if any, and may be stat'd
+/// relative to the directory's fd. This is for hot loops like wildcard expansion, which look at
+/// every entry of potentially many directories.
+///
+/// Listings may be cached across iterators, which is for interactive uses like completions and
+/// highlighting that look at the same directories on every keypress. A cached listing is only used
+/// while the directory's file ID (which includes its modification and change times) is unchanged.
+class dir_iter_t {
+   public:
+    /// An entry of the directory. This is only valid until the next call to next().
+    struct entry_t {
+        /// The raw name of the entry.
+        const char *name;
+        /// The type of the entry as a DT_* constant, or DT_UNKNOWN if the system didn't tell us.
+        unsigned char type;
+
+        /// \return whether we know the type of this entry without a stat. Symlinks count as
+        /// unknown, since the caller generally wants to know what they point at.
+        bool type_known() const { return type != DT_UNKNOWN && type != DT_LNK; }
+
+        /// \return whether this entry is known to be a directory.
+        bool is_dir() const { return type == DT_DIR; }
+
+        /// \return whether this entry may be a directory, i.e. it is not known to be anything else.
+        bool maybe_dir() const { return !type_known() || is_dir(); }
+    };
+
+    /// Open the directory at the given path. Check valid() for success. If \p cached is set, the
+    /// entries may come from the listing cache instead of being read again.
+    explicit dir_iter_t(const wcstring &path, bool cached = false);
+
+    /// Open the directory named \p name within \p parent, without resolving its full path.
+    dir_iter_t(const dir_iter_t &parent, const char *name);
+
+    ~dir_iter_t();
+
+    dir_iter_t(const dir_iter_t &) = delete;
+    void operator=(const dir_iter_t &) = delete;
+
+    /// \return whether the directory was opened.
+    bool valid() const { return dir_ != NULL; }
+
+    /// \return the next entry, or NULL at the end of the directory or on error.
+    const entry_t *next();
+
+    /// Go back to the first entry.
+    void rewind();
+
+    /// \return the fd of the directory.
+    int fd() const;
+
+    /// \return whether the entry is a directory, following symlinks. This only stats the entry if
+    /// readdir() didn't tell us its type.
+    bool entry_is_dir(const entry_t &entry) const;
+
+    /// Versions of stat(), lstat() and access() for an entry of this directory.
+    int stat(const char *name, struct stat *buf) const;
+    int lstat(const char *name, struct stat *buf) const;
+    int access(const char *name, int mode) const;
+
+   private:
+    // Take the listing from the cache, or read the whole directory into it.
+    void load_listing();
+
+    DIR *dir_;
+    entry_t entry_;
+    // If set, entries come from this listing instead of readdir().
+    std::shared_ptr<const dir_listing_t> listing_;
+    size_t listing_pos_;
+};
 
 /// Wide character version of dirname().
 std::wstring wdirname(const std::wstring &path);